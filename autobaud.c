@@ -0,0 +1,226 @@
+
+/*
+ * Automatic baud rate detection on live traffic. Candidate rates are
+ * tried in turn; for each one a few hundred bytes are collected and
+ * scored on the fly from
+ *
+ *  - framing and parity errors reported by the UART (if supported)
+ *  - the ratio of printable characters
+ *  - the byte value entropy: a wrong rate tends to give either a few
+ *    repeating garbage values, or noise
+ *
+ * Only counters and a byte histogram are kept per candidate, no data is
+ * buffered. A candidate scoring well enough locks immediately, otherwise
+ * the best rate is chosen after a full round.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <termios.h>
+
+#include "mainloop.h"
+#include "serial.h"
+#include "autobaud.h"
+
+#define MAX_RATES     64
+#define SAMPLE_BYTES  256
+#define SAMPLE_MSEC   150
+#define MAX_ROUNDS    3
+#define SCORE_LOCK    0.9
+#define SCORE_MIN     0.5
+
+static int fd_port = -1;
+static int rates[MAX_RATES];
+static int n_rates;
+static int cur;
+static int rounds;
+static int active = 0;
+static void (*done_handler)(int rate, double score);
+
+static double best_score;
+static int best_rate;
+
+static struct {
+	unsigned int hist[256];
+	unsigned int bytes;
+	unsigned int printable;
+	int errors;
+	struct serial_icount ic_start;
+	int have_icount;
+} sample;
+
+static int on_autobaud_timer(void *data);
+
+
+static double entropy(void)
+{
+	double h = 0;
+	int i;
+
+	for(i=0; i<256; i++) {
+		if(sample.hist[i]) {
+			double p = (double)sample.hist[i] / sample.bytes;
+			h -= p * log2(p);
+		}
+	}
+
+	return h;
+}
+
+
+/*
+ * Score between 0 (garbage) and 1 (clean text)
+ */
+
+static double score(void)
+{
+	double s, h;
+
+	if(sample.bytes == 0) return -1;
+
+	s = (double)sample.printable / sample.bytes;
+	s -= 4.0 * sample.errors / sample.bytes;
+
+	h = entropy();
+	if(h > 6.0) s -= (h - 6.0) / 2.0;
+	if(h < 1.5 && sample.bytes > 16) s -= (1.5 - h) / 3.0;
+
+	return s < 0 ? 0 : s;
+}
+
+
+static void update_errors(void)
+{
+	struct serial_icount ic;
+
+	if(sample.have_icount && serial_get_icount(fd_port, &ic) == 0) {
+		sample.errors = (ic.frame - sample.ic_start.frame) +
+		                (ic.parity - sample.ic_start.parity) +
+		                (ic.brk - sample.ic_start.brk);
+	}
+}
+
+
+static void try_rate(void)
+{
+	memset(&sample, 0, sizeof sample);
+
+	serial_set_speed(fd_port, rates[cur]);
+	tcflush(fd_port, TCIFLUSH);
+	mainloop_fd_flush(fd_port);
+	sample.have_icount = serial_get_icount(fd_port, &sample.ic_start) == 0;
+
+	mainloop_timer_add(0, SAMPLE_MSEC, on_autobaud_timer, NULL);
+}
+
+
+static void finish(int rate, double s)
+{
+	active = 0;
+	mainloop_timer_del(on_autobaud_timer, NULL);
+	if(rate > 0) {
+		serial_set_speed(fd_port, rate);
+		tcflush(fd_port, TCIFLUSH);
+		mainloop_fd_flush(fd_port);
+	}
+	if(done_handler) done_handler(rate, s);
+}
+
+
+/*
+ * Done with the current candidate, move on to the next one
+ */
+
+static void next(void)
+{
+	double s;
+
+	update_errors();
+	s = score();
+
+	if(s >= SCORE_LOCK && sample.bytes >= SAMPLE_BYTES / 4) {
+		finish(rates[cur], s);
+		return;
+	}
+
+	if(s > best_score) {
+		best_score = s;
+		best_rate = rates[cur];
+	}
+
+	if(++cur == n_rates) {
+		cur = 0;
+		if(best_score >= SCORE_MIN || ++rounds == MAX_ROUNDS) {
+			finish(best_score >= SCORE_MIN ? best_rate : 0, best_score);
+			return;
+		}
+	}
+
+	try_rate();
+}
+
+
+static int on_autobaud_timer(void *data)
+{
+	if(active) next();
+	return 0;
+}
+
+
+void autobaud_feed(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	if(!active) return;
+
+	for(i=0; i<len; i++) {
+		uint8_t c = buf[i];
+		sample.hist[c] ++;
+		if((c >= 0x20 && c < 0x7f) || c == '\r' || c == '\n' || c == '\t') sample.printable ++;
+	}
+	sample.bytes += len;
+
+	if(sample.bytes >= SAMPLE_BYTES) next();
+}
+
+
+int autobaud_start(int fd, const int *r, int n, void (*done)(int rate, double score))
+{
+	if(n < 1) return -1;
+	if(n > MAX_RATES) n = MAX_RATES;
+
+	memcpy(rates, r, n * sizeof(int));
+	n_rates = n;
+	fd_port = fd;
+	done_handler = done;
+	cur = 0;
+	rounds = 0;
+	best_score = -1;
+	best_rate = 0;
+	active = 1;
+
+	mainloop_handler_name((void *)on_autobaud_timer, "autobaud_timer");
+	try_rate();
+
+	return 0;
+}
+
+
+int autobaud_active(void)
+{
+	return active;
+}
+
+
+void autobaud_stop(void)
+{
+	if(active) {
+		active = 0;
+		mainloop_timer_del(on_autobaud_timer, NULL);
+	}
+}
+
+/*
+ * End
+ */
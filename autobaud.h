@@ -0,0 +1,12 @@
+#ifndef autobaud_h
+#define autobaud_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+int autobaud_start(int fd, const int *rates, int n, void (*done)(int rate, double score));
+void autobaud_feed(const uint8_t *buf, size_t len);
+int autobaud_active(void);
+void autobaud_stop(void);
+
+#endif
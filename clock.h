@@ -0,0 +1,33 @@
+#ifndef clock_h
+#define clock_h
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Time stamps. The monotonic clock is used for intervals and timing,
+ * the real time clock for time stamps stored with the data.
+ */
+
+static inline double mono_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static inline uint64_t mono_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t real_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
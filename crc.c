@@ -0,0 +1,71 @@
+
+/*
+ * Table driven CRC calculation. Both CRCs are reflected, the tables are
+ * generated on first use.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc.h"
+
+static uint16_t crc16_table[256];
+static uint32_t crc32_table[256];
+static int tables_ok = 0;
+
+
+static void make_tables(void)
+{
+	int i, j;
+
+	for(i=0; i<256; i++) {
+		uint16_t c16 = i;
+		uint32_t c32 = i;
+		for(j=0; j<8; j++) {
+			c16 = (c16 & 1) ? (c16 >> 1) ^ 0x8408 : c16 >> 1;
+			c32 = (c32 & 1) ? (c32 >> 1) ^ 0xedb88320 : c32 >> 1;
+		}
+		crc16_table[i] = c16;
+		crc32_table[i] = c32;
+	}
+
+	tables_ok = 1;
+}
+
+
+/*
+ * Running CRC over multiple buffers: start with CRCxx_INIT and invert the
+ * result when done. A buffer followed by its inverted CRC (little endian)
+ * leaves the well known residue 0xf0b8 or 0xdebb20e3.
+ */
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	if(!tables_ok) make_tables();
+	while(len--) crc = (crc >> 8) ^ crc16_table[(crc ^ *buf++) & 0xff];
+	return crc;
+}
+
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	if(!tables_ok) make_tables();
+	while(len--) crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
+	return crc;
+}
+
+
+uint16_t crc16(const uint8_t *buf, size_t len)
+{
+	return crc16_update(CRC16_INIT, buf, len) ^ 0xffff;
+}
+
+
+uint32_t crc32(const uint8_t *buf, size_t len)
+{
+	return crc32_update(CRC32_INIT, buf, len) ^ 0xffffffff;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,18 @@
+#ifndef crc_h
+#define crc_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-16/X.25 as used for HDLC and PPP, and CRC-32/IEEE */
+
+#define CRC16_INIT 0xffff
+#define CRC32_INIT 0xffffffff
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, size_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
+
+uint16_t crc16(const uint8_t *buf, size_t len);
+uint32_t crc32(const uint8_t *buf, size_t len);
+
+#endif
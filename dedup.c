@@ -0,0 +1,269 @@
+/*
+ * Repeated line collapsing. Every completed line is hashed and compared
+ * with the hashes of the last lines written. A line equal to the one k
+ * lines back starts a repeat run with a period of k lines; the run lasts
+ * as long as the following lines keep matching the pattern, and is
+ * replaced by a single marker line with the repeat count and the time of
+ * the first and the last repeat when it ends.
+ *
+ * Complete lines are passed on as pointers into the input buffer. Only
+ * the unfinished last line of a chunk is held back, since it can not be
+ * judged yet; it is released after a short idle time so prompts still
+ * show up. A run that stops without the pattern breaking is ended after
+ * a longer idle time.
+ *
+ * For cycles longer than one line the text of the last lines is kept,
+ * so a run that ends halfway through the pattern can write the lines
+ * that were swallowed from the unfinished cycle.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+
+#include "clock.h"
+#include "mainloop.h"
+#include "dedup.h"
+
+#define HIST_SIZE   (DEDUP_CYCLE_MAX + 1)
+#define HOLD_MSEC   100
+#define IDLE_MSEC   1000
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static int on_dedup_timer(void *data);
+
+
+void dedup_init(struct dedup *d, int cycle, void (*out)(const uint8_t *buf, size_t len, int marker))
+{
+	memset(d, 0, sizeof *d);
+	if(cycle > DEDUP_CYCLE_MAX) cycle = DEDUP_CYCLE_MAX;
+	d->cycle = cycle;
+	d->out = out;
+	d->hash = FNV_OFFSET;
+	mainloop_handler_name((void *)on_dedup_timer, "dedup_timer");
+}
+
+
+static uint64_t hash_update(uint64_t h, const uint8_t *p, size_t n)
+{
+	while(n--) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+
+/*
+ * Line written 'k' lines ago, 1 is the last one
+ */
+
+static struct dedup_line *hist_at(struct dedup *d, unsigned k)
+{
+	return &d->hist[(d->hist_pos + HIST_SIZE - k) % HIST_SIZE];
+}
+
+
+static void hist_push(struct dedup *d, uint64_t hash, int text,
+		const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+	struct dedup_line *l = &d->hist[d->hist_pos];
+
+	l->hash = hash;
+	l->len = 0;
+
+	if(d->cycle > 1 && text && alen + blen <= DEDUP_LINE_MAX) {
+		if(alen) memcpy(l->buf, a, alen);
+		if(blen) memcpy(l->buf + alen, b, blen);
+		l->len = alen + blen;
+	}
+
+	d->hist_pos = (d->hist_pos + 1) % HIST_SIZE;
+	if(d->hist_n < HIST_SIZE) d->hist_n ++;
+}
+
+
+static char *fmt_time(const struct timeval *tv, char *buf, size_t len)
+{
+	char tmp[16];
+	strftime(tmp, sizeof tmp, "%H:%M:%S", localtime(&tv->tv_sec));
+	snprintf(buf, len, "%s.%03d", tmp, (int)(tv->tv_usec / 1000));
+	return buf;
+}
+
+
+static void end_run(struct dedup *d)
+{
+	uint64_t full, rest;
+
+	if(d->period == 0) return;
+
+	full = d->matched / d->period;
+	rest = d->matched % d->period;
+
+	if(full > 0) {
+		char buf[160], t1[32], t2[32];
+		int n;
+		if(d->period == 1) {
+			n = snprintf(buf, sizeof buf, "[last line repeated %llu times, %s - %s]\n",
+					(unsigned long long)full,
+					fmt_time(&d->t_first, t1, sizeof t1), fmt_time(&d->t_last, t2, sizeof t2));
+		} else {
+			n = snprintf(buf, sizeof buf, "[last %u lines repeated %llu times, %s - %s]\n",
+					d->period, (unsigned long long)full,
+					fmt_time(&d->t_first, t1, sizeof t1), fmt_time(&d->t_last, t2, sizeof t2));
+		}
+		d->out((uint8_t *)buf, n, 1);
+		d->lines_collapsed += full * d->period;
+	}
+
+	/* Write the lines of the unfinished cycle; the pattern rotates along */
+
+	while(rest--) {
+		struct dedup_line *l = hist_at(d, d->period);
+		d->out(l->buf, l->len, 0);
+		hist_push(d, l->hash, 1, l->buf, l->len, NULL, 0);
+	}
+
+	d->period = 0;
+	d->matched = 0;
+}
+
+
+/*
+ * A cycle of 'k' lines can only be collapsed if all its lines can be
+ * written again
+ */
+
+static int pattern_ok(struct dedup *d, unsigned k)
+{
+	unsigned i;
+
+	if(k == 1) return 1;
+
+	for(i=1; i<=k; i++) {
+		if(hist_at(d, i)->len == 0) return 0;
+	}
+
+	return 1;
+}
+
+
+static void line_done(struct dedup *d, const uint8_t *buf, size_t len)
+{
+	uint64_t h = d->hash;
+	unsigned k;
+
+	if(d->period) {
+		struct dedup_line *l = hist_at(d, d->period - d->matched % d->period);
+		if(!d->shown && l->hash == h) {
+			d->matched ++;
+			gettimeofday(&d->t_last, NULL);
+			goto out;
+		}
+		end_run(d);
+	}
+
+	if(!d->shown) {
+		for(k=1; k<=d->cycle && k<=d->hist_n; k++) {
+			if(hist_at(d, k)->hash == h && pattern_ok(d, k)) {
+				d->period = k;
+				d->matched = 1;
+				gettimeofday(&d->t_first, NULL);
+				d->t_last = d->t_first;
+				goto out;
+			}
+		}
+	}
+
+	if(d->held) d->out(d->line, d->held, 0);
+	d->out(buf, len, 0);
+	hist_push(d, h, !d->shown, d->line, d->held, buf, len);
+
+out:
+	d->hash = FNV_OFFSET;
+	d->held = 0;
+	d->shown = 0;
+}
+
+
+/*
+ * Write the held part of the current line; the rest of it will be passed
+ * on as it comes
+ */
+
+static void show_held(struct dedup *d)
+{
+	end_run(d);
+	if(d->held) d->out(d->line, d->held, 0);
+	d->held = 0;
+	d->shown = 1;
+}
+
+
+void dedup_feed(struct dedup *d, const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + len;
+	size_t n;
+
+	if(d->cycle == 0) {
+		d->out(buf, len, 0);
+		return;
+	}
+
+	d->t_input = mono_sec();
+
+	for(;;) {
+		const uint8_t *nl = memchr(p, '\n', end - p);
+		if(nl == NULL) break;
+		n = nl + 1 - p;
+		d->hash = hash_update(d->hash, p, n);
+		line_done(d, p, n);
+		p += n;
+	}
+
+	n = end - p;
+
+	if(n > 0) {
+		d->hash = hash_update(d->hash, p, n);
+		if(!d->shown && d->held + n > DEDUP_LINE_MAX) show_held(d);
+		if(d->shown) {
+			d->out(p, n, 0);
+		} else {
+			memcpy(d->line + d->held, p, n);
+			d->held += n;
+		}
+	}
+
+	if((d->held || d->period) && !d->timer) {
+		d->timer = 1;
+		mainloop_timer_add(0, HOLD_MSEC, on_dedup_timer, d);
+	}
+}
+
+
+static int on_dedup_timer(void *data)
+{
+	struct dedup *d = data;
+	double idle = mono_sec() - d->t_input;
+
+	if(d->held && idle >= HOLD_MSEC * 1E-3) show_held(d);
+	if(d->period && idle >= IDLE_MSEC * 1E-3) end_run(d);
+
+	d->timer = d->held || d->period;
+	return d->timer;
+}
+
+
+void dedup_flush(struct dedup *d)
+{
+	end_run(d);
+	if(d->held) show_held(d);
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,51 @@
+#ifndef dedup_h
+#define dedup_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define DEDUP_LINE_MAX  512
+#define DEDUP_CYCLE_MAX 16
+
+struct dedup_line {
+	uint64_t hash;
+	size_t len;             /* 0 when the text is not available */
+	uint8_t buf[DEDUP_LINE_MAX];
+};
+
+struct dedup {
+	int cycle;              /* longest cycle of lines detected, 0 is off */
+	void (*out)(const uint8_t *buf, size_t len, int marker);
+
+	/* line being received */
+
+	uint64_t hash;
+	int shown;
+	size_t held;
+	uint8_t line[DEDUP_LINE_MAX];
+
+	/* last lines written, newest at hist_pos - 1 */
+
+	struct dedup_line hist[DEDUP_CYCLE_MAX + 1];
+	unsigned hist_pos;
+	unsigned hist_n;
+
+	/* repeat run in progress */
+
+	unsigned period;
+	uint64_t matched;
+	struct timeval t_first;
+	struct timeval t_last;
+
+	double t_input;
+	int timer;
+
+	uint64_t lines_collapsed;
+};
+
+void dedup_init(struct dedup *d, int cycle, void (*out)(const uint8_t *buf, size_t len, int marker));
+void dedup_feed(struct dedup *d, const uint8_t *buf, size_t len);
+void dedup_flush(struct dedup *d);
+
+#endif
@@ -0,0 +1,107 @@
+
+/*
+ * Watch for a device node to (re)appear. The directory holding the node is
+ * watched with inotify; if that directory does not exist (yet), as happens
+ * with /dev/serial/by-id when the last adapter is unplugged, its nearest
+ * existing ancestor is watched instead. Any change in the watched
+ * directory calls the handler, which is expected to simply try to open
+ * the device.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "mainloop.h"
+#include "devwatch.h"
+
+static int fd_inotify = -1;
+static int wd = -1;
+static char dev_path[PATH_MAX];
+static void (*dev_handler)(void);
+
+
+/*
+ * Watch the deepest existing directory on the path to the device
+ */
+
+static int add_watch(void)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int w;
+
+	snprintf(dir, sizeof dir, "%s", dev_path);
+
+	while((slash = strrchr(dir, '/')) != NULL) {
+		if(slash == dir) {
+			slash[1] = '\0';
+		} else {
+			slash[0] = '\0';
+		}
+		w = inotify_add_watch(fd_inotify, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+		if(w >= 0) {
+			if(wd >= 0 && wd != w) inotify_rm_watch(fd_inotify, wd);
+			wd = w;
+			return 0;
+		}
+		if(slash == dir) break;
+	}
+
+	return -1;
+}
+
+
+static int on_inotify(int fd, void *data)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	/*
+	 * The events themselves are not interesting, only the fact that
+	 * something changed
+	 */
+
+	while(read(fd, buf, sizeof buf) > 0);
+
+	add_watch();
+	if(dev_handler) dev_handler();
+
+	return 0;
+}
+
+
+int devwatch_start(const char *path, void (*handler)(void))
+{
+	snprintf(dev_path, sizeof dev_path, "%s", path);
+	dev_handler = handler;
+
+	if(fd_inotify < 0) {
+		fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(fd_inotify < 0) return -1;
+	}
+
+	if(add_watch() != 0) return -1;
+
+	mainloop_fd_add(fd_inotify, FD_READ, on_inotify, NULL);
+	mainloop_handler_name((void *)on_inotify, "devwatch");
+
+	return 0;
+}
+
+
+void devwatch_stop(void)
+{
+	if(fd_inotify >= 0) {
+		mainloop_fd_del(fd_inotify, FD_READ, on_inotify, NULL);
+		close(fd_inotify);
+		fd_inotify = -1;
+		wd = -1;
+	}
+	dev_handler = NULL;
+}
+
+/*
+ * End
+ */
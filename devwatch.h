@@ -0,0 +1,7 @@
+#ifndef devwatch_h
+#define devwatch_h
+
+int devwatch_start(const char *path, void (*handler)(void));
+void devwatch_stop(void);
+
+#endif
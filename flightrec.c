@@ -0,0 +1,279 @@
+/*
+ * Flight recorder: a fixed size capture file, memory mapped and written as
+ * a ring. Every chunk becomes a record with a sequence number and a
+ * timestamp, so writing costs a memcpy plus a small header; the kernel
+ * writes the dirty pages back on its own.
+ *
+ * The file is msync'ed from a timer. Data that made it to the page cache
+ * survives a crash of iterm; after a power loss everything up to the last
+ * sync is on disk. The header is only updated at sync time and merely
+ * records how far that was: readers find the records by scanning the
+ * ring for valid record headers with a matching sequence number trailer,
+ * and sort them by sequence number. Only the header fields are covered
+ * by a CRC, to keep the write cost independent of the chunk size.
+ *
+ * A recorder opened on an existing file of the same size continues after
+ * the newest record in it. Existing files that are not recordings are
+ * refused.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "crc.h"
+#include "flightrec.h"
+
+static int fd = -1;
+static uint8_t *map = NULL;
+static uint8_t *data;
+static uint64_t data_size;
+static uint64_t head;
+static uint64_t seq;
+static uint64_t dirty_lo;
+static uint64_t dirty_hi;
+
+
+int flightrec_hdr_ok(const struct flightrec_hdr *h)
+{
+	return memcmp(h->magic, FLIGHTREC_MAGIC, sizeof h->magic) == 0 &&
+	       h->crc == crc32((const uint8_t *)h, offsetof(struct flightrec_hdr, crc));
+}
+
+
+static const struct flightrec_rec *rec_at(const uint8_t *data, uint64_t size, uint64_t off)
+{
+	const struct flightrec_rec *r = (const void *)(data + off);
+	uint64_t trailer;
+
+	if(off + FLIGHTREC_REC_SIZE(0) > size) return NULL;
+	if(r->magic != FLIGHTREC_REC_MAGIC) return NULL;
+	if(r->len > FLIGHTREC_REC_MAX || off + FLIGHTREC_REC_SIZE(r->len) > size) return NULL;
+	if(r->crc != crc32((const uint8_t *)r, offsetof(struct flightrec_rec, crc))) return NULL;
+
+	memcpy(&trailer, data + off + sizeof *r + r->len, sizeof trailer);
+	return trailer == r->seq ? r : NULL;
+}
+
+
+/*
+ * Call 'fn' for every valid record in the ring, in ring order. Returns
+ * the number of records found.
+ */
+
+size_t flightrec_scan(const uint8_t *data, uint64_t size,
+		void (*fn)(const struct flightrec_rec *r, uint64_t off, void *user), void *user)
+{
+	uint64_t off = 0;
+	size_t n = 0;
+
+	while(off + FLIGHTREC_REC_SIZE(0) <= size) {
+		const struct flightrec_rec *r = rec_at(data, size, off);
+		if(r) {
+			fn(r, off, user);
+			off += FLIGHTREC_REC_SIZE(r->len);
+			n ++;
+		} else {
+			off += 8;
+		}
+	}
+
+	return n;
+}
+
+
+static void find_newest(const struct flightrec_rec *r, uint64_t off, void *user)
+{
+	int *found = user;
+
+	if(!*found || r->seq >= seq) {
+		seq = r->seq + 1;
+		head = off + FLIGHTREC_REC_SIZE(r->len);
+		*found = 1;
+	}
+}
+
+
+static void hdr_update(void)
+{
+	struct flightrec_hdr *h = (struct flightrec_hdr *)map;
+
+	memcpy(h->magic, FLIGHTREC_MAGIC, sizeof h->magic);
+	h->data_size = data_size;
+	h->seq = seq;
+	h->head = head;
+	h->t_sync = real_nsec();
+	h->crc = crc32((const uint8_t *)h, offsetof(struct flightrec_hdr, crc));
+}
+
+
+int flightrec_open(const char *fname, uint64_t size)
+{
+	struct stat st;
+	uint64_t total;
+	int found = 0;
+	int r;
+
+	size = (size + FLIGHTREC_HDR_SIZE - 1) & ~(uint64_t)(FLIGHTREC_HDR_SIZE - 1);
+	if(size < FLIGHTREC_SIZE_MIN) {
+		errno = EINVAL;
+		return -1;
+	}
+	total = FLIGHTREC_HDR_SIZE + size;
+
+	fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0) return -1;
+
+	/*
+	 * Only an empty file or an earlier recording is used; one of another
+	 * size is started over. Anything else is left alone, so a mistyped
+	 * name can not destroy some other file.
+	 */
+
+	if(fstat(fd, &st) != 0) goto err;
+	if(st.st_size > 0) {
+		char magic[sizeof(((struct flightrec_hdr *)0)->magic)];
+		if(pread(fd, magic, sizeof magic, 0) != sizeof magic ||
+		   memcmp(magic, FLIGHTREC_MAGIC, sizeof magic) != 0) {
+			errno = EEXIST;
+			goto err;
+		}
+	}
+	if(st.st_size != total) {
+		if(ftruncate(fd, 0) != 0) goto err;
+	}
+
+	/* Allocate all blocks now, so a full disk can not fault the mapping later */
+
+	r = posix_fallocate(fd, 0, total);
+	if(r != 0) {
+		errno = r;
+		goto err;
+	}
+
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		map = NULL;
+		goto err;
+	}
+
+	data = map + FLIGHTREC_HDR_SIZE;
+	data_size = size;
+	head = 0;
+	seq = 0;
+
+	if(flightrec_hdr_ok((struct flightrec_hdr *)map) && ((struct flightrec_hdr *)map)->data_size == size) {
+		flightrec_scan(data, data_size, find_newest, &found);
+		if(head >= data_size) head = 0;
+	}
+
+	hdr_update();
+	msync(map, FLIGHTREC_HDR_SIZE, MS_SYNC);
+	dirty_lo = dirty_hi = 0;
+
+	return 0;
+
+err:
+	r = errno;
+	close(fd);
+	fd = -1;
+	errno = r;
+	return -1;
+}
+
+
+static void write_rec(const uint8_t *buf, size_t len)
+{
+	struct flightrec_rec r;
+	size_t size = FLIGHTREC_REC_SIZE(len);
+	uint8_t *p;
+
+	if(head + size > data_size) head = 0;
+	p = data + head;
+
+	/* Payload and trailer first, the header makes the record valid */
+
+	memcpy(p + sizeof r, buf, len);
+	memcpy(p + sizeof r + len, &seq, sizeof seq);
+
+	r.magic = FLIGHTREC_REC_MAGIC;
+	r.len = len;
+	r.seq = seq;
+	r.t = real_nsec();
+	r.crc = crc32((const uint8_t *)&r, offsetof(struct flightrec_rec, crc));
+	r.pad = 0;
+	memcpy(p, &r, sizeof r);
+
+	if(dirty_hi == dirty_lo) {
+		dirty_lo = head;
+		dirty_hi = head + size;
+	} else {
+		if(head < dirty_lo) dirty_lo = head;
+		if(head + size > dirty_hi) dirty_hi = head + size;
+	}
+
+	head += size;
+	seq ++;
+}
+
+
+void flightrec_write(const uint8_t *buf, size_t len)
+{
+	if(map == NULL) return;
+
+	while(len > 0) {
+		size_t n = len < FLIGHTREC_REC_MAX ? len : FLIGHTREC_REC_MAX;
+		write_rec(buf, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * Write the records since the last sync to disk, then the header
+ */
+
+int flightrec_sync(void)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t lo, hi;
+
+	if(map == NULL || dirty_hi == dirty_lo) return 0;
+
+	/* msync() wants a page aligned start, the data may start mid page */
+
+	lo = (FLIGHTREC_HDR_SIZE + dirty_lo) & ~(page - 1);
+	hi = FLIGHTREC_HDR_SIZE + dirty_hi;
+	if(msync(map + lo, hi - lo, MS_SYNC) != 0) return -1;
+
+	hdr_update();
+	if(msync(map, FLIGHTREC_HDR_SIZE, MS_SYNC) != 0) return -1;
+
+	dirty_lo = dirty_hi = 0;
+	return 0;
+}
+
+
+void flightrec_close(void)
+{
+	if(map == NULL) return;
+
+	flightrec_sync();
+	munmap(map, FLIGHTREC_HDR_SIZE + data_size);
+	close(fd);
+	map = NULL;
+	fd = -1;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,48 @@
+#ifndef flightrec_h
+#define flightrec_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On disk layout of the flight recorder file: a header page followed by
+ * the data ring. Records are 8 byte aligned; the payload is followed by
+ * a copy of the sequence number, so a record torn by a crash is detected.
+ */
+
+#define FLIGHTREC_MAGIC      "ITRMREC1"
+#define FLIGHTREC_REC_MAGIC  0x31636572
+#define FLIGHTREC_HDR_SIZE   4096
+#define FLIGHTREC_REC_MAX    65536
+#define FLIGHTREC_SIZE_MIN   (1024 * 1024)
+
+struct flightrec_hdr {
+	char magic[8];
+	uint64_t data_size;
+	uint64_t seq;          /* next record at the last sync */
+	uint64_t head;         /* write offset at the last sync */
+	uint64_t t_sync;       /* time of the last sync, ns since the epoch */
+	uint32_t crc;          /* of the fields above */
+};
+
+struct flightrec_rec {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t seq;
+	uint64_t t;            /* ns since the epoch */
+	uint32_t crc;          /* of the fields above */
+	uint32_t pad;
+};
+
+#define FLIGHTREC_REC_SIZE(len) ((sizeof(struct flightrec_rec) + (len) + sizeof(uint64_t) + 7) & ~(size_t)7)
+
+int flightrec_open(const char *fname, uint64_t size);
+void flightrec_write(const uint8_t *buf, size_t len);
+int flightrec_sync(void);
+void flightrec_close(void);
+
+int flightrec_hdr_ok(const struct flightrec_hdr *h);
+size_t flightrec_scan(const uint8_t *data, uint64_t size,
+		void (*fn)(const struct flightrec_rec *r, uint64_t off, void *user), void *user);
+
+#endif
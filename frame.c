@@ -0,0 +1,267 @@
+/*
+ * Streaming decoders for byte stuffed framing:
+ *
+ *   SLIP  (RFC 1055): frames end with 0xc0, 0xdb escapes 0xc0 and 0xdb
+ *   HDLC  (RFC 1662, async): frames are delimited by 0x7e, 0x7d escapes
+ *         the next byte by xor'ing it with 0x20; 0x7d 0x7e aborts
+ *   COBS: frames end with 0x00; every block starts with a code byte
+ *         giving the offset of the next (removed) zero
+ *
+ * Frames can be split over any number of chunks. Most of the input is
+ * payload that is copied as is, so the decoders scan for the next special
+ * byte with SSE2 and copy the run in between with memcpy; for COBS the
+ * runs are given by the block codes.
+ *
+ * An optional CRC at the end of the frame is checked with the residue
+ * of the CRC over the whole frame, and removed from the payload.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "crc.h"
+#include "frame.h"
+
+#define SLIP_END      0xc0
+#define SLIP_ESC      0xdb
+#define SLIP_ESC_END  0xdc
+#define SLIP_ESC_ESC  0xdd
+
+#define HDLC_FLAG     0x7e
+#define HDLC_ESC      0x7d
+
+#define CRC16_RESIDUE 0xf0b8
+#define CRC32_RESIDUE 0xdebb20e3
+
+static const char *proto_name[] = { "none", "slip", "cobs", "hdlc" };
+
+
+int frame_parse(const char *spec, enum frame_proto *proto, enum frame_crc *crc)
+{
+	size_t l = strcspn(spec, ",");
+	const char *c = spec[l] ? spec + l + 1 : NULL;
+	int i;
+
+	*proto = FRAME_NONE;
+	for(i=FRAME_SLIP; i<=FRAME_HDLC; i++) {
+		if(strncasecmp(spec, proto_name[i], l) == 0 && proto_name[i][l] == '\0') *proto = i;
+	}
+	if(*proto == FRAME_NONE) return -1;
+
+	*crc = *proto == FRAME_HDLC ? FRAME_CRC_16 : FRAME_CRC_NONE;
+
+	if(c) {
+		if(strcasecmp(c, "crc16") == 0) {
+			*crc = FRAME_CRC_16;
+		} else if(strcasecmp(c, "crc32") == 0) {
+			*crc = FRAME_CRC_32;
+		} else if(strcasecmp(c, "nocrc") == 0) {
+			*crc = FRAME_CRC_NONE;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+const char *frame_proto_name(enum frame_proto proto)
+{
+	return proto_name[proto];
+}
+
+
+void frame_init(struct frame *f, enum frame_proto proto, enum frame_crc crc, int dir,
+		void (*emit)(int dir, const uint8_t *buf, size_t len, int status))
+{
+	memset(f, 0, sizeof *f);
+	f->proto = proto;
+	f->crc = crc;
+	f->dir = dir;
+	f->emit = emit;
+}
+
+
+/*
+ * Length of the run of bytes not equal to 'a' or 'b'
+ */
+
+static size_t scan2(const uint8_t *p, size_t n, uint8_t a, uint8_t b)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		int bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if(bits) return i + __builtin_ctz(bits);
+	}
+#endif
+
+	for(; i < n; i++) {
+		if(p[i] == a || p[i] == b) break;
+	}
+
+	return i;
+}
+
+
+static void append(struct frame *f, const uint8_t *p, size_t n)
+{
+	if(f->len + n > FRAME_MAX) {
+		f->status |= FRAME_OVERFLOW;
+		n = FRAME_MAX - f->len;
+	}
+	memcpy(f->buf + f->len, p, n);
+	f->len += n;
+}
+
+
+static void done(struct frame *f)
+{
+	size_t len = f->len;
+	int status = f->status;
+
+	f->len = 0;
+	f->status = 0;
+	f->esc = 0;
+	f->cobs_code = 0;
+	f->cobs_left = 0;
+
+	/* Back to back delimiters are idle fill, not frames */
+
+	if(len == 0 && status == 0) return;
+
+	if(f->crc != FRAME_CRC_NONE && !(status & (FRAME_ABORT | FRAME_OVERFLOW))) {
+		size_t cl = f->crc == FRAME_CRC_16 ? 2 : 4;
+		int ok;
+		if(len >= cl) {
+			if(f->crc == FRAME_CRC_16) {
+				ok = crc16_update(CRC16_INIT, f->buf, len) == CRC16_RESIDUE;
+			} else {
+				ok = crc32_update(CRC32_INIT, f->buf, len) == CRC32_RESIDUE;
+			}
+			len -= cl;
+		} else {
+			ok = 0;
+		}
+		status |= ok ? FRAME_CRC_OK : FRAME_CRC_BAD;
+	}
+
+	f->frames ++;
+	if(status & FRAME_ERRORS) f->errors ++;
+	f->emit(f->dir, f->buf, len, status);
+}
+
+
+static void feed_stuffed(struct frame *f, const uint8_t *src, size_t len)
+{
+	uint8_t end = f->proto == FRAME_SLIP ? SLIP_END : HDLC_FLAG;
+	uint8_t esc = f->proto == FRAME_SLIP ? SLIP_ESC : HDLC_ESC;
+	size_t i = 0;
+
+	while(i < len) {
+
+		uint8_t c;
+
+		if(f->esc) {
+			c = src[i++];
+			f->esc = 0;
+			if(c == end) {
+				f->status |= f->proto == FRAME_HDLC ? FRAME_ABORT : FRAME_BAD_ESCAPE;
+				done(f);
+				continue;
+			}
+			if(f->proto == FRAME_HDLC) {
+				c ^= 0x20;
+			} else if(c == SLIP_ESC_END) {
+				c = SLIP_END;
+			} else if(c == SLIP_ESC_ESC) {
+				c = SLIP_ESC;
+			} else {
+				f->status |= FRAME_BAD_ESCAPE;
+			}
+			append(f, &c, 1);
+			continue;
+		}
+
+		size_t n = scan2(src + i, len - i, end, esc);
+		append(f, src + i, n);
+		i += n;
+		if(i == len) break;
+
+		c = src[i++];
+		if(c == end) {
+			done(f);
+		} else {
+			f->esc = 1;
+		}
+	}
+}
+
+
+static void feed_cobs(struct frame *f, const uint8_t *src, size_t len)
+{
+	static const uint8_t zero = 0;
+	size_t i = 0;
+
+	while(i < len) {
+
+		if(f->cobs_left > 0) {
+			size_t n = len - i < f->cobs_left ? len - i : f->cobs_left;
+			const uint8_t *z = memchr(src + i, 0, n);
+			if(z) {
+				append(f, src + i, z - (src + i));
+				i = z - src + 1;
+				f->status |= FRAME_TRUNCATED;
+				done(f);
+			} else {
+				append(f, src + i, n);
+				f->cobs_left -= n;
+				i += n;
+			}
+			continue;
+		}
+
+		uint8_t c = src[i++];
+
+		if(c == 0) {
+			done(f);
+			continue;
+		}
+
+		/* The zero a block stands for is only known once the next one starts */
+
+		if(f->cobs_code && f->cobs_code != 0xff) append(f, &zero, 1);
+		f->cobs_code = c;
+		f->cobs_left = c - 1;
+	}
+}
+
+
+void frame_feed(struct frame *f, const uint8_t *buf, size_t len)
+{
+	switch(f->proto) {
+		case FRAME_SLIP:
+		case FRAME_HDLC:
+			feed_stuffed(f, buf, len);
+			break;
+		case FRAME_COBS:
+			feed_cobs(f, buf, len);
+			break;
+		case FRAME_NONE:
+			break;
+	}
+}
+
+/*
+ * End
+ */
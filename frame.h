@@ -0,0 +1,58 @@
+#ifndef frame_h
+#define frame_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_MAX 4096
+
+enum frame_proto {
+	FRAME_NONE,
+	FRAME_SLIP,
+	FRAME_COBS,
+	FRAME_HDLC,
+};
+
+enum frame_crc {
+	FRAME_CRC_NONE,
+	FRAME_CRC_16,        /* CRC-16/X.25, as the HDLC FCS */
+	FRAME_CRC_32,        /* CRC-32/IEEE */
+};
+
+/* Frame status flags */
+
+#define FRAME_CRC_OK     0x01
+#define FRAME_CRC_BAD    0x02
+#define FRAME_BAD_ESCAPE 0x04
+#define FRAME_ABORT      0x08
+#define FRAME_OVERFLOW   0x10
+#define FRAME_TRUNCATED  0x20
+
+#define FRAME_ERRORS (FRAME_CRC_BAD | FRAME_BAD_ESCAPE | FRAME_ABORT | FRAME_OVERFLOW | FRAME_TRUNCATED)
+
+struct frame {
+	enum frame_proto proto;
+	enum frame_crc crc;
+	int dir;
+	void (*emit)(int dir, const uint8_t *buf, size_t len, int status);
+
+	/* decoder state */
+
+	int esc;
+	int cobs_code;
+	int cobs_left;
+	int status;
+	size_t len;
+	uint8_t buf[FRAME_MAX];
+
+	uint64_t frames;
+	uint64_t errors;
+};
+
+int frame_parse(const char *spec, enum frame_proto *proto, enum frame_crc *crc);
+const char *frame_proto_name(enum frame_proto proto);
+void frame_init(struct frame *f, enum frame_proto proto, enum frame_crc crc, int dir,
+		void (*emit)(int dir, const uint8_t *buf, size_t len, int status));
+void frame_feed(struct frame *f, const uint8_t *buf, size_t len);
+
+#endif
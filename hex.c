@@ -0,0 +1,324 @@
+
+/*
+ * Bulk hex conversion helpers, vectorized with SSE2 where available
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hex.h"
+#include "crc.h"
+
+static const char digits[] = "0123456789abcdef";
+
+
+/*
+ * Convert n bytes to 2n lowercase hex digits
+ */
+
+void hex_encode(const uint8_t *src, size_t n, char *dst)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i mask  = _mm_set1_epi8(0x0f);
+	const __m128i nine  = _mm_set1_epi8(9);
+	const __m128i zero  = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i v  = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+		_mm_storeu_si128((__m128i *)(dst + i * 2),      _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+
+	for(; i < n; i++) {
+		dst[i * 2]     = digits[src[i] >> 4];
+		dst[i * 2 + 1] = digits[src[i] & 0x0f];
+	}
+}
+
+
+/*
+ * Copy printable ASCII characters, replace everything else by a '.'
+ */
+
+void hex_printable(const uint8_t *src, size_t n, char *dst)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i lo  = _mm_set1_epi8(0x1f);
+	const __m128i hi  = _mm_set1_epi8(0x7f);
+	const __m128i dot = _mm_set1_epi8('.');
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i m = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		v = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, dot));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#endif
+
+	for(; i < n; i++) {
+		dst[i] = (src[i] >= 0x20 && src[i] < 0x7f) ? src[i] : '.';
+	}
+}
+
+static int nibble(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+
+#ifdef __SSE2__
+
+/*
+ * Convert 16 characters to their nibble values, invalid characters
+ * become 0xff
+ */
+
+static inline __m128i nibble16(__m128i c)
+{
+	__m128i d  = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l  = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i id = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i il = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+	__m128i v  = _mm_or_si128(_mm_and_si128(id, d), _mm_and_si128(il, _mm_add_epi8(l, _mm_set1_epi8(10))));
+	return _mm_or_si128(v, _mm_andnot_si128(_mm_or_si128(id, il), _mm_set1_epi8(-1)));
+}
+
+#endif
+
+
+/*
+ * Length of the run of hex digits at the start of s
+ */
+
+static size_t hex_run(const char *s, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = nibble16(_mm_loadu_si128((const __m128i *)(s + i)));
+		int bad = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(-1)));
+		if(bad) return i + __builtin_ctz(bad);
+	}
+#endif
+
+	while(i < n && nibble(s[i]) >= 0) i++;
+	return i;
+}
+
+
+/*
+ * Pack an even number of hex digits into bytes
+ */
+
+static void hex_pack(const char *s, size_t n, uint8_t *dst)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for(; i + 16 <= n; i += 16) {
+		__m128i v  = nibble16(_mm_loadu_si128((const __m128i *)(s + i)));
+		__m128i hi = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+		__m128i lo = _mm_srli_epi16(v, 8);
+		__m128i b  = _mm_packus_epi16(_mm_or_si128(hi, lo), _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *)(dst + i / 2), b);
+	}
+#endif
+
+	for(; i < n; i += 2) {
+		dst[i / 2] = (nibble(s[i]) << 4) | nibble(s[i + 1]);
+	}
+}
+
+
+static int is_sep(char c)
+{
+	return c == ' ' || c == '\t' || c == ',' || c == ':' || c == '-' || c == ';' || c == '\r';
+}
+
+
+static int is_keyword(const char *s, size_t n, const char *kw)
+{
+	size_t l = strlen(kw);
+	size_t i;
+
+	if(n < l) return 0;
+	for(i=0; i<l; i++) {
+		if((s[i] | 0x20) != kw[i]) return 0;
+	}
+	return n == l || is_sep(s[l]);
+}
+
+
+/*
+ * Decode one range of hex text. Digits are grouped in tokens separated by
+ * whitespace or punctuation; a token with an odd number of digits gets an
+ * implicit leading zero.
+ */
+
+static int decode_range(const char *src, size_t from, size_t to,
+		uint8_t *dst, size_t size, size_t *n_out, size_t *errpos)
+{
+	size_t i = from;
+	size_t n = *n_out;
+
+	while(i < to) {
+
+		const char *p = src + i;
+		size_t left = to - i;
+
+		if(is_sep(*p)) {
+			i ++;
+			continue;
+		}
+
+		if(left >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+			i += 2;
+			continue;
+		}
+
+		if(is_keyword(p, left, "crc16")) {
+			if(n + 2 > size) goto overflow;
+			uint16_t crc = crc16(dst, n);
+			dst[n++] = crc;
+			dst[n++] = crc >> 8;
+			i += 5;
+			continue;
+		}
+
+		if(is_keyword(p, left, "crc32")) {
+			if(n + 4 > size) goto overflow;
+			uint32_t crc = crc32(dst, n);
+			dst[n++] = crc;
+			dst[n++] = crc >> 8;
+			dst[n++] = crc >> 16;
+			dst[n++] = crc >> 24;
+			i += 5;
+			continue;
+		}
+
+		size_t run = hex_run(p, left);
+		if(run == 0) {
+			*errpos = i;
+			return -1;
+		}
+
+		if(n + (run + 1) / 2 > size) goto overflow;
+
+		if(run & 1) {
+			dst[n++] = nibble(*p);
+			p ++;
+		}
+		hex_pack(p, run & ~1, dst + n);
+		n += run / 2;
+		i += run;
+	}
+
+	*n_out = n;
+	return 0;
+
+overflow:
+	*errpos = i;
+	return -1;
+}
+
+
+/*
+ * Length of a dump offset at the start of a line, if any: at least 6
+ * hex digits followed by a ':' (xxd) or a space (hexdump -C, only when
+ * the line has an ASCII column)
+ */
+
+static size_t dump_offset(const char *s, size_t n, int has_bar)
+{
+	size_t i = hex_run(s, n);
+
+	if(i < 6 || i >= n) return 0;
+	if(s[i] == ':') return i + 1;
+	if(s[i] == ' ' && has_bar) return i + 1;
+	return 0;
+}
+
+
+/*
+ * Decode a typed or pasted hex string into bytes. Accepts whitespace and
+ * punctuation between bytes, '0x' prefixes and lines pasted from xxd or
+ * hexdump -C. The keywords 'crc16' and 'crc32' append the CRC of all
+ * bytes decoded so far, little endian. Returns the number of bytes, or
+ * -1 with the offending position in errpos.
+ */
+
+int hex_decode(const char *src, size_t len, uint8_t *dst, size_t size, size_t *errpos)
+{
+	size_t n = 0;
+	size_t ls = 0;
+	int in_dump = 0;
+
+	while(ls < len) {
+
+		const char *nl = memchr(src + ls, '\n', len - ls);
+		size_t le = nl ? (size_t)(nl - src) : len;
+		size_t ds = ls;
+		size_t de = le;
+
+		while(ds < le && (src[ds] == ' ' || src[ds] == '\t')) ds ++;
+
+		const char *bar = memchr(src + ds, '|', le - ds);
+		size_t off = dump_offset(src + ds, le - ds, bar != NULL);
+
+		/*
+		 * hexdump -C ends with a line holding only the final offset
+		 */
+
+		if(in_dump && hex_run(src + ds, le - ds) == 8) {
+			size_t i = ds + 8;
+			while(i < le && (src[i] == ' ' || src[i] == '\t' || src[i] == '\r')) i++;
+			if(i == le) ds = de;
+		}
+
+		if(off > 0) {
+			in_dump = 1;
+			int xxd = src[ds + off - 1] == ':';
+			ds += off;
+			if(xxd) {
+				const char *p;
+				for(p = src + ds; p + 1 < src + le; p++) {
+					if(p[0] == ' ' && p[1] == ' ') {
+						de = p - src;
+						break;
+					}
+				}
+			} else {
+				de = bar - src;
+			}
+		}
+
+		if(decode_range(src, ds, de, dst, size, &n, errpos) != 0) return -1;
+
+		ls = le + 1;
+	}
+
+	return n;
+}
+
+/*
+ * End
+ */
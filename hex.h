@@ -0,0 +1,11 @@
+#ifndef hex_h
+#define hex_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+void hex_encode(const uint8_t *src, size_t n, char *dst);
+void hex_printable(const uint8_t *src, size_t n, char *dst);
+int hex_decode(const char *src, size_t len, uint8_t *dst, size_t size, size_t *errpos);
+
+#endif
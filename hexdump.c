@@ -0,0 +1,192 @@
+
+/*
+ * Incremental hex dump renderer. Complete rows are formatted in bulk and
+ * written once; only the trailing incomplete row of a chunk is drawn, and
+ * redrawn in place when the next chunk completes it. Consecutive
+ * identical rows are collapsed into a single '*' line, like hexdump(1).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hex.h"
+#include "hexdump.h"
+
+#define ROW_MAX (8 + 2 + HEXDUMP_MAX_WIDTH * 4 + 4 + HEXDUMP_MAX_WIDTH + 4)
+
+static int width = 16;
+static int group = 8;
+
+static uint64_t offset;
+static int row_from;
+static uint8_t row[HEXDUMP_MAX_WIDTH];
+static uint8_t prev[HEXDUMP_MAX_WIDTH];
+static int prev_valid;
+static int dup;
+static int partial_drawn;
+
+
+int hexdump_set_format(int w, int g)
+{
+	if(w < 1 || w > HEXDUMP_MAX_WIDTH) return -1;
+	if(g < 1) g = w;
+
+	width = w;
+	group = g;
+	hexdump_reset();
+	return 0;
+}
+
+
+void hexdump_reset(void)
+{
+	offset = 0;
+	row_from = 0;
+	prev_valid = 0;
+	dup = 0;
+	partial_drawn = 0;
+}
+
+
+/*
+ * Advance the offset without rendering, the next row starts at the new
+ * offset with its leading columns left blank
+ */
+
+void hexdump_skip(uint64_t n)
+{
+	offset += n;
+	row_from = offset % width;
+	prev_valid = 0;
+	dup = 0;
+	partial_drawn = 0;
+}
+
+
+/*
+ * Format columns [from, to> of the current row; other columns are blank
+ */
+
+static size_t format_row(char *out, uint64_t row_offset, int from, int to)
+{
+	char hex[HEXDUMP_MAX_WIDTH * 2];
+	char asc[HEXDUMP_MAX_WIDTH];
+	uint8_t ob[4] = { row_offset >> 24, row_offset >> 16, row_offset >> 8, row_offset };
+	char *p = out;
+	int col;
+
+	hex_encode(row, width, hex);
+	hex_printable(row, width, asc);
+
+	hex_encode(ob, 4, p);
+	p += 8;
+	*p++ = ' ';
+	*p++ = ' ';
+
+	for(col=0; col<width; col++) {
+		if(col > 0 && (col % group) == 0) *p++ = ' ';
+		if(col >= from && col < to) {
+			memcpy(p, hex + col * 2, 2);
+		} else {
+			memset(p, ' ', 2);
+		}
+		p[2] = ' ';
+		p += 3;
+	}
+
+	*p++ = ' ';
+	*p++ = '|';
+	memset(p, ' ', width);
+	memcpy(p + from, asc + from, to - from);
+	p += width;
+	*p++ = '|';
+
+	return p - out;
+}
+
+
+void hexdump_write(const uint8_t *buf, size_t len, FILE *f)
+{
+	char out[8192];
+	size_t n_out = 0;
+
+	while(len > 0) {
+
+		int col = offset % width;
+		size_t n = width - col;
+		if(n > len) n = len;
+
+		memcpy(row + col, buf, n);
+		offset += n;
+		buf += n;
+		len -= n;
+
+		if(col + n < width) break;
+
+		/*
+		 * Row complete
+		 */
+
+		if(n_out + ROW_MAX + 8 > sizeof out) {
+			fwrite(out, 1, n_out, f);
+			n_out = 0;
+		}
+
+		if(row_from == 0 && prev_valid && memcmp(row, prev, width) == 0) {
+			if(partial_drawn) {
+				memcpy(out + n_out, "\r\e[K", 4);
+				n_out += 4;
+			}
+			if(!dup) {
+				memcpy(out + n_out, "*\n", 2);
+				n_out += 2;
+				dup = 1;
+			}
+		} else {
+			if(partial_drawn) out[n_out++] = '\r';
+			n_out += format_row(out + n_out, offset - width, row_from, width);
+			out[n_out++] = '\n';
+			dup = 0;
+		}
+
+		memcpy(prev, row, width);
+		prev_valid = (row_from == 0);
+		row_from = 0;
+		partial_drawn = 0;
+	}
+
+	/*
+	 * Draw the trailing incomplete row, it will be redrawn in place
+	 * when completed
+	 */
+
+	int col = offset % width;
+
+	if(col > row_from) {
+		if(n_out + ROW_MAX + 8 > sizeof out) {
+			fwrite(out, 1, n_out, f);
+			n_out = 0;
+		}
+		out[n_out++] = '\r';
+		n_out += format_row(out + n_out, offset - col, row_from, col);
+		partial_drawn = 1;
+	}
+
+	if(n_out > 0) fwrite(out, 1, n_out, f);
+}
+
+
+/*
+ * Terminate the current row
+ */
+
+void hexdump_finish(FILE *f)
+{
+	if(partial_drawn) fputc('\n', f);
+	partial_drawn = 0;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,15 @@
+#ifndef hexdump_h
+#define hexdump_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HEXDUMP_MAX_WIDTH 64
+
+int hexdump_set_format(int width, int group);
+void hexdump_reset(void);
+void hexdump_skip(uint64_t n);
+void hexdump_write(const uint8_t *buf, size_t len, FILE *f);
+void hexdump_finish(FILE *f);
+
+#endif
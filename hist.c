@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof *h);
+}
+
+
+/*
+ * Lowest value that maps to the given bucket
+ */
+
+static uint64_t bucket_value(int i)
+{
+	if(i < HIST_SUB) return i;
+	int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t sub = i % HIST_SUB;
+	return (HIST_SUB + sub) << (e - HIST_SUB_BITS);
+}
+
+
+/*
+ * Return the value below which the given percentage of samples fall,
+ * clamped to the observed min/max
+ */
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t n = 0;
+	uint64_t want = h->count * p / 100.0;
+	int i;
+
+	if(h->count == 0) return 0;
+	if(want >= h->count) return h->max;
+
+	for(i=0; i<HIST_BUCKETS; i++) {
+		n += h->bucket[i];
+		if(n > want) {
+			uint64_t v = bucket_value(i + 1) - 1;
+			if(v > h->max) v = h->max;
+			if(v < h->min) v = h->min;
+			return v;
+		}
+	}
+
+	return h->max;
+}
+
+
+/*
+ * Format a nanosecond value in a human friendly unit
+ */
+
+char *hist_fmt_nsec(uint64_t ns, char *buf, int len)
+{
+	if(ns < 1000) {
+		snprintf(buf, len, "%dns", (int)ns);
+	} else if(ns < 1000000) {
+		snprintf(buf, len, "%.1fus", ns / 1E3);
+	} else if(ns < 1000000000) {
+		snprintf(buf, len, "%.1fms", ns / 1E6);
+	} else {
+		snprintf(buf, len, "%.2fs", ns / 1E9);
+	}
+	return buf;
+}
+
+/*
+ * End
+ */
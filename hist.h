@@ -0,0 +1,44 @@
+#ifndef hist_h
+#define hist_h
+
+#include <stdint.h>
+
+/*
+ * Fixed size log-linear histogram. Values are bucketed by their power of
+ * two, with 8 linear sub-buckets per power, giving a worst case relative
+ * error of 12.5% over the full 64 bit range.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t bucket[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint64_t v)
+{
+	if(v < HIST_SUB) return v;
+	int e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	if(h->count == 0 || v < h->min) h->min = v;
+	if(v > h->max) h->max = v;
+	h->count ++;
+	h->sum += v;
+	h->bucket[hist_index(v)] ++;
+}
+
+void hist_reset(struct hist *h);
+uint64_t hist_percentile(const struct hist *h, double p);
+char *hist_fmt_nsec(uint64_t ns, char *buf, int len);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Serial read profiles:
+ *
+ *   interactive  small reads as soon as data arrives, lowest latency
+ *   bulk         reads sized by TIOCINQ so one read drains the kernel
+ *                buffer, after which the port is not watched for the
+ *                coalescing window: at high rates the data of a whole
+ *                window is picked up with one wakeup and one read
+ *   adaptive     bulk while the receive rate is high, interactive
+ *                otherwise, with hysteresis
+ *
+ * The caller does the parking of the port during the coalescing window;
+ * this module only makes the decisions.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+
+#include "clock.h"
+#include "ioprof.h"
+
+#define READ_INTERACTIVE  256
+#define COALESCE_MSEC     5
+#define RATE_WINDOW       0.2
+#define RATE_BULK         20000.0
+#define RATE_INTERACTIVE  5000.0
+
+static const char *mode_name[] = { "interactive", "bulk", "adaptive" };
+
+static enum ioprof_mode mode = IOPROF_INTERACTIVE;
+static int bulk = 0;
+static double t_window = 0;
+static size_t window_bytes = 0;
+
+
+int ioprof_set(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof(mode_name)/sizeof(mode_name[0]); i++) {
+		if(strcasecmp(name, mode_name[i]) == 0) {
+			mode = i;
+			bulk = mode == IOPROF_BULK;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+const char *ioprof_name(void)
+{
+	if(mode == IOPROF_ADAPTIVE) {
+		return bulk ? "adaptive, now bulk" : "adaptive, now interactive";
+	}
+	return mode_name[mode];
+}
+
+
+int ioprof_bulk(void)
+{
+	return bulk;
+}
+
+
+int ioprof_coalesce_msec(void)
+{
+	return COALESCE_MSEC;
+}
+
+
+size_t ioprof_read_size(int fd, size_t max)
+{
+	int n;
+
+	if(!bulk) return max < READ_INTERACTIVE ? max : READ_INTERACTIVE;
+
+	if(ioctl(fd, TIOCINQ, &n) != 0 || n <= 0) return max;
+	return (size_t)n < max ? (size_t)n : max;
+}
+
+
+/*
+ * Account received data for the adaptive profile. Returns 1 when the
+ * profile in effect changed.
+ */
+
+int ioprof_account(size_t len)
+{
+	double t, rate;
+	int prev = bulk;
+
+	if(mode != IOPROF_ADAPTIVE) return 0;
+
+	t = mono_sec();
+	window_bytes += len;
+	if(t_window == 0) t_window = t;
+	if(t - t_window < RATE_WINDOW) return 0;
+
+	rate = window_bytes / (t - t_window);
+	if(rate > RATE_BULK) bulk = 1;
+	if(rate < RATE_INTERACTIVE) bulk = 0;
+
+	t_window = t;
+	window_bytes = 0;
+
+	return bulk != prev;
+}
+
+/*
+ * End
+ */
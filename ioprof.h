@@ -0,0 +1,19 @@
+#ifndef ioprof_h
+#define ioprof_h
+
+#include <stddef.h>
+
+enum ioprof_mode {
+	IOPROF_INTERACTIVE,
+	IOPROF_BULK,
+	IOPROF_ADAPTIVE,
+};
+
+int ioprof_set(const char *name);
+const char *ioprof_name(void);
+int ioprof_bulk(void);
+int ioprof_coalesce_msec(void);
+size_t ioprof_read_size(int fd, size_t max);
+int ioprof_account(size_t len);
+
+#endif
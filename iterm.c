@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <time.h>
 #include <stdint.h>
@@ -13,22 +14,122 @@
 #include <sys/time.h>
 #include <string.h>
 #include <ctype.h>
+#include <syslog.h>
+#include <fcntl.h>
 
+#include "clock.h"
 #include "serial.h"
 #include "mainloop.h"
 #include "speed.h"
+#include "stats.h"
+#include "metrics.h"
+#include "hexdump.h"
+#include "hex.h"
+#include "splice.h"
+#include "json.h"
+#include "devwatch.h"
+#include "autobaud.h"
+#include "linktest.h"
+#include "txpace.h"
+#include "sniff.h"
+#include "pool.h"
+#include "sanitize.h"
+#include "dedup.h"
+#include "rt.h"
+#include "flightrec.h"
+#include "shmring.h"
+#include "frame.h"
+#include "ioprof.h"
+#include "hist.h"
+#include "pipeline.h"
 
 static int fd_serial;
 static int fd_terminal;
-static int hex_off = 0;
 static int hex_mode = 0;
 static int translate_newline = 0;
-static char hex_buf[90] = "";
 static int timestamp = 0;
 static int echo = 0;
 static int have_tty;
 static int log_enable = 0;
+static int profile = 0;
+static int in_hexline = 0;
+static char hexline[8192];
+static size_t hexline_len = 0;
+static double hexline_t_sent = 0;
+static int render_decimate = 0;
+static int render_fps = 20;
+static int render_budget = 200000;
+static size_t render_credit;
+static uint64_t render_skipped;
+static uint8_t render_tail[2048];
+static uint64_t render_tail_head;
+static int render_col;
 static FILE *fd_log;
+static char log_fname[256];
+static int headless = 0;
+static int daemonized = 0;
+static const char *pidfile = NULL;
+static int splice_mode = 0;
+static int fd_log_raw = -1;
+static const char *port_name = "";
+
+#define JSON_TERM 1
+#define JSON_LOG  2
+#define JSON_SOCK 4
+
+static int json_sinks = 0;
+
+static struct sanitize san_screen;
+static struct sanitize san_log;
+
+static struct dedup dedup_screen;
+static struct dedup dedup_log;
+static int dedup_cycle = 0;
+static int dedup_feeding = 0;
+
+static int rt_prio = -1;
+static int rt_cpu = -1;
+
+static char *flightrec_file = NULL;
+static uint64_t flightrec_size = 256 * 1024 * 1024;
+
+static char *shmring_name = NULL;
+static uint64_t shmring_size = 4 * 1024 * 1024;
+
+static struct frame frame_rx;
+static struct frame frame_tx;
+static enum frame_proto frame_proto = FRAME_NONE;
+static enum frame_crc frame_crc;
+
+static char *ioprof_spec = NULL;
+static int serial_parked = 0;
+static int use_uring = 0;
+
+static struct {
+	char *dev;
+	int baudrate;
+	int custom;
+	int custom_speed;
+	int rtscts;
+	int xonxoff;
+	int stopbits;
+	int parity;
+	int mctrl;
+} port;
+
+static int reconnect = 0;
+static int (*serial_handler)(int fd, void *data);
+static double t_lost;
+static int autobaud = 0;
+static char *autobaud_rates = NULL;
+static int linktest_order = 0;
+static int linktest_secs = 5;
+static char *linktest_rates = NULL;
+static int exit_code = 0;
+static char sniff_dev[64];
+static int fd_sniff = -1;
+static double sniff_gap = 0;
+static double sniff_char_time;
 
 static int get_baudrate(const char *s);
 static int on_terminal_read(int fd, void *data);
@@ -38,9 +139,89 @@ static void msg(const char *fmt, ...);
 static void usage(char *fname);
 static int on_sigint(int signo, void *data);
 static void set_hex_mode(int onoff);
-static void terminal_write(uint8_t c, int local);
-static void log_write(const uint8_t *buf, size_t len);
+static void set_render_decimate(int onoff);
+static int on_render_timer(void *data);
+static void json_emit(const char *buf, size_t len);
+static int port_open(void);
+static void port_lost(const char *reason);
+static void start_autobaud(void);
+static void start_linktest(void);
+static void serial_send(const uint8_t *buf, size_t len);
+static int serial_outq(void);
+static void on_txpace_done(const struct txpace_report *r);
+static int parse_rates(const char *s, int *rates, int max);
+static void log_mark(const char *event, const char *fmt, ...);
 static void set_log_enable(int onoff, const char *fname);
+static int on_serial_read_headless(int fd, void *data);
+static int on_flush_timer(void *data);
+static int on_coalesce_timer(void *data);
+static int on_reconnect_timer(void *data);
+static int on_flightrec_timer(void *data);
+static void serial_rx_account(size_t len);
+static int on_serial_splice(int fd, void *data);
+static int on_sighup(int signo, void *data);
+static int on_sniff_read(int fd, void *data);
+static void on_sniff_emit(int dir, double t, int newframe, const uint8_t *buf, size_t len);
+static void on_frame(int dir, const uint8_t *buf, size_t len, int status);
+static FILE *log_open(const char *fname);
+static int log_open_raw(const char *fname);
+static void start_uring(void);
+static void pipelines_init(void);
+static void stages_update(void);
+static void chain_write(struct pipeline *pl, const uint8_t *buf, size_t len, int flags);
+static void rx_write(const uint8_t *buf, size_t len);
+static void dedup_screen_out(const uint8_t *buf, size_t len, int marker);
+static void dedup_log_out(const uint8_t *buf, size_t len, int marker);
+
+/*
+ * Processing chains for the screen, the log, the JSON records, the data
+ * sent to the port and the shared memory ring. Which stages take part is
+ * decided by stages_update() whenever a mode changes.
+ */
+
+static void stage_render(struct stage *s, const struct chunk *c);
+static void stage_hex(struct stage *s, const struct chunk *c);
+static void stage_dedup(struct stage *s, const struct chunk *c);
+static void stage_sanitize(struct stage *s, const struct chunk *c);
+static void stage_timestamp(struct stage *s, const struct chunk *c);
+static void stage_screen(struct stage *s, const struct chunk *c);
+static void stage_flightrec(struct stage *s, const struct chunk *c);
+static void stage_log(struct stage *s, const struct chunk *c);
+static void stage_json(struct stage *s, const struct chunk *c);
+static void stage_json_out(struct stage *s, const struct chunk *c);
+static void stage_newline(struct stage *s, const struct chunk *c);
+static void stage_port(struct stage *s, const struct chunk *c);
+static void stage_shmring(struct stage *s, const struct chunk *c);
+static void flush_screen(struct stage *s);
+static void flush_log(struct stage *s);
+
+static struct pipeline pl_screen;
+static struct pipeline pl_log;
+static struct pipeline pl_json;
+static struct pipeline pl_tx;
+static struct pipeline pl_shm;
+
+static struct stage st_render       = STAGE_INIT("render", stage_render, NULL, NULL);
+static struct stage st_hex          = STAGE_INIT("hex", stage_hex, NULL, NULL);
+static struct stage st_dedup_screen = STAGE_INIT("dedup", stage_dedup, NULL, &dedup_screen);
+static struct stage st_san_screen   = STAGE_INIT("sanitize", stage_sanitize, NULL, &san_screen);
+static struct stage st_timestamp    = STAGE_INIT("timestamp", stage_timestamp, NULL, NULL);
+static struct stage st_screen       = STAGE_INIT("stdout", stage_screen, flush_screen, NULL);
+
+static struct stage st_flightrec    = STAGE_INIT("flightrec", stage_flightrec, NULL, NULL);
+static struct stage st_dedup_log    = STAGE_INIT("dedup", stage_dedup, NULL, &dedup_log);
+static struct stage st_san_log      = STAGE_INIT("sanitize", stage_sanitize, NULL, &san_log);
+static struct stage st_log          = STAGE_INIT("file", stage_log, flush_log, NULL);
+
+static struct stage st_json         = STAGE_INIT("json", stage_json, NULL, NULL);
+static struct stage st_json_out     = STAGE_INIT("sinks", stage_json_out, NULL, NULL);
+
+static struct stage st_newline      = STAGE_INIT("newline", stage_newline, NULL, NULL);
+static struct stage st_port         = STAGE_INIT("port", stage_port, NULL, NULL);
+
+static struct stage st_shmring      = STAGE_INIT("ring", stage_shmring, NULL, NULL);
+
+static FILE *hex_out;
 
 
 int main(int argc, char **argv)
@@ -56,10 +237,15 @@ int main(int argc, char **argv)
 	int baudrate = 115200;
 	char ttydev[64] = "/dev/ttyUSB0";
 	int use_custom_baudrate = 0;
+	char *metrics_addr = NULL;
+	char *json_addr = NULL;
 	
 	have_tty = isatty(1);
+	sanitize_init(&san_screen, SANITIZE_RAW, 0);
+	sanitize_init(&san_log, SANITIZE_RAW, 0);
+	pipelines_init();
 	
-	while( (o = getopt(argc, argv, "E2b:cehl:nrtxDR")) != EOF) {
+	while( (o = getopt(argc, argv, "E2aA::b:B:cdef:hi:j:l:m:np:q:rtu::w:xy:CDF:HJ:M:O:PQ:RST:UX:Z:")) != EOF) {
 		switch(o) {
 			case '2':
 				stopbits = 2;
@@ -79,6 +265,144 @@ int main(int argc, char **argv)
 			case 'R':
 				set_rts = 1;
 				break;
+			case 'M':
+				metrics_addr = optarg;
+				break;
+			case 'P':
+				profile = 1;
+				break;
+			case 'H':
+				headless = 1;
+				break;
+			case 'd':
+				headless = 1;
+				daemonized = 1;
+				break;
+			case 'p':
+				pidfile = optarg;
+				break;
+			case 'S':
+				headless = 1;
+				splice_mode = 1;
+				break;
+			case 'a':
+				reconnect = 1;
+				break;
+			case 'A':
+				autobaud = 1;
+				autobaud_rates = optarg;
+				break;
+			case 'q':
+				linktest_order = atoi(strncmp(optarg, "prbs", 4) == 0 ? optarg + 4 : optarg);
+				if(strchr(optarg, ',')) linktest_secs = atoi(strchr(optarg, ',') + 1);
+				break;
+			case 'Q':
+				linktest_rates = optarg;
+				if(!linktest_order) linktest_order = 15;
+				break;
+			case 'T':
+				if(txpace_set(optarg) != 0) {
+					fprintf(stderr, "Invalid pacing %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'X':
+				snprintf(sniff_dev, sizeof sniff_dev, "%.*s", (int)strcspn(optarg, ","), optarg);
+				if(strchr(optarg, ',')) sniff_gap = atof(strchr(optarg, ',') + 1) * 1E-3;
+				break;
+			case 'f': {
+				char tmp[16];
+				int m1, m2;
+				snprintf(tmp, sizeof tmp, "%.*s", (int)strcspn(optarg, ","), optarg);
+				m1 = sanitize_parse_mode(tmp);
+				m2 = strchr(optarg, ',') ? sanitize_parse_mode(strchr(optarg, ',') + 1) : m1;
+				if(m1 < 0 || m2 < 0) {
+					fprintf(stderr, "Invalid filter %s, use raw, safe, strip or escape\n", optarg);
+					exit(1);
+				}
+				san_screen.mode = m1;
+				san_log.mode = m2;
+				break;
+			}
+			case 'C':
+				san_screen.colour = 1;
+				break;
+			case 'i':
+				ioprof_spec = optarg;
+				if(ioprof_set(optarg) != 0) {
+					fprintf(stderr, "Invalid I/O profile %s, use interactive, bulk or adaptive\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'U':
+				use_uring = 1;
+				break;
+			case 'Z':
+				if(frame_parse(optarg, &frame_proto, &frame_crc) != 0) {
+					fprintf(stderr, "Invalid framing %s, use slip, cobs or hdlc, optionally followed by ,crc16 ,crc32 or ,nocrc\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'O': {
+				char *p = strchr(optarg, ',');
+				flightrec_file = optarg;
+				if(p) {
+					*p++ = '\0';
+					flightrec_size = strtoull(p, &p, 10);
+					if(*p == 'k') flightrec_size <<= 10;
+					if(*p == 'M') flightrec_size <<= 20;
+					if(*p == 'G') flightrec_size <<= 30;
+				}
+				break;
+			}
+			case 'm': {
+				char *p = strchr(optarg, ',');
+				shmring_name = optarg;
+				if(p) {
+					*p++ = '\0';
+					shmring_size = strtoull(p, &p, 10);
+					if(*p == 'k') shmring_size <<= 10;
+					if(*p == 'M') shmring_size <<= 20;
+					if(*p == 'G') shmring_size <<= 30;
+				}
+				break;
+			}
+			case 'y': {
+				char *p;
+				rt_prio = strtol(optarg, &p, 10);
+				if(*p == ',') rt_cpu = strtol(p + 1, &p, 10);
+				if(*p || rt_prio < 0 || rt_prio > 99) {
+					fprintf(stderr, "Invalid real-time setting %s, use PRIO[,CPU] with PRIO 1..99, or 0\n", optarg);
+					exit(1);
+				}
+				break;
+			}
+			case 'u':
+				dedup_cycle = optarg ? atoi(optarg) : 1;
+				if(dedup_cycle < 1 || dedup_cycle > DEDUP_CYCLE_MAX) {
+					fprintf(stderr, "Invalid cycle length %s, use 1..%d\n", optarg, DEDUP_CYCLE_MAX);
+					exit(1);
+				}
+				break;
+			case 'j':
+				if(strstr(optarg, "term")) json_sinks |= JSON_TERM;
+				if(strstr(optarg, "log")) json_sinks |= JSON_LOG;
+				break;
+			case 'J':
+				json_addr = optarg;
+				json_sinks |= JSON_SOCK;
+				break;
+			case 'F':
+				render_fps = atoi(optarg);
+				if(render_fps < 1) render_fps = 1;
+				if(render_fps > 1000) render_fps = 1000;
+				render_decimate = 1;
+				break;
+			case 'B':
+				render_budget = get_baudrate(optarg);
+				if(render_budget < 1) render_budget = 1;
+				render_decimate = 1;
+				break;
 			case 'b':
 				baudrate = get_baudrate(optarg);
 				break;
@@ -97,6 +421,12 @@ int main(int argc, char **argv)
 			case 't':
 				timestamp = 1;
 				break;
+			case 'w':
+				if(hexdump_set_format(atoi(optarg), strchr(optarg, ',') ? atoi(strchr(optarg, ',') + 1) : 0) != 0) {
+					fprintf(stderr, "Invalid hex format %s\n", optarg);
+					exit(1);
+				}
+				break;
 			case 'x':
 				xonxoff = 1;
 				break;
@@ -109,6 +439,11 @@ int main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
+	dedup_init(&dedup_screen, dedup_cycle, dedup_screen_out);
+	dedup_init(&dedup_log, dedup_cycle, dedup_log_out);
+	frame_init(&frame_rx, frame_proto, frame_crc, 0, on_frame);
+	frame_init(&frame_tx, frame_proto, frame_crc, 1, on_frame);
+
 	int i;
 	for(i=0; i<argc; i++) {
 		int b = get_baudrate(argv[i]);
@@ -125,12 +460,81 @@ int main(int argc, char **argv)
 		snprintf(ttydev, sizeof ttydev, "/dev/%s", tmp);
 	}
 
-	fd_serial   = serial_open(ttydev, baudrate, rtscts, xonxoff, stopbits, parity);
+	if((linktest_order || sniff_dev[0]) && splice_mode) {
+		fprintf(stderr, "Link test and sniffer can not be combined with splice mode\n");
+		exit(1);
+	}
+
+	/* Splice mode and the sniffer bypass the processing chains */
+
+	if(splice_mode || sniff_dev[0]) {
+		const char *opt = flightrec_file ? "-O" :
+		                  shmring_name ? "-m" :
+		                  (splice_mode && json_sinks) ? "-j/-J" :
+		                  dedup_cycle ? "-u" :
+		                  frame_proto ? "-Z" :
+		                  (san_screen.mode != SANITIZE_RAW || san_log.mode != SANITIZE_RAW) ? "-f" :
+		                  san_screen.colour ? "-C" : NULL;
+		if(opt) {
+			fprintf(stderr, "%s can not be combined with %s\n", opt, splice_mode ?
+					"splice mode, which passes the data on untouched" :
+					"the sniffer, which shows its own merged view");
+			exit(1);
+		}
+	}
+
+	/*
+	 * Open the outputs that can fail before the terminal is switched to raw
+	 * mode or the process is daemonized, so the error is seen and the
+	 * terminal is left as it was
+	 */
+
+	if(flightrec_file) {
+		if(flightrec_open(flightrec_file, flightrec_size) != 0) {
+			fprintf(stderr, "Can not open flight recorder %s: %s\n", flightrec_file,
+					errno == EEXIST ? "not a recording, refusing to overwrite it" : strerror(errno));
+			exit(1);
+		}
+		mainloop_timer_add(1, 0, on_flightrec_timer, NULL);
+		mainloop_handler_name((void *)on_flightrec_timer, "flightrec_timer");
+	}
+
+	if(shmring_name) {
+		if(shmring_open(shmring_name, shmring_size) != 0) {
+			fprintf(stderr, "Can not create shared memory ring %s: %s\n", shmring_name, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if(headless) {
+		have_tty = 0;
+		if(!ioprof_spec) ioprof_set("bulk");
+		if(fd_log) setvbuf(fd_log, NULL, _IOFBF, 65536);
+		if(!daemonized) setvbuf(stdout, NULL, _IOFBF, 65536);
+	}
+
+	stages_update();
+
+	port_name     = ttydev;
+	port.dev      = ttydev;
+	port.baudrate = baudrate;
+	port.custom   = use_custom_baudrate;
+	port.rtscts   = rtscts;
+	port.xonxoff  = xonxoff;
+	port.stopbits = stopbits;
+	port.parity   = parity;
+	port.mctrl    = (set_dtr ? TIOCM_DTR : 0) | (set_rts ? TIOCM_RTS : 0);
+
+	fd_serial   = port_open();
 	fd_terminal = 0;
 
+	if(fd_serial < 0) {
+		perror(ttydev);
+		exit(1);
+	}
+
 	if(use_custom_baudrate) {
-		int s2 = set_speed(fd_serial, baudrate);
-		msg("Custom baudrate %d\n", s2);
+		msg("Custom baudrate %d", port.custom_speed);
 	}
 
 	int baudrate2 = serial_get_speed(fd_serial);
@@ -140,229 +544,1063 @@ int main(int argc, char **argv)
 			xonxoff ? " (XON/XOFF)": ""
 			);
 
+	if(sniff_dev[0]) {
+		int bpc = 1 + 8 + port.parity + port.stopbits;
+		double char_time = (double)bpc / port.baudrate;
+
+		sniff_char_time = char_time;
+		if(!strchr(sniff_dev, '/')) {
+			char tmp[32];
+			snprintf(tmp, sizeof tmp, "%.31s", sniff_dev);
+			snprintf(sniff_dev, sizeof sniff_dev, "/dev/%s", tmp);
+		}
+		fd_sniff = serial_open(sniff_dev, port.baudrate, rtscts, xonxoff, stopbits, parity);
+		if(fd_sniff < 0) {
+			perror(sniff_dev);
+			exit(1);
+		}
+		if(port.custom) set_speed(fd_sniff, port.baudrate);
+		set_noncanonical(fd_sniff, NULL);
+
+		if(sniff_gap <= 0) sniff_gap = char_time * 20 > 1E-3 ? char_time * 20 : 1E-3;
+		sniff_init(char_time, sniff_gap, on_sniff_emit);
+		mainloop_handler_name((void *)on_sniff_read, "sniff_read");
+		msg("Sniffing A=%s B=%s, frame gap %.1f ms", ttydev, sniff_dev, sniff_gap * 1E3);
+	}
+
 	mainloop_signal_add(SIGINT, on_sigint, NULL);
 
-	serial_set_dtr(fd_serial, set_dtr);
-	serial_set_rts(fd_serial, set_rts);
+	mainloop_handler_name((void *)on_serial_read, "serial_read");
+	mainloop_handler_name((void *)on_terminal_read, "terminal_read");
+	mainloop_handler_name((void *)on_status_timer, "status_timer");
+	mainloop_handler_name((void *)on_sigint, "sigint");
+	mainloop_handler_name((void *)on_render_timer, "render_timer");
+	mainloop_handler_name((void *)on_serial_read_headless, "serial_read");
+	mainloop_handler_name((void *)on_serial_splice, "serial_splice");
+	mainloop_handler_name((void *)on_coalesce_timer, "coalesce_timer");
+	mainloop_handler_name((void *)on_flush_timer, "flush_timer");
+	mainloop_handler_name((void *)on_reconnect_timer, "reconnect_timer");
+	mainloop_handler_name((void *)on_sighup, "sighup");
+	mainloop_instrument(profile);
+	pipeline_instrument(profile);
+
+	if(json_addr) {
+		if(json_sock_listen(json_addr) < 0) {
+			msg("Error opening JSON socket %s: %s", json_addr, strerror(errno));
+		} else {
+			msg("Serving JSON records on %s", json_addr);
+		}
+	}
+
+	if(metrics_addr) {
+		if(metrics_listen(metrics_addr, ttydev) < 0) {
+			msg("Error opening metrics socket %s: %s", metrics_addr, strerror(errno));
+		} else {
+			msg("Serving metrics on %s", metrics_addr);
+		}
+	}
+
+	if(headless) {
+		if(daemonized) {
+			if(daemon(1, 0) != 0) {
+				msg("Error daemonizing: %s", strerror(errno));
+				exit(1);
+			}
+			openlog("iterm", LOG_PID, LOG_DAEMON);
+			shmring_owner();
+		}
+		if(pidfile) {
+			FILE *f = fopen(pidfile, "w");
+			if(f) {
+				fprintf(f, "%d\n", (int)getpid());
+				fclose(f);
+			} else {
+				msg("Error writing pidfile %s: %s", pidfile, strerror(errno));
+			}
+		}
+		mainloop_signal_add(SIGTERM, on_sigint, NULL);
+		mainloop_signal_add(SIGHUP, on_sighup, NULL);
+		if(splice_mode) {
+			int fd_out = daemonized ? -1 : 1;
+			if(fd_log) fd_log_raw = log_open_raw(log_fname);
+			if((fd_out < 0 && fd_log_raw < 0) || splice_open(fd_serial, fd_out, fd_log_raw) != 0) {
+				msg("Error setting up splice: %s", (fd_out < 0 && fd_log_raw < 0) ? "no destination" : strerror(errno));
+				exit(1);
+			}
+			serial_handler = on_serial_splice;
+		} else {
+			serial_handler = fd_sniff >= 0 ? on_sniff_read : on_serial_read_headless;
+			mainloop_timer_add(0, 200, on_flush_timer, NULL);
+		}
+		mainloop_fd_add(fd_serial, FD_READ, serial_handler, NULL);
+	} else {
+		set_noncanonical(fd_terminal, &save);
+		serial_handler = fd_sniff >= 0 ? on_sniff_read : on_serial_read;
+		mainloop_fd_add(fd_serial, FD_READ, serial_handler, NULL);
+		mainloop_fd_add(fd_terminal, FD_READ, on_terminal_read, NULL);
+		if(render_decimate) set_render_decimate(1);
+	}
+
+	if(fd_sniff >= 0) mainloop_fd_add(fd_sniff, FD_READ, on_sniff_read, (void *)1);
 
-	set_noncanonical(fd_serial, NULL);
-	set_noncanonical(fd_terminal, &save);
+	if(use_uring) start_uring();
 
-	mainloop_fd_add(fd_serial, FD_READ, on_serial_read, NULL);
-	mainloop_fd_add(fd_terminal, FD_READ, on_terminal_read, NULL);
 	mainloop_timer_add(0, 100, on_status_timer, NULL);
 
+	txpace_set_line(port.baudrate, 1 + 8 + port.parity + port.stopbits);
+	txpace_start(serial_send, serial_outq, on_txpace_done);
+	if(txpace_enabled()) {
+		char tmp[80];
+		txpace_describe(tmp, sizeof tmp);
+		msg("Pacing TX: %s", tmp);
+	}
+
+	if(autobaud) start_autobaud();
+	if(linktest_order) start_linktest();
+
+	if(flightrec_file) msg("Recording to %s", flightrec_file);
+	if(shmring_name) msg("Publishing to shared memory ring %s", shmring_name);
+
+	if(rt_prio > 0) {
+		struct rt_result r;
+		if(rt_enable(rt_prio, rt_cpu, &r) == 0) {
+			msg("Real-time: SCHED_FIFO priority %d%s, memory locked", rt_prio, rt_cpu >= 0 ? ", pinned" : "");
+		}
+		if(r.sched) msg("Warning: SCHED_FIFO not available (%s), needs CAP_SYS_NICE or RLIMIT_RTPRIO", strerror(r.sched));
+		if(r.affinity) msg("Warning: can not pin to CPU %d (%s)", rt_cpu, strerror(r.affinity));
+		if(r.mlock) msg("Warning: memory not locked (%s), needs CAP_IPC_LOCK or RLIMIT_MEMLOCK", strerror(r.mlock));
+	} else if(rt_cpu >= 0) {
+		int e = rt_pin(rt_cpu);
+		if(e == 0) msg("Pinned to CPU %d", rt_cpu);
+		else msg("Warning: can not pin to CPU %d (%s)", rt_cpu, strerror(e));
+	}
+	if(rt_prio >= 0) rt_probe_start();
+
 	mainloop_run();
 
-	msg("Exit");
+	if(profile) mainloop_profile_dump(stdout);
 
-	tcsetattr (fd_terminal, TCSANOW, &save);
-	return(0);
-}
+	if(splice_mode) {
+		msg("Moved %llu bytes: %llu spliced, %llu copied through user space",
+				(unsigned long long)stats.rx_bytes,
+				(unsigned long long)stats.splice_bytes,
+				(unsigned long long)stats.copy_bytes);
+		splice_close();
+	}
 
+	if(fd_sniff >= 0) {
+		sniff_flush();
+		on_sniff_emit(-1, 0, 1, NULL, 0);
+		fflush(stdout);
+	}
 
-static void set_hex_mode(int onoff)
-{
-	if(onoff) {
-		hex_buf[0] = '\0';
-		hex_off = 0;
-		hex_mode = 1;
+	dedup_flush(&dedup_screen);
+	dedup_flush(&dedup_log);
+	flightrec_close();
+	shmring_close();
+
+	msg("Exit");
+
+	if(headless) {
+		on_flush_timer(NULL);
+		if(pidfile) unlink(pidfile);
 	} else {
-		printf("\n");
-		hex_mode = 0;
+		tcsetattr (fd_terminal, TCSANOW, &save);
 	}
-	msg("Hex mode %s", onoff ? "enabled" : "disabled");
+	return(exit_code);
 }
 
 
-static int get_baudrate(const char *s)
+/*
+ * Open the serial port with the configured settings, restoring custom
+ * speed and the DTR/RTS lines
+ */
+
+static int port_open(void)
 {
-	char *p;
-	int baudrate = atoi(s);
+	int fd;
 
-	if(baudrate == 0) return 0;
+	fd = serial_open(port.dev, port.baudrate, port.rtscts, port.xonxoff, port.stopbits, port.parity);
+	if(fd < 0) return -1;
 
-	p = strchr(s, 'k');
-	if(p) baudrate = baudrate * 1000 + atoi(p+1) * 100;
-	
-	p = strchr(s, 'm');
-	if(p) baudrate = baudrate * 1000000 + atoi(p+1) * 100000;
+	if(port.custom) port.custom_speed = set_speed(fd, port.baudrate);
+	serial_set_dtr(fd, !!(port.mctrl & TIOCM_DTR));
+	serial_set_rts(fd, !!(port.mctrl & TIOCM_RTS));
+	set_noncanonical(fd, NULL);
 
-	return baudrate;
+	return fd;
 }
 
 
-static void terminal_write(uint8_t c, int local)
+static void port_reconnect(void)
 {
-	char hex[3];
+	int fd;
 
-	if(hex_mode) {
+	if(fd_serial >= 0) return;
 
-		if((hex_off % 16) == 0) {
-			if(hex_buf[0]) {
-				printf("%s\n", hex_buf);
-				fflush(stdout);
-			}
-			sprintf(hex_buf, "\r%08x                                                    |                |", hex_off);
-		}
+	fd = port_open();
+	if(fd < 0) return;
+
+	fd_serial = fd;
+	if(splice_mode) splice_set_source(fd);
+	mainloop_fd_add(fd_serial, FD_READ, serial_handler, NULL);
+	if(!splice_mode) mainloop_readahead(fd_serial, 1);
+	devwatch_stop();
+	mainloop_timer_del(on_reconnect_timer, NULL);
 
-		int col = hex_off % 16;
-		char *p1 = hex_buf + col * 3 + 11 + (col > 7);
-		char *p2 = hex_buf + col + 62;
-		hex_off ++;
+	stats.reconnects ++;
+	msg("Reconnected to %s after %.0f ms", port.dev, (mono_sec() - t_lost) * 1E3);
+	log_mark("reconnect", "reconnected after %.0f ms", (mono_sec() - t_lost) * 1E3);
+}
 
-		snprintf(hex, sizeof hex, "%02x", c);
-		memcpy(p1, hex, 2);
-		*p2 = isprint(c) ? c : '.';
 
-		printf("%s", hex_buf);
+/*
+ * Fallback in case inotify misses the device
+ */
 
-	} else {
+static int on_reconnect_timer(void *data)
+{
+	port_reconnect();
+	return fd_serial < 0;
+}
 
-		if(timestamp) {
 
-			putchar(c);
+/*
+ * The serial port failed. Without -a this ends the session, otherwise the
+ * port is closed and reopened as soon as the device node reappears
+ */
 
-			if(c == '\n') {
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				struct tm *tm = localtime(&tv.tv_sec);
-				char tbuf[32] = "";
-				strftime(tbuf, sizeof tbuf, "%H:%M:%S", tm);
-				printf("\e[1;30m%s.%03d\e[0m ", tbuf, (int)(tv.tv_usec / 1E3));
-			}
+static void port_lost(const char *reason)
+{
+	/* Auto baud and the link test drive the port and can not carry on without it */
 
-		} else {
-			putchar(c);
-		}
+	if(autobaud_active()) {
+		autobaud_stop();
+		msg("Auto baud cancelled");
+	}
+	if(linktest_active()) {
+		linktest_stop();
+		msg("Link test aborted");
+		exit_code = 1;
+		mainloop_stop();
 	}
 
-	fflush(stdout);
+	if(!reconnect) {
+		msg("Error on serial port: %s", reason);
+		mainloop_stop();
+		return;
+	}
+
+	if(fd_serial < 0) return;
+
+	msg("Lost %s: %s, waiting for it to return", port.dev, reason);
+	log_mark("disconnect", "lost port: %s", reason);
 
+	mainloop_fd_del(fd_serial, FD_READ, serial_handler, NULL);
+	mainloop_readahead(fd_serial, 0);
+	close(fd_serial);
+	fd_serial = -1;
+	serial_parked = 0;
+	stats_port_reset();
+	t_lost = mono_sec();
+
+	if(devwatch_start(port.dev, port_reconnect) != 0) {
+		msg("Can not watch for %s: %s", port.dev, strerror(errno));
+	}
+	mainloop_timer_add(1, 0, on_reconnect_timer, NULL);
 }
 
 
-static void serial_write(uint8_t c)
+/*
+ * Auto baud: extra (custom) rates given with -A are tried first, then
+ * the standard rates from 1200 up, the most common ones first
+ */
+
+static void on_autobaud_done(int rate, double score)
 {
-	int r;
-	
-	r = write(fd_serial, &c, 1);
-	if(r < 0) {
-		msg("Error writing to serial port: %s", strerror(errno));
-		mainloop_stop();
+	int list[32];
+	int i, n;
+
+	if(rate <= 0) {
+		msg("Auto baud: no usable rate found");
 		return;
 	}
-	if(echo) terminal_write(c, 1);
+
+	port.baudrate = rate;
+	port.custom = 1;
+	n = serial_get_speed_list(list, 32);
+	for(i=0; i<n; i++) {
+		if(list[i] == rate) port.custom = 0;
+	}
+
+	txpace_set_line(rate, 1 + 8 + port.parity + port.stopbits);
+	msg("Auto baud: locked at %d bps (score %.2f)", rate, score);
 }
 
 
-static int on_serial_read(int fd, void *data)
+static void start_autobaud(void)
 {
-	uint8_t buf[128];
-	uint8_t *p = buf;
-	int len;
+	static const int common[] = { 115200, 9600, 57600, 38400, 19200, 230400, 460800, 921600 };
+	int std[32];
+	int rates[64];
+	int i, j, n = 0;
 
-	len = read(fd_serial, buf, sizeof(buf));
-	if(len <= 0) {
-		if(len == 0) {
-			msg("Serial port closed");
-		} else {
-			msg("Error reading from serial port: %s", strerror(errno));
-		}
-		mainloop_stop();
-	}
+	if(autobaud_rates) n = parse_rates(autobaud_rates, rates, 16);
 
-	log_write(buf, len);
+	for(i=0; i<sizeof(common)/sizeof(common[0]); i++) rates[n++] = common[i];
 
-	while(len--) terminal_write(*p++, 0);
+	int n_std = serial_get_speed_list(std, 32);
+	for(i=0; i<n_std; i++) {
+		int dup = std[i] < 1200;
+		for(j=0; j<n; j++) if(rates[j] == std[i]) dup = 1;
+		if(!dup && n < 64) rates[n++] = std[i];
+	}
 
-	return 0;
+	msg("Auto baud: scanning %d rates", n);
+	autobaud_start(fd_serial, rates, n, on_autobaud_done);
 }
 
 
-struct mctrl {
-	char *name_up;
-	char *name_down;
-	int mask;
-} mctrl_list[] = {
-	{ "DTR", "dtr", TIOCM_DTR },
-	{ "DSR", "dsr", TIOCM_DSR },
-	{ "DCD", "dcd", TIOCM_CD  },
-	{ "RTS", "rts", TIOCM_RTS },
-	{ "CTS", "cts", TIOCM_CTS },
-	{ "RI" , "ri" , TIOCM_RI },
-};
+/*
+ * Link qualification with PRBS over a loopback, at the configured rate or
+ * sweeping the rates given with -Q. The session ends when done.
+ */
 
-void show_modemstatus(void)
+static void on_linktest_report(const struct linktest_result *r)
 {
-	char buf[64];
-	char *p = buf;
-	static int pstatus = -1;
-	int i;
+	double pct = r->line_rate > 0 ? r->rx_rate * 100.0 / r->line_rate : 0;
 
-	int status = serial_get_mctrl(fd_serial);
+	if(!r->final) {
+		msg("PRBS-%d @ %d: %.0f s, %.0f of %.0f B/s (%.0f%%), %llu errors%s",
+				r->order, r->rate, r->secs, r->rx_rate, r->line_rate, pct,
+				(unsigned long long)r->errors, r->synced ? "" : ", no sync");
+		return;
+	}
 
-	for(i=0; i<sizeof(mctrl_list) / sizeof(mctrl_list[0]); i++) {
-		struct mctrl *m = &mctrl_list[i];
-		char *updown = " ";
+	msg("PRBS-%d @ %d: %s, BER %.2e (%llu errors in %llu bits)",
+			r->order, r->rate, r->stable ? "stable" : "FAIL", r->ber,
+			(unsigned long long)r->errors, (unsigned long long)r->bits);
+	msg("  %llu bursts (longest %llu bits), %llu sync losses%s",
+			(unsigned long long)r->bursts, (unsigned long long)r->burst_max,
+			(unsigned long long)r->sync_losses, r->synced ? "" : ", not in sync at end");
+	msg("  rx %llu of %llu bytes, %.0f of %.0f B/s (%.1f%%)",
+			(unsigned long long)r->rx_bytes, (unsigned long long)r->tx_bytes,
+			r->rx_rate, r->line_rate, pct);
+}
 
-		if(pstatus != -1) {
-			if((status & m->mask) && !(pstatus & m->mask)) updown = "↗";
-			if(!(status & m->mask) && (pstatus & m->mask)) updown = "↘";
-		}
-		
-		p += sprintf(p, "[%s%s] ", 
-				(status & m->mask) ? m->name_up : m->name_down,
-				updown);
+
+static void on_linktest_done(int best_rate)
+{
+	if(best_rate > 0) {
+		msg("Highest stable rate: %d bps", best_rate);
+	} else {
+		msg("No stable rate found");
+		exit_code = 2;
 	}
 
-	msg(buf);
-	
-	pstatus = status;
+	mainloop_stop();
 }
 
 
-static int on_status_timer(void *data)
+static void start_linktest(void)
 {
-	static int pstatus = -1;
-	int status;
+	int rates[32];
+	int n = 0;
+	int bpc = 1 + 8 + port.parity + port.stopbits;
 
-	status = serial_get_mctrl(fd_serial);
+	if(linktest_rates) n = parse_rates(linktest_rates, rates, 32);
+	if(n == 0) rates[n++] = port.baudrate;
 
-	if(pstatus != -1 && status != pstatus) {
-		show_modemstatus();
+	if(linktest_start(fd_serial, linktest_order, linktest_secs, rates, n, bpc,
+				on_linktest_report, on_linktest_done) != 0) {
+		msg("Invalid link test: PRBS-%d for %d s, use prbs7, prbs15 or prbs23", linktest_order, linktest_secs);
+		exit_code = 1;
+		mainloop_stop();
+		return;
 	}
 
-	pstatus = status;
-	return 1;
+	msg("Link test PRBS-%d, %d s per rate, loop back TX to RX", linktest_order, linktest_secs);
 }
 
 
-static int on_terminal_read(int fd, void *data)
+static void set_hex_mode(int onoff)
 {
-	uint8_t c;
-	static int in_hex;
-	static int escape = 0;
-	static int hexval = 0;
-	int r;
+	if(onoff) {
+		hexdump_reset();
+		hex_mode = 1;
+	} else {
+		hexdump_finish(hex_out);
+		hex_mode = 0;
+	}
+	stages_update();
+	msg("Hex mode %s", onoff ? "enabled" : "disabled");
+}
 
-	r = read(fd_terminal, &c, 1);
-	if(r < 0) {
-		msg("Error reading from terminal");
-		mainloop_stop();
-		return 0;
+
+/*
+ * Parse a comma separated list of rates
+ */
+
+static int parse_rates(const char *s, int *rates, int max)
+{
+	int n = 0;
+
+	while(*s && n < max) {
+		char tmp[16];
+		size_t l = strcspn(s, ",");
+		snprintf(tmp, sizeof tmp, "%.*s", (int)l, s);
+		int r = get_baudrate(tmp);
+		if(r > 0) rates[n++] = r;
+		s += l;
+		if(*s == ',') s ++;
 	}
 
-	log_write(&c, 1);
+	return n;
+}
+
+
+static int get_baudrate(const char *s)
+{
+	char *p;
+	int baudrate = atoi(s);
+
+	if(baudrate == 0) return 0;
+
+	p = strchr(s, 'k');
+	if(p) baudrate = baudrate * 1000 + atoi(p+1) * 100;
 	
-	if(escape) {
-		
-		c = tolower(c);
+	p = strchr(s, 'm');
+	if(p) baudrate = baudrate * 1000000 + atoi(p+1) * 100000;
+
+	return baudrate;
+}
+
+
+/*
+ * Render decimation. When the device produces more than the terminal can
+ * show, rendering is limited to a byte budget per frame at a fixed frame
+ * rate. Output that does not fit the budget is dropped from the screen
+ * only; the most recent part is kept and shown as a tail at the next frame,
+ * preceded by a marker with the amount of data skipped. The log gets
+ * every byte regardless.
+ */
+
+static void render_tail_add(const uint8_t *buf, size_t len)
+{
+	size_t size = sizeof render_tail;
+
+	if(len > size) {
+		buf += len - size;
+		len = size;
+	}
+
+	while(len > 0) {
+		size_t off = render_tail_head % size;
+		size_t n = size - off;
+		if(n > len) n = len;
+		memcpy(render_tail + off, buf, n);
+		render_tail_head += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+
+static void stage_render(struct stage *s, const struct chunk *c)
+{
+	const uint8_t *buf = c->buf;
+	size_t len = c->len;
+
+	if(c->flags) {
+		stage_emit(s, c);
+		return;
+	}
+
+	if(render_skipped == 0) {
+		size_t n = len < render_credit ? len : render_credit;
+		if(n > 0) stage_emit_buf(s, buf, n, 0);
+		render_credit -= n;
+		buf += n;
+		len -= n;
+	}
+
+	if(len > 0) {
+		render_tail_add(buf, len);
+		render_skipped += len;
+		stats.render_skipped += len;
+		stats.render_backlog = render_skipped;
+	}
+}
+
+
+static char *fmt_size(double v, char *buf, int len)
+{
+	if(v < 1E3) {
+		snprintf(buf, len, "%.0f bytes", v);
+	} else if(v < 1E6) {
+		snprintf(buf, len, "%.1f kB", v / 1E3);
+	} else {
+		snprintf(buf, len, "%.1f MB", v / 1E6);
+	}
+	return buf;
+}
+
+
+/*
+ * The render timer has millisecond resolution; the byte budget of a
+ * frame follows the interval actually used, so rates that do not divide
+ * 1000 keep the configured bytes/sec
+ */
+
+static int render_interval(void)
+{
+	return 1000 / render_fps;
+}
+
+
+/*
+ * Byte budget of the next frame. The fraction of a byte left over is
+ * carried to the next frame, so budgets below one byte per frame still
+ * render at the configured rate.
+ */
+
+static size_t render_frame(void)
+{
+	static size_t rest;
+	size_t b = (size_t)render_budget * render_interval() + rest;
+
+	rest = b % 1000;
+	return b / 1000;
+}
+
+
+static int on_render_timer(void *data)
+{
+	size_t frame = render_frame();
+
+	if(render_skipped > 0) {
+
+		/* 
+		 * Show the tail, using at most half of the frame budget, and
+		 * starting at a line boundary when not in hex mode
+		 */
+
+		size_t size = sizeof render_tail;
+		size_t n = render_skipped < size ? render_skipped : size;
+		if(n > frame / 2) n = frame / 2;
+
+		uint8_t tail[sizeof render_tail];
+		size_t i;
+		for(i=0; i<n; i++) {
+			tail[i] = render_tail[(render_tail_head - n + i) % size];
+		}
+
+		uint8_t *p = tail;
+		if(!hex_mode) {
+			uint8_t *nl = memchr(tail, '\n', n);
+			if(nl && nl < tail + n - 1) p = nl + 1;
+		}
+
+		char tmp[32];
+		size_t shown = tail + n - p;
+		if(hex_mode) {
+			hexdump_finish(hex_out);
+			hexdump_skip(render_skipped - shown);
+		} else if(render_col) {
+			putchar('\n');
+		}
+		msg("… %s skipped …", fmt_size(render_skipped - shown, tmp, sizeof tmp));
+		stage_emit_buf(&st_render, p, shown, 0);
+		pipeline_flush(&pl_screen);
+		render_skipped = 0;
+	}
+
+	render_credit = frame;
+	stats.render_backlog = 0;
+
+	return render_decimate;
+}
+
+
+static void set_render_decimate(int onoff)
+{
+	render_decimate = onoff;
+	stages_update();
+
+	if(onoff) {
+		render_credit = render_frame();
+		mainloop_timer_add(0, render_interval(), on_render_timer, NULL);
+		msg("Render decimation at %d fps, %d bytes/sec", render_fps, render_budget);
+	} else {
+		mainloop_timer_del(on_render_timer, NULL);
+		if(render_skipped > 0) on_render_timer(NULL);
+		msg("Full rendering");
+	}
+}
+
+
+/*
+ * Write to the port right away
+ */
+
+static void serial_send(const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	int r;
+
+	if(fd_serial < 0) {
+		msg("Not connected, dropped %d bytes", (int)len);
+		return;
+	}
+
+	while(done < len) {
+		r = write(fd_serial, buf + done, len - done);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) {
+				/* Only while the link test has the port */
+				msg("Port busy, dropped %d bytes", (int)(len - done));
+				break;
+			}
+			port_lost(strerror(errno));
+			return;
+		}
+		done += r;
+		stats.tx_bytes += r;
+		stats.tx_writes ++;
+	}
+	if(frame_proto) frame_feed(&frame_tx, buf, len);
+	chain_write(&pl_shm, buf, len, CHUNK_TX);
+	chain_write(&pl_json, buf, len, CHUNK_TX);
+	if(echo) chain_write(&pl_screen, buf, len, CHUNK_TX);
+}
+
+
+static int serial_outq(void)
+{
+	return fd_serial < 0 ? -1 : serial_get_outq(fd_serial);
+}
+
+
+/*
+ * Write to the port, through the pacing queue if enabled. Data typed
+ * while a paced transfer is in progress is queued behind it.
+ */
+
+static void serial_write_buf(const uint8_t *buf, size_t len)
+{
+	if(txpace_enabled()) {
+		size_t n = txpace_write(buf, len);
+		if(n < len) msg("TX queue full, dropped %d bytes", (int)(len - n));
+		return;
+	}
+
+	serial_send(buf, len);
+}
+
+
+static void on_txpace_done(const struct txpace_report *r)
+{
+	char b[3][16];
+
+	if(r->bytes < 2) return;
+
+	msg("Paced %llu bytes in %.1f ms, planned %.1f ms (%.1f%%), %llu holds, late p50 %s p99 %s max %s",
+			(unsigned long long)r->bytes, r->elapsed * 1E3, r->target * 1E3,
+			r->target > 0 ? r->elapsed * 100.0 / r->target : 100.0,
+			(unsigned long long)r->holds,
+			hist_fmt_nsec(r->late_p50, b[0], 16),
+			hist_fmt_nsec(r->late_p99, b[1], 16),
+			hist_fmt_nsec(r->late_max, b[2], 16));
+}
+
+
+/*
+ * Hex line input: collect a hex string until enter, decode it and send it
+ * as one burst. A newline with more input pending is part of a paste, and
+ * does not terminate the line.
+ */
+
+static void hexline_prompt(void)
+{
+	printf("\r\e[K\e[1;30mhex>\e[0m ");
+	fflush(stdout);
+}
+
+
+static void hexline_send(void)
+{
+	uint8_t buf[sizeof hexline];
+	size_t errpos = 0;
+	int n;
+
+	putchar('\n');
+	n = hex_decode(hexline, hexline_len, buf, sizeof buf, &errpos);
+	hexline_len = 0;
+
+	if(n < 0) {
+		msg("Invalid hex input at position %d", (int)errpos);
+		return;
+	}
+	if(n == 0) return;
+
+	double t1 = mono_sec();
+	chain_write(&pl_tx, buf, n, CHUNK_TEXT);
+	double t2 = mono_sec();
+	if(fd_sniff >= 0 || fd_serial < 0) return;
+
+	int bpc = 1 + 8 + port.parity + port.stopbits;
+	int baudrate = serial_get_speed(fd_serial);
+	double wire = baudrate ? n * bpc * 1E3 / baudrate : 0.0;
+
+	/* With pacing the data only went into the queue */
+
+	if(txpace_enabled()) {
+		msg("Queued %d bytes, %.2f ms on the wire", n, wire);
+	} else {
+		msg("Sent %d bytes in %.1f us, %.2f ms on the wire", n, (t2 - t1) * 1E6, wire);
+	}
+	hexline_t_sent = t2;
+}
+
+
+static void hexline_input(uint8_t c)
+{
+	int pending = 0;
+
+	if(c == '\r' || c == '\n') {
+		ioctl(fd_terminal, FIONREAD, &pending);
+		if(pending == 0) {
+			in_hexline = 0;
+			hexline_send();
+			return;
+		}
+		c = '\n';
+		printf("\r\n");
+	} else if(c == 0x7f || c == 0x08) {
+		if(hexline_len > 0 && hexline[hexline_len-1] != '\n') {
+			hexline_len --;
+			printf("\b \b");
+		}
+	} else if(c == 0x1b || c == 0x03) {
+		in_hexline = 0;
+		hexline_len = 0;
+		putchar('\n');
+		msg("Hex input cancelled");
+		return;
+	} else {
+		putchar(c);
+	}
+
+	if(c != 0x7f && c != 0x08 && hexline_len < sizeof(hexline)) {
+		hexline[hexline_len++] = c;
+	}
+
+	fflush(stdout);
+}
+
+
+/*
+ * Read profile handling. In the bulk profile the port is parked after a
+ * read: it is not watched for the coalescing window, after which all
+ * data that came in meanwhile is read at once. Once a window passes
+ * without data the port is watched again.
+ */
+
+static int on_coalesce_timer(void *data)
+{
+	int n = 0;
+
+	if(fd_serial < 0 || !serial_parked) return 0;
+
+	if(ioprof_bulk() && ioctl(fd_serial, TIOCINQ, &n) == 0 && n + mainloop_read_pending(fd_serial) > 0) {
+		stats.rx_coalesced ++;
+		serial_handler(fd_serial, NULL);
+		return fd_serial >= 0;
+	}
+
+	serial_parked = 0;
+	mainloop_fd_add(fd_serial, FD_READ, serial_handler, NULL);
+	return 0;
+}
+
+
+/*
+ * Read from the serial port. Data the kernel already read ahead is taken
+ * as a whole: small reads would only add latency from here on.
+ */
+
+static int serial_read(int fd, uint8_t *buf, size_t len)
+{
+	if(mainloop_read_pending(fd) == 0) len = ioprof_read_size(fd, len);
+	return mainloop_read(fd, buf, len);
+}
+
+
+static void serial_rx_account(size_t len)
+{
+	stats.rx_bytes += len;
+	stats.rx_reads ++;
+
+	if(ioprof_account(len)) stats.io_switches ++;
+
+	if(ioprof_bulk() && !serial_parked && fd_serial >= 0) {
+		mainloop_fd_del(fd_serial, FD_READ, serial_handler, NULL);
+		serial_parked = 1;
+		mainloop_timer_add(0, ioprof_coalesce_msec(), on_coalesce_timer, NULL);
+	}
+}
+
+
+static int on_serial_read(int fd, void *data)
+{
+	static uint8_t buf[65536];
+	int len;
+
+	len = serial_read(fd_serial, buf, sizeof(buf));
+	if(len <= 0) {
+		if(len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+		port_lost(len ? strerror(errno) : "closed");
+		return 0;
+	}
+
+	serial_rx_account(len);
+
+	if(autobaud_active()) {
+		autobaud_feed(buf, len);
+		return 0;
+	}
+
+	if(linktest_active()) {
+		linktest_feed(buf, len);
+		return 0;
+	}
+
+	if(hexline_t_sent > 0) {
+		msg("Response after %.2f ms", (mono_sec() - hexline_t_sent) * 1E3);
+		hexline_t_sent = 0;
+	}
+
+	if(frame_proto) {
+		flightrec_write(buf, len);
+		chain_write(&pl_shm, buf, len, 0);
+		frame_feed(&frame_rx, buf, len);
+		return 0;
+	}
+
+	rx_write(buf, len);
+
+	return 0;
+}
+
+
+struct mctrl {
+	char *name_up;
+	char *name_down;
+	int mask;
+} mctrl_list[] = {
+	{ "DTR", "dtr", TIOCM_DTR },
+	{ "DSR", "dsr", TIOCM_DSR },
+	{ "DCD", "dcd", TIOCM_CD  },
+	{ "RTS", "rts", TIOCM_RTS },
+	{ "CTS", "cts", TIOCM_CTS },
+	{ "RI" , "ri" , TIOCM_RI },
+};
+
+void show_modemstatus(void)
+{
+	char buf[64];
+	char *p = buf;
+	static int pstatus = -1;
+	int i;
+
+	int status = serial_get_mctrl(fd_serial);
+
+	for(i=0; i<sizeof(mctrl_list) / sizeof(mctrl_list[0]); i++) {
+		struct mctrl *m = &mctrl_list[i];
+		char *updown = " ";
+
+		if(pstatus != -1) {
+			if((status & m->mask) && !(pstatus & m->mask)) updown = "↗";
+			if(!(status & m->mask) && (pstatus & m->mask)) updown = "↘";
+		}
+		
+		p += sprintf(p, "[%s%s] ", 
+				(status & m->mask) ? m->name_up : m->name_down,
+				updown);
+	}
+
+	msg(buf);
+
+	if(json_sinks) {
+		char out[256];
+		json_emit(out, json_modem(out, port_name, status));
+	}
+	
+	pstatus = status;
+}
+
+
+static void show_stats(void)
+{
+	struct serial_icount ic;
+
+	msg("RX %llu bytes in %llu reads, %.0f B/s (peak %.0f B/s)",
+			(unsigned long long)stats.rx_bytes,
+			(unsigned long long)stats.rx_reads,
+			stats.rx_rate, stats.rx_peak);
+	msg("TX %llu bytes in %llu writes, %.0f B/s (peak %.0f B/s)",
+			(unsigned long long)stats.tx_bytes,
+			(unsigned long long)stats.tx_writes,
+			stats.tx_rate, stats.tx_peak);
+	msg("I/O profile %s: %.0f bytes/read, %.0f reads/MB, %llu coalesced reads, %llu switches",
+			ioprof_name(),
+			stats.rx_reads ? (double)stats.rx_bytes / stats.rx_reads : 0.0,
+			stats.rx_bytes ? stats.rx_reads * 1048576.0 / stats.rx_bytes : 0.0,
+			(unsigned long long)stats.rx_coalesced,
+			(unsigned long long)stats.io_switches);
+	if(use_uring) {
+		msg("Event loop %s: %llu enters, %llu submissions, %llu reads, %llu writes, %.0f enters/MB",
+				mainloop_backend_name(),
+				mainloop_stats.uring_enters,
+				mainloop_stats.uring_sqes,
+				mainloop_stats.uring_reads,
+				mainloop_stats.uring_writes,
+				stats.rx_bytes ? mainloop_stats.uring_enters * 1048576.0 / stats.rx_bytes : 0.0);
+	}
+	msg("Kernel queue: in %d (peak %d), out %d (peak %d)",
+			stats.inq, stats.inq_peak, stats.outq, stats.outq_peak);
+
+	if(render_decimate || stats.render_skipped) {
+		char tmp1[32], tmp2[32];
+		msg("Render: %s, %d fps, %d B/s, skipped %s, backlog %s",
+				render_decimate ? "decimated" : "full", render_fps, render_budget,
+				fmt_size(stats.render_skipped, tmp1, sizeof tmp1),
+				fmt_size(stats.render_backlog + (stats.inq > 0 ? stats.inq : 0), tmp2, sizeof tmp2));
+	}
+
+	if(dedup_cycle) {
+		msg("Collapsed lines: %llu on screen, %llu in log",
+				(unsigned long long)dedup_screen.lines_collapsed,
+				(unsigned long long)dedup_log.lines_collapsed);
+	}
+
+	if(frame_proto) {
+		msg("Frames %s: rx %llu (%llu errors), tx %llu (%llu errors)", frame_proto_name(frame_proto),
+				(unsigned long long)frame_rx.frames, (unsigned long long)frame_rx.errors,
+				(unsigned long long)frame_tx.frames, (unsigned long long)frame_tx.errors);
+	}
+
+	if(rt_wakeup()->count) {
+		const struct hist *h = rt_wakeup();
+		char b[3][16];
+		msg("Wakeup latency: p50 %s, p99 %s, max %s (%llu samples)",
+				hist_fmt_nsec(hist_percentile(h, 50), b[0], 16),
+				hist_fmt_nsec(hist_percentile(h, 99), b[1], 16),
+				hist_fmt_nsec(h->max, b[2], 16),
+				(unsigned long long)h->count);
+	}
+
+	if(shmring_name) {
+		uint64_t lag, lost;
+		char tmp1[32], tmp2[32];
+		int n = shmring_consumers(&lag, &lost);
+		msg("Shared ring %s: %d readers, max lag %s, %s lost by readers", shmring_name, n,
+				fmt_size(lag, tmp1, sizeof tmp1), fmt_size(lost, tmp2, sizeof tmp2));
+	}
+
+	if(txpace_enabled()) {
+		char tmp[80];
+		txpace_describe(tmp, sizeof tmp);
+		msg("Pacing: %s, %llu bytes queued, %llu holds", tmp,
+				(unsigned long long)stats.tx_queued,
+				(unsigned long long)stats.tx_pace_holds);
+	}
+
+	struct pipeline *pp;
+	struct stage *st;
+	for(pp = pipeline_list(); pp; pp = pp->next) {
+		for(st = pp->first; st; st = st->next) {
+			char tmp1[32], tmp2[32], tmp3[32] = "";
+			if(st->chunks == 0) continue;
+			if(profile && st->bytes_in) snprintf(tmp3, sizeof tmp3, ", %.2f ns/byte", (double)st->nsec / st->bytes_in);
+			msg("Stage %s/%s: %llu chunks, %s in, %s out%s", pp->name, st->name,
+					(unsigned long long)st->chunks,
+					fmt_size(st->bytes_in, tmp1, sizeof tmp1),
+					fmt_size(st->bytes_out, tmp2, sizeof tmp2), tmp3);
+		}
+	}
+
+	struct pool *pl;
+	for(pl = pool_list(); pl; pl = pl->next) {
+		msg("Pool %s: %u of %u in use (peak %u), %llu allocs, %llu slab mallocs",
+				pl->name, pl->in_use, pl->capacity, pl->peak,
+				(unsigned long long)pl->allocs, (unsigned long long)pl->mallocs);
+	}
+
+	if(stats.have_icount) {
+		stats_get_errors(&ic);
+		msg("UART: rx %d, tx %d, frame %d, parity %d, overrun %d, buf overrun %d, break %d",
+				ic.rx, ic.tx, ic.frame, ic.parity, ic.overrun, ic.buf_overrun, ic.brk);
+	} else {
+		msg("UART: error counters not supported by driver");
+	}
+}
+
+
+static int on_status_timer(void *data)
+{
+	static int pstatus = -1;
+	int status;
+
+	if(fd_serial < 0) return 1;
+
+	status = serial_get_mctrl(fd_serial);
+	port.mctrl = status & (TIOCM_DTR | TIOCM_RTS);
+
+	if(pstatus != -1 && status != pstatus) {
+		stats.modem_transitions += __builtin_popcount((status ^ pstatus) &
+				(TIOCM_DTR | TIOCM_DSR | TIOCM_CD | TIOCM_RTS | TIOCM_CTS | TIOCM_RI));
+		show_modemstatus();
+	}
+
+	int overruns = stats_sample(fd_serial);
+	if(overruns > 0) {
+		struct serial_icount ic;
+		stats_get_errors(&ic);
+		msg("Warning: %d new overrun(s), %d total", overruns, ic.overrun + ic.buf_overrun);
+	}
+
+	pstatus = status;
+	return 1;
+}
+
+
+static int on_terminal_read(int fd, void *data)
+{
+	uint8_t c;
+	static int in_hex;
+	static int escape = 0;
+	static int hexval = 0;
+	int r;
+
+	r = read(fd_terminal, &c, 1);
+	if(r < 0) {
+		msg("Error reading from terminal");
+		mainloop_stop();
+		return 0;
+	}
+
+	chain_write(&pl_log, &c, 1, CHUNK_TX);
+	
+	if(escape) {
+		
+		c = tolower(c);
 	
 		if(c == '~') {
-			serial_write(c);
+			chain_write(&pl_tx, &c, 1, CHUNK_TEXT);
 			if(echo) {
-				terminal_write(c, 1); 
+				chain_write(&pl_screen, &c, 1, CHUNK_TX);
 			}
 		}
 		
@@ -376,9 +1614,57 @@ static int on_terminal_read(int fd, void *data)
 			show_modemstatus();
 		}
 
+		else if(c == 's') {
+			show_stats();
+		}
+
+		else if(c == 'p') {
+			if(!profile) {
+				profile = 1;
+				mainloop_instrument(1);
+				pipeline_instrument(1);
+				msg("Profiling enabled");
+			} else {
+				mainloop_profile_dump(stdout);
+			}
+		}
+
+		else if(c == 'u') {
+			const char *fname = "iterm-trace.json";
+			int n = mainloop_trace_dump(fname);
+			if(n < 0) {
+				msg("Error writing trace: %s", strerror(errno));
+			} else {
+				msg("Wrote %d trace events to %s", n, fname);
+			}
+		}
+
+		else if(c == 'c') {
+			san_screen.colour = !san_screen.colour;
+			stages_update();
+			msg("Log level colouring %s", san_screen.colour ? "enabled" : "disabled");
+		}
+
+		else if(c == 'f') {
+			set_render_decimate(!render_decimate);
+		}
+
+		else if(c == 'a') {
+			if(autobaud_active()) {
+				autobaud_stop();
+				msg("Auto baud cancelled");
+			} else {
+				start_autobaud();
+			}
+		}
+
 		else if(c == 'b') {
-			tcsendbreak(fd_serial, 1);
-			msg("Break");
+			if(fd_sniff >= 0) {
+				msg("Sniffing, break not sent");
+			} else {
+				tcsendbreak(fd_serial, 1);
+				msg("Break");
+			}
 			fflush(stdout);
 		}
 		
@@ -403,6 +1689,7 @@ static int on_terminal_read(int fd, void *data)
 		
 		else if(c == 't') {
 			timestamp = !timestamp;
+			stages_update();
 			msg("Timestamps %s", timestamp ? "enabled" : "disabled");
 		}
 		
@@ -415,6 +1702,12 @@ static int on_terminal_read(int fd, void *data)
 			in_hex = 1;
 		}
 
+		else if(c == 'w') {
+			in_hexline = 1;
+			hexline_len = 0;
+			hexline_prompt();
+		}
+
 		else if(isdigit(c)) {
 
 			char fname[64];
@@ -424,11 +1717,7 @@ static int on_terminal_read(int fd, void *data)
 				char buf[32000];
 				int l = fread(buf, 1, sizeof buf, f);
 				msg("Writing buffer %c, %d bytes", c, l);
-				if(l > 0) {
-					int i;
-					for(i=0; i<l; i++) serial_write(buf[i]);
-					usleep(100);
-				}
+				if(l > 0) chain_write(&pl_tx, (uint8_t *)buf, l, CHUNK_TEXT);
 				fclose(f);
 			}
 		}
@@ -437,20 +1726,31 @@ static int on_terminal_read(int fd, void *data)
 			msg("~    send tilde");
 			msg(".    exit");
 			msg("0..9 send contents of ~/iterm-<N> to serial port");
+			msg("a    start/cancel baud rate detection");
 			msg("b    send break");
+			msg("c    toggle log level colouring");
 			msg("d    toggle dtr");
 			msg("m    show modem status lines");
+			msg("s    show port statistics");
+			msg("p    enable profiling / show handler latencies");
+			msg("u    dump handler trace to iterm-trace.json");
 			msg("h    toggle hex mode");
+			msg("f    toggle full / decimated rendering");
 			msg("e    toggle echo");
 			msg("l    toggle logging");
 			msg("t    toggle timestamp");
 			msg("xNN  enter hex character NN");
+			msg("w    send hex string, 'crc16'/'crc32' append a CRC");
 		}
 		
 		escape = 0;
 		
 	} 
 	
+	else if(in_hexline) {
+		hexline_input(c);
+	}
+
 	else if(in_hex) {
 	
 		c = tolower(c);
@@ -459,35 +1759,444 @@ static int on_terminal_read(int fd, void *data)
 		
 		hexval = (hexval << 4) + c;
 
-		if(++in_hex > 2) {
-			serial_write(hexval);
-			in_hex = 0;
+		if(++in_hex > 2) {
+			uint8_t b = hexval;
+			chain_write(&pl_tx, &b, 1, CHUNK_TEXT);
+			in_hex = 0;
+		}
+		
+	}
+		
+	
+	else {
+		if(c == '~') {
+			escape = 1;
+		} else {
+			chain_write(&pl_tx, &c, 1, 0);
+		}
+	}
+	
+	return 0;
+}	
+
+
+/*
+ * Sniffer: port A is the main port, B the second one given with -X. Data
+ * is never written to either port, chunks are handed to the merger and
+ * come back in time order through on_sniff_emit()
+ */
+
+static int on_sniff_read(int fd, void *data)
+{
+	static uint8_t buf[4096];
+	int dir = data != NULL;
+	int len;
+
+	len = mainloop_read(fd, buf, sizeof(buf));
+	if(len <= 0) {
+		if(len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+		if(dir == 0) {
+			port_lost(len ? strerror(errno) : "closed");
+		} else {
+			msg("Error on %s: %s", sniff_dev, len ? strerror(errno) : "closed");
+			mainloop_fd_del(fd, FD_READ, on_sniff_read, data);
+			mainloop_readahead(fd, 0);
+			close(fd);
+			fd_sniff = -1;
+		}
+		return 0;
+	}
+
+	stats.rx_bytes += len;
+	stats.rx_reads ++;
+
+	sniff_feed(dir, buf, len);
+	return 0;
+}
+
+
+static void sniff_put(const char *s, size_t n)
+{
+	if(!(json_sinks & JSON_TERM) && !daemonized) fwrite(s, 1, n, stdout);
+
+	if(log_enable && fd_log && !(json_sinks & JSON_LOG)) {
+		fwrite(s, 1, n, fd_log);
+		stats.log_bytes += n;
+		if(headless) stats.log_pending += n;
+	}
+}
+
+
+static void sniff_colour(int dir)
+{
+	static const char *colour[] = { "\e[32m", "\e[33m" };
+
+	if(have_tty && !(json_sinks & JSON_TERM)) fputs(dir < 0 ? "\e[0m" : colour[dir], stdout);
+}
+
+
+/*
+ * Decoded frame: one line with direction, length, status and payload, as
+ * text if it is all printable, in hex otherwise. The JSON sinks get the
+ * whole payload as a record.
+ */
+
+static void on_frame(int dir, const uint8_t *buf, size_t len, int status)
+{
+	char line[256];
+	const char *st = "";
+	size_t i, n, show;
+	int text = 1;
+
+	if(status & FRAME_OVERFLOW) st = "overflow";
+	else if(status & FRAME_ABORT) st = "abort";
+	else if(status & FRAME_TRUNCATED) st = "truncated";
+	else if(status & FRAME_BAD_ESCAPE) st = "bad esc";
+	else if(status & FRAME_CRC_BAD) st = "CRC BAD";
+	else if(status & FRAME_CRC_OK) st = "crc ok";
+
+	for(i=0; i<len && text; i++) text = buf[i] >= 0x20 && buf[i] < 0x7f;
+
+	n = snprintf(line, sizeof line, "%s %4zu %-9s ", dir ? "tx" : "rx", len, st);
+	if(text) {
+		show = len < 64 ? len : 64;
+		n += snprintf(line + n, sizeof line - n, "\"%.*s\"", (int)show, buf);
+	} else {
+		show = len < 32 ? len : 32;
+		for(i=0; i<show; i++) n += snprintf(line + n, sizeof line - n, "%02x ", buf[i]);
+		if(show) n--;
+	}
+	n += snprintf(line + n, sizeof line - n, "%s\n", show < len ? " ..." : "");
+
+	if(json_sinks) {
+		static char out[JSON_RECORD_MAX(FRAME_MAX)];
+		json_emit(out, json_data(out, port_name, dir ? "tx-frame" : "rx-frame", buf, len));
+	}
+
+	chain_write(&pl_log, (uint8_t *)line, n, CHUNK_MARKER);
+
+	if(!(json_sinks & JSON_TERM)) {
+		char out[sizeof line + 16];
+		const char *colour = (status & FRAME_ERRORS) ? "\e[31m" : dir ? "\e[33m" : "\e[32m";
+		int l = snprintf(out, sizeof out, "%s%.*s%s\n", have_tty ? colour : "", (int)n - 1, line, have_tty ? "\e[0m" : "");
+		chain_write(&pl_screen, (uint8_t *)out, l, CHUNK_MARKER);
+	}
+}
+
+
+/*
+ * Every frame starts a line with its time relative to the first frame and
+ * the direction. In hex mode lines are wrapped at 16 bytes, in text mode
+ * non printable characters are escaped and a newline ends the frame.
+ */
+
+static void on_sniff_emit(int dir, double t, int newframe, const uint8_t *buf, size_t len)
+{
+	static double t0 = -1;
+	static int line_open = 0;
+	static int col;
+	static const char *label[] = { "A>", "B>" };
+	char tmp[64];
+	size_t i;
+	int n;
+
+	if(dir < 0) {
+		if(line_open) sniff_put("\n", 1);
+		line_open = 0;
+		return;
+	}
+
+	if(json_sinks) {
+		static char out[JSON_RECORD_MAX(4096)];
+		size_t l = len < 4096 ? len : 4096;
+		json_emit(out, json_data(out, dir ? sniff_dev : port_name, "rx", buf, l));
+	}
+
+	if(t0 < 0) t0 = t;
+
+	sniff_colour(dir);
+
+	for(i=0; i<len; i++) {
+		uint8_t c = buf[i];
+
+		if(newframe || !line_open || (hex_mode && col == 16)) {
+			if(line_open) sniff_put("\n", 1);
+			if(newframe || !line_open) {
+				n = snprintf(tmp, sizeof tmp, "%12.6f %s ", t - t0 + i * sniff_char_time, label[dir]);
+			} else {
+				n = snprintf(tmp, sizeof tmp, "%16s", "");
+			}
+			sniff_put(tmp, n);
+			line_open = 1;
+			newframe = 0;
+			col = 0;
+		}
+
+		if(hex_mode) {
+			n = snprintf(tmp, sizeof tmp, " %02x", c);
+		} else if(c == '\n') {
+			n = snprintf(tmp, sizeof tmp, "\\n");
+			newframe = 1;
+		} else if(c == '\r') {
+			n = snprintf(tmp, sizeof tmp, "\\r");
+		} else if(c == '\\') {
+			n = snprintf(tmp, sizeof tmp, "\\\\");
+		} else if(c >= 0x20 && c < 0x7f) {
+			tmp[0] = c;
+			n = 1;
+		} else {
+			n = snprintf(tmp, sizeof tmp, "\\x%02x", c);
+		}
+		sniff_put(tmp, n);
+		col ++;
+	}
+
+	sniff_colour(-1);
+
+	if(!headless) {
+		fflush(stdout);
+		if(log_enable && fd_log) fflush(fd_log);
+	}
+}
+
+
+/*
+ * Headless mode: no terminal handling at all. The port is read in large
+ * chunks which go straight to the log and to stdout, both fully buffered
+ * and flushed from a timer instead of after every chunk.
+ */
+
+static int on_serial_read_headless(int fd, void *data)
+{
+	static uint8_t buf[65536];
+	int len;
+
+	len = serial_read(fd_serial, buf, sizeof(buf));
+	if(len <= 0) {
+		if(len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+		port_lost(len ? strerror(errno) : "closed");
+		return 0;
+	}
+
+	serial_rx_account(len);
+
+	if(autobaud_active()) {
+		autobaud_feed(buf, len);
+		return 0;
+	}
+
+	if(linktest_active()) {
+		linktest_feed(buf, len);
+		return 0;
+	}
+
+	if(frame_proto) {
+		flightrec_write(buf, len);
+		chain_write(&pl_shm, buf, len, 0);
+		frame_feed(&frame_rx, buf, len);
+		return 0;
+	}
+
+	rx_write(buf, len);
+
+	return 0;
+}
+
+
+static int on_serial_splice(int fd, void *data)
+{
+	int len = splice_transfer();
+
+	/* A destination that fails is not a lost port */
+
+	if(len == SPLICE_EOUT || len == SPLICE_ELOG) {
+		msg("Error writing %s: %s", len == SPLICE_ELOG ? log_fname : "output", strerror(errno));
+		exit_code = 1;
+		mainloop_stop();
+		return 0;
+	}
+
+	if(len <= 0) {
+		if(len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+		port_lost(len ? strerror(errno) : "closed");
+		return 0;
+	}
+
+	stats.rx_bytes += len;
+	stats.rx_reads ++;
+	return 0;
+}
+
+
+static int on_flightrec_timer(void *data)
+{
+	if(flightrec_sync() != 0) msg("Flight recorder sync failed: %s", strerror(errno));
+	return 1;
+}
+
+
+static int on_flush_timer(void *data)
+{
+	if(fd_log) fflush(fd_log);
+	if(!daemonized) fflush(stdout);
+	stats.log_pending = 0;
+	return 1;
+}
+
+
+static int on_sighup(int signo, void *data)
+{
+	if(fd_log_raw >= 0) {
+		int fd = log_open_raw(log_fname);
+		if(fd >= 0) {
+			splice_set_log(fd);
+			close(fd_log_raw);
+			fd_log_raw = fd;
+		} else {
+			msg("Error reopening log %s: %s", log_fname, strerror(errno));
 		}
-		
 	}
-		
-	
-	else {
-		if(c == '~') {
-			escape = 1;
+
+	if(fd_log) {
+		fclose(fd_log);
+		fd_log = log_open(log_fname);
+		if(fd_log) {
+			setvbuf(fd_log, NULL, _IOFBF, 65536);
+			msg("Reopened log %s", log_fname);
 		} else {
-			if(translate_newline) {
-				if(c == '\n') c = '\r';
-			}
-			serial_write(c);
+			msg("Error reopening log %s: %s", log_fname, strerror(errno));
 		}
+		stages_update();
 	}
-	
 	return 0;
-}	
+}
+
 
+/*
+ * JSON lines output, selectable per sink
+ */
 
-static void log_write(const uint8_t *buf, size_t len)
+static void json_emit(const char *buf, size_t len)
 {
-	if(log_enable && fd_log) {
+	if(json_sinks & JSON_TERM) {
+		fwrite(buf, 1, len, stdout);
+		if(!headless) fflush(stdout);
+	}
+
+	if((json_sinks & JSON_LOG) && log_enable && fd_log) {
 		fwrite(buf, 1, len, fd_log);
-		fflush(fd_log);
+		if(headless) {
+			stats.log_pending += len;
+		} else {
+			fflush(fd_log);
+		}
+		stats.log_bytes += len;
+	}
+
+	if(json_sinks & JSON_SOCK) json_sock_send(buf, len);
+}
+
+
+/*
+ * Mark an event like a disconnect in the log, so gaps in the data are
+ * visible afterwards
+ */
+
+static void log_mark(const char *event, const char *fmt, ...)
+{
+	char buf[128];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, sizeof buf, fmt, va);
+	va_end(va);
+
+	if(json_sinks) {
+		char out[512];
+		json_emit(out, json_event(out, port_name, event, buf));
+	}
+
+	if(!(json_sinks & JSON_LOG) && log_enable && fd_log) {
+		struct timeval tv;
+		char tbuf[32];
+		gettimeofday(&tv, NULL);
+		strftime(tbuf, sizeof tbuf, "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
+		fprintf(fd_log, "\n[iterm %s.%03d %s: %s]\n", tbuf, (int)(tv.tv_usec / 1000), port_name, buf);
+		if(!headless) fflush(fd_log);
+	}
+}
+
+
+/*
+ * Open the log for appending. With the io_uring event loop its writes
+ * are batched by the loop.
+ */
+
+static FILE *log_open(const char *fname)
+{
+	FILE *f;
+	int fd;
+
+	if(!use_uring) return fopen(fname, "a+");
+
+	fd = open(fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0) return NULL;
+	f = mainloop_fdopen(fd, "a");
+	if(f == NULL) close(fd);
+	return f;
+}
+
+
+/*
+ * The log as raw fd for splice mode: positioned at the end rather than
+ * opened with O_APPEND, which splice() refuses
+ */
+
+static int log_open_raw(const char *fname)
+{
+	int fd = open(fname, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+	if(fd >= 0) lseek(fd, 0, SEEK_END);
+	return fd;
+}
+
+
+/*
+ * Switch the event loop to io_uring: the serial ports are read ahead by
+ * the kernel, and terminal and log output are written in one request
+ * per loop iteration
+ */
+
+static void start_uring(void)
+{
+	if(mainloop_backend("io_uring") != 0) {
+		msg("io_uring not available (%s), using select", strerror(errno));
+		use_uring = 0;
+		return;
 	}
+
+	if(fd_serial >= 0 && !splice_mode) mainloop_readahead(fd_serial, 1);
+	if(fd_sniff >= 0) mainloop_readahead(fd_sniff, 1);
+
+	if(!daemonized) {
+		FILE *f;
+		fflush(stdout);
+		f = mainloop_fdopen(1, "w");
+		if(f) {
+			setvbuf(f, NULL, headless ? _IOFBF : _IOLBF, 65536);
+			stdout = f;
+		}
+	}
+
+	if(fd_log) {
+		fclose(fd_log);
+		fd_log = log_open(log_fname);
+		if(fd_log && headless) setvbuf(fd_log, NULL, _IOFBF, 65536);
+		if(fd_log == NULL) msg("Error reopening log %s: %s", log_fname, strerror(errno));
+		stages_update();
+	}
+
+	msg("Event loop: %s", mainloop_backend_name());
 }
 
 
@@ -496,7 +2205,8 @@ static void set_log_enable(int onoff, const char *fname)
 	if(onoff) {
 		if(fd_log == NULL) {
 			if(fname == NULL) fname = "iterm.log";
-			fd_log = fopen(fname, "a+");
+			snprintf(log_fname, sizeof log_fname, "%s", fname);
+			fd_log = log_open(fname);
 			if(fd_log) {
 				msg("Writing log to %s", fname);
 			} else {
@@ -509,19 +2219,378 @@ static void set_log_enable(int onoff, const char *fname)
 	} else {
 		log_enable = 0;
 	}
+	stages_update();
+}
+
+/*
+ * Hex mode renders into this stream, which passes the text on to the
+ * stages after the hex stage
+ */
+
+static ssize_t hex_cookie_write(void *cookie, const char *buf, size_t len)
+{
+	stage_emit_buf(cookie, buf, len, CHUNK_TEXT);
+	return len;
+}
+
+
+static void pipelines_init(void)
+{
+	static cookie_io_functions_t hex_io = { .write = hex_cookie_write };
+
+	pipeline_init(&pl_shm, "shm");
+	pipeline_add(&pl_shm, &st_shmring);
+
+	pipeline_init(&pl_tx, "tx");
+	pipeline_add(&pl_tx, &st_newline);
+	pipeline_add(&pl_tx, &st_port);
+
+	pipeline_init(&pl_json, "json");
+	pipeline_add(&pl_json, &st_json);
+	pipeline_add(&pl_json, &st_json_out);
+
+	pipeline_init(&pl_log, "log");
+	pipeline_add(&pl_log, &st_flightrec);
+	pipeline_add(&pl_log, &st_dedup_log);
+	pipeline_add(&pl_log, &st_san_log);
+	pipeline_add(&pl_log, &st_log);
+
+	pipeline_init(&pl_screen, "screen");
+	pipeline_add(&pl_screen, &st_render);
+	pipeline_add(&pl_screen, &st_hex);
+	pipeline_add(&pl_screen, &st_dedup_screen);
+	pipeline_add(&pl_screen, &st_san_screen);
+	pipeline_add(&pl_screen, &st_timestamp);
+	pipeline_add(&pl_screen, &st_screen);
+
+	hex_out = fopencookie(&st_hex, "w", hex_io);
+	if(hex_out) {
+		setvbuf(hex_out, NULL, _IONBF, 0);
+	} else {
+		hex_out = stdout;
+	}
+}
+
+
+/*
+ * Switch the stages according to the current modes. Headless mode writes
+ * the data as is; the JSON log replaces the text log.
+ */
+
+static void stages_update(void)
+{
+	int logging = log_enable && fd_log && !(json_sinks & JSON_LOG);
+	int term = !headless;
+
+	pipeline_enable(&st_render, render_decimate && term);
+	pipeline_enable(&st_hex, hex_mode && term);
+	pipeline_enable(&st_dedup_screen, dedup_cycle && term);
+	pipeline_enable(&st_san_screen, (san_screen.mode != SANITIZE_RAW || san_screen.colour) && term);
+	pipeline_enable(&st_timestamp, timestamp && term);
+	pipeline_enable(&st_screen, !daemonized);
+	san_screen.redraw = !timestamp;
+
+	pipeline_enable(&st_flightrec, flightrec_file != NULL);
+	pipeline_enable(&st_dedup_log, dedup_cycle && logging);
+	pipeline_enable(&st_san_log, (san_log.mode != SANITIZE_RAW || san_log.colour) && logging);
+	pipeline_enable(&st_log, logging);
+
+	pipeline_enable(&st_json, json_sinks);
+	pipeline_enable(&st_json_out, json_sinks);
+
+	pipeline_enable(&st_shmring, shmring_name != NULL);
+
+	pipeline_enable(&st_newline, translate_newline);
+	pipeline_enable(&st_port, 1);
+}
+
+
+/*
+ * Feed a chain, and flush its output unless headless, where a timer
+ * does that
+ */
+
+static void chain_write(struct pipeline *pl, const uint8_t *buf, size_t len, int flags)
+{
+	struct chunk c = { buf, len, flags };
+
+	pipeline_feed(pl, &c);
+	if(!headless) pipeline_flush(pl);
+}
+
+
+/*
+ * Data from the port goes to all chains, which share the read buffer
+ */
+
+static void rx_write(const uint8_t *buf, size_t len)
+{
+	struct chunk c = { buf, len, 0 };
+
+	pipeline_feed(&pl_shm, &c);
+	pipeline_feed(&pl_log, &c);
+	pipeline_feed(&pl_json, &c);
+	if(!(json_sinks & JSON_TERM)) pipeline_feed(&pl_screen, &c);
+
+	if(!headless) {
+		pipeline_flush(&pl_log);
+		pipeline_flush(&pl_screen);
+	}
+}
+
+
+/*
+ * Screen chain stages. The render stage is above, with the rest of the
+ * render decimation.
+ */
+
+static void stage_hex(struct stage *s, const struct chunk *c)
+{
+	if(c->flags & (CHUNK_MARKER | CHUNK_TEXT)) {
+		stage_emit(s, c);
+		return;
+	}
+
+	hexdump_write(c->buf, c->len, hex_out);
+}
+
+
+static void stage_dedup(struct stage *s, const struct chunk *c)
+{
+	if(c->flags) {
+		stage_emit(s, c);
+		return;
+	}
+
+	dedup_feeding = 1;
+	dedup_feed(s->user, c->buf, c->len);
+	dedup_feeding = 0;
+}
+
+
+/*
+ * Output of line collapsing. Held lines are also released from a timer,
+ * outside of a feed, and then flushed here.
+ */
+
+static void dedup_out(struct stage *s, const uint8_t *buf, size_t len, int marker)
+{
+	stage_emit_buf(s, buf, len, marker ? CHUNK_MARKER : 0);
+	if(!dedup_feeding && !headless) pipeline_flush(s->pl);
+}
+
+
+static void dedup_screen_out(const uint8_t *buf, size_t len, int marker)
+{
+	char tmp[256];
+
+	if(marker) {
+		int n = snprintf(tmp, sizeof tmp, "\e[1;30m%.*s\e[0m\n", (int)len - 1, buf);
+		buf = (uint8_t *)tmp;
+		len = n < sizeof tmp ? n : sizeof tmp - 1;
+	}
+
+	dedup_out(&st_dedup_screen, buf, len, marker);
+}
+
+
+static void dedup_log_out(const uint8_t *buf, size_t len, int marker)
+{
+	dedup_out(&st_dedup_log, buf, len, marker);
+}
+
+
+static void stage_sanitize(struct stage *s, const struct chunk *c)
+{
+	static uint8_t tmp[SANITIZE_MAX(4096)];
+	const uint8_t *buf = c->buf;
+	size_t len = c->len;
+
+	if(c->flags) {
+		stage_emit(s, c);
+		return;
+	}
+
+	while(len > 0) {
+		size_t n = len < 4096 ? len : 4096;
+		size_t l = sanitize(s->user, buf, n, tmp);
+		if(l > 0) stage_emit_buf(s, tmp, l, 0);
+		buf += n;
+		len -= n;
+	}
+}
+
+
+static void stage_timestamp(struct stage *s, const struct chunk *c)
+{
+	const uint8_t *p = c->buf;
+	const uint8_t *end = p + c->len;
+
+	if(c->flags & CHUNK_TEXT) {
+		stage_emit(s, c);
+		return;
+	}
+
+	while(p < end) {
+		const uint8_t *nl = memchr(p, '\n', end - p);
+		struct timeval tv;
+		char tbuf[32] = "";
+		char out[64];
+		int n;
+
+		if(nl == NULL) {
+			stage_emit_buf(s, p, end - p, c->flags);
+			return;
+		}
+
+		stage_emit_buf(s, p, nl + 1 - p, c->flags);
+		p = nl + 1;
+
+		gettimeofday(&tv, NULL);
+		strftime(tbuf, sizeof tbuf, "%H:%M:%S", localtime(&tv.tv_sec));
+		n = snprintf(out, sizeof out, "\e[1;30m%s.%03d\e[0m ", tbuf, (int)(tv.tv_usec / 1E3));
+		stage_emit_buf(s, out, n, CHUNK_TEXT);
+	}
+}
+
+
+static void stage_screen(struct stage *s, const struct chunk *c)
+{
+	fwrite(c->buf, 1, c->len, stdout);
+	if(c->len > 0 && !(c->flags & CHUNK_TEXT)) render_col = c->buf[c->len - 1] != '\n';
+}
+
+
+static void flush_screen(struct stage *s)
+{
+	fflush(stdout);
+}
+
+
+/*
+ * Log chain stages. The flight recorder gets the device data before
+ * anything else, also when the log itself is off.
+ */
+
+static void stage_flightrec(struct stage *s, const struct chunk *c)
+{
+	if(!(c->flags & (CHUNK_TX | CHUNK_MARKER | CHUNK_TEXT))) flightrec_write(c->buf, c->len);
+	stage_emit(s, c);
+}
+
+
+static void stage_log(struct stage *s, const struct chunk *c)
+{
+	fwrite(c->buf, 1, c->len, fd_log);
+	if(headless) stats.log_pending += c->len;
+	stats.log_bytes += c->len;
+}
+
+
+static void flush_log(struct stage *s)
+{
+	fflush(fd_log);
+}
+
+
+/*
+ * JSON chain: data records, to the sinks selected with -j and -J
+ */
+
+static void stage_json(struct stage *s, const struct chunk *c)
+{
+	static char out[JSON_RECORD_MAX(65536)];
+	const char *dir = (c->flags & CHUNK_TX) ? "tx" : "rx";
+	const uint8_t *buf = c->buf;
+	size_t len = c->len;
+
+	while(len > 0) {
+		size_t n = len < 65536 ? len : 65536;
+		stage_emit_buf(s, out, json_data(out, port_name, dir, buf, n), CHUNK_TEXT);
+		buf += n;
+		len -= n;
+	}
+}
+
+
+static void stage_json_out(struct stage *s, const struct chunk *c)
+{
+	json_emit((const char *)c->buf, c->len);
+}
+
+
+/*
+ * TX chain: typed data to the port. Data entered in hex or sent from a
+ * buffer file is passed as text and never translated.
+ */
+
+static void stage_newline(struct stage *s, const struct chunk *c)
+{
+	uint8_t tmp[256];
+	const uint8_t *buf = c->buf;
+	size_t len = c->len;
+	size_t i, n;
+
+	if(c->flags || memchr(buf, '\n', len) == NULL) {
+		stage_emit(s, c);
+		return;
+	}
+
+	while(len > 0) {
+		n = len < sizeof tmp ? len : sizeof tmp;
+		for(i=0; i<n; i++) tmp[i] = buf[i] == '\n' ? '\r' : buf[i];
+		stage_emit_buf(s, tmp, n, c->flags);
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * The sniffer is a passive tap: whatever reaches the port end of the
+ * chain is dropped
+ */
+
+static void stage_port(struct stage *s, const struct chunk *c)
+{
+	if(fd_sniff >= 0) {
+		msg("Sniffing, %d bytes not sent", (int)c->len);
+		return;
+	}
+	serial_write_buf(c->buf, c->len);
+}
+
+
+/*
+ * Shared memory ring: device data and data sent to the port, as is
+ */
+
+static void stage_shmring(struct stage *s, const struct chunk *c)
+{
+	shmring_write((c->flags & CHUNK_TX) ? SHMRING_TX : SHMRING_RX, c->buf, c->len);
 }
 
 
+
 void msg(const char *fmt, ...)
 {
 	char buf[128];
 	va_list va;
 
-	if(!have_tty) return;
+	if(!have_tty && !headless) return;
 
 	va_start(va, fmt);
 	vsnprintf(buf, sizeof buf, fmt, va);
 	va_end(va);
+
+	if(headless) {
+		if(daemonized) {
+			syslog(LOG_INFO, "%s", buf);
+		} else {
+			fprintf(stderr, "iterm: %s\n", buf);
+		}
+		return;
+	}
 	
 	printf("\r\e[K\e[1;30m> %s\e[0m\n", buf);
 }
@@ -539,10 +2608,41 @@ void usage(char *fname)
 	printf("  -l PATH   Log to given file\n");
 	printf("  -r	    use RTS/CTS hardware handshaking\n");
 	printf("  -h	    HEX mode\n");
+	printf("  -w W[,G]  HEX mode row width W, grouped by G bytes\n");
 	printf("  -c        Use custom baud rate\n");
 	printf("  -x	    Enable XON/XOFF flow control\n");
+	printf("  -a        Reconnect automatically when the port disappears\n");
+	printf("  -A[RATES] Detect baud rate, trying custom RATES (comma separated) first\n");
+	printf("  -q P[,S]  Link test with PRBS-P (7, 15 or 23) for S secs over a loopback\n");
+	printf("  -Q RATES  Link test sweeping the given rates (comma separated)\n");
+	printf("  -T SPEC   Pace TX: char=MS,line=MS inter character/line delays, rate=B/S\n");
+	printf("  -X DEV[,GAP] Sniff: merge data from the port and DEV, GAP ms starts a new frame\n");
+	printf("  -f S[,L]  Filter escape sequences on screen S and log L: raw, safe, strip, escape\n");
+	printf("  -C        Colour lines containing ERR/WARN/panic keywords\n");
+	printf("  -u[N]     Collapse repeated lines, or cycles of up to N lines\n");
+	printf("  -i MODE   Read profile: interactive (default), bulk (default when headless)\n");
+	printf("            or adaptive\n");
+	printf("  -Z P[,C]  Decode slip, cobs or hdlc frames; C is crc16, crc32 or nocrc\n");
+	printf("  -O F[,S]  Keep the last S bytes (default 256M) of device output in ring file F,\n");
+	printf("            use ringdump to export\n");
+	printf("  -m N[,S]  Publish RX and TX data in shared memory ring N of S bytes (default 4M)\n");
+	printf("            for local tools, use shmtail to follow\n");
+	printf("  -y P[,C]  Real-time mode: SCHED_FIFO priority P, pinned to CPU C. P=0 only\n");
+	printf("            measures wakeup latency, and pins when C is given\n");
+	printf("  -U        Use io_uring for the event loop: read ahead on the port, batched\n");
+	printf("            terminal and log writes. Falls back to select when not available\n");
 	printf("  -D	    Set DTR on at startup\n");
 	printf("  -R	    Set RTS on at startup\n");
+	printf("  -M ADDR   Serve metrics on unix socket PATH or TCP [HOST]:PORT\n");
+	printf("  -P        Profile mainloop handler latencies\n");
+	printf("  -H        Headless: no terminal, raw data to stdout and log\n");
+	printf("  -d        Daemonize, implies -H\n");
+	printf("  -p PATH   Write pid to PATH\n");
+	printf("  -S        Raw pipe mode, splice port to stdout and log, implies -H\n");
+	printf("  -j SINKS  JSON lines output on sinks 'term' and/or 'log'\n");
+	printf("  -J ADDR   Serve JSON lines on unix socket PATH or TCP [HOST]:PORT\n");
+	printf("  -F FPS    Decimate terminal rendering to FPS frames/sec (1..1000)\n");
+	printf("  -B RATE   Decimate terminal rendering to RATE bytes/sec\n");
 	printf("\n");
 	printf("Available baud rates:\n");
 	printf("  50 300 1200 2400 4800 9600 19200 38400 57600 115200\n");
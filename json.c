@@ -0,0 +1,282 @@
+
+/*
+ * Streaming JSON lines encoder. Every record is one line, written into a
+ * caller supplied buffer without allocations:
+ *
+ *   {"ts":1700000000.123456,"port":"/dev/ttyUSB0","dir":"rx","text":"..."}
+ *   {"ts":1700000000.123456,"port":"/dev/ttyUSB0","dir":"rx","b64":"..."}
+ *   {"ts":1700000000.123456,"port":"/dev/ttyUSB0","event":"modem","dtr":true,...}
+ *   {"ts":1700000000.123456,"port":"/dev/ttyUSB0","event":"disconnect","text":"..."}
+ *
+ * Payloads consisting of printable ASCII, tab, cr and lf are sent as
+ * text, anything else as base64. Text is escaped in runs: an SSE2 scan
+ * finds the next byte that needs attention and everything before it is
+ * copied in one go.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mainloop.h"
+#include "sock.h"
+#include "stats.h"
+#include "json.h"
+
+#define MAX_CLIENTS 8
+
+static int clients[MAX_CLIENTS];
+static int n_clients = 0;
+
+
+/*
+ * Length of the run of bytes that can be copied into a JSON string as is
+ */
+
+static size_t plain_run(const uint8_t *s, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i lo = _mm_set1_epi8(0x20);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i m = _mm_cmplt_epi8(v, lo);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del));
+		int mask = _mm_movemask_epi8(m);
+		if(mask) return i + __builtin_ctz(mask);
+	}
+#endif
+
+	for(; i < n; i++) {
+		uint8_t c = s[i];
+		if(c < 0x20 || c >= 0x7f || c == '"' || c == '\\') break;
+	}
+	return i;
+}
+
+
+/*
+ * Escape buf as JSON string contents. Returns the length written, or -1
+ * if buf contains bytes that can not be represented as text
+ */
+
+static int escape_text(char *dst, const uint8_t *buf, size_t len)
+{
+	char *p = dst;
+	size_t i = 0;
+
+	while(i < len) {
+		size_t n = plain_run(buf + i, len - i);
+		memcpy(p, buf + i, n);
+		p += n;
+		i += n;
+		if(i == len) break;
+
+		switch(buf[i++]) {
+			case '"':  *p++ = '\\'; *p++ = '"'; break;
+			case '\\': *p++ = '\\'; *p++ = '\\'; break;
+			case '\n': *p++ = '\\'; *p++ = 'n'; break;
+			case '\r': *p++ = '\\'; *p++ = 'r'; break;
+			case '\t': *p++ = '\\'; *p++ = 't'; break;
+			default: return -1;
+		}
+	}
+
+	return p - dst;
+}
+
+
+static size_t base64(char *dst, const uint8_t *buf, size_t len)
+{
+	static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *p = dst;
+	size_t i;
+
+	for(i=0; i+3<=len; i+=3) {
+		uint32_t v = (buf[i] << 16) | (buf[i+1] << 8) | buf[i+2];
+		p[0] = tab[v >> 18];
+		p[1] = tab[(v >> 12) & 0x3f];
+		p[2] = tab[(v >> 6) & 0x3f];
+		p[3] = tab[v & 0x3f];
+		p += 4;
+	}
+
+	if(i < len) {
+		uint32_t v = buf[i] << 16;
+		if(i + 1 < len) v |= buf[i+1] << 8;
+		p[0] = tab[v >> 18];
+		p[1] = tab[(v >> 12) & 0x3f];
+		p[2] = (i + 1 < len) ? tab[(v >> 6) & 0x3f] : '=';
+		p[3] = '=';
+		p += 4;
+	}
+
+	return p - dst;
+}
+
+
+static size_t header(char *dst, const char *port)
+{
+	struct timeval tv;
+	char *p = dst;
+	int r;
+
+	gettimeofday(&tv, NULL);
+	p += sprintf(p, "{\"ts\":%ld.%06ld,\"port\":\"", (long)tv.tv_sec, (long)tv.tv_usec);
+	r = escape_text(p, (const uint8_t *)port, strlen(port));
+	if(r > 0) p += r;
+	*p++ = '"';
+
+	return p - dst;
+}
+
+
+/*
+ * Encode a data record, dst must hold JSON_RECORD_MAX(len) bytes
+ */
+
+size_t json_data(char *dst, const char *port, const char *dir, const uint8_t *buf, size_t len)
+{
+	char *p = dst + header(dst, port);
+	int r;
+
+	p += sprintf(p, ",\"dir\":\"%s\",\"text\":\"", dir);
+	r = escape_text(p, buf, len);
+
+	if(r < 0) {
+		p -= 8;
+		memcpy(p, "\"b64\":\"", 7);
+		p += 7;
+		p += base64(p, buf, len);
+	} else {
+		p += r;
+	}
+
+	memcpy(p, "\"}\n", 3);
+	return p + 3 - dst;
+}
+
+
+size_t json_modem(char *dst, const char *port, int status)
+{
+	char *p = dst + header(dst, port);
+
+	p += sprintf(p, ",\"event\":\"modem\",\"dtr\":%s,\"dsr\":%s,\"dcd\":%s,\"rts\":%s,\"cts\":%s,\"ri\":%s}\n",
+			(status & TIOCM_DTR) ? "true" : "false",
+			(status & TIOCM_DSR) ? "true" : "false",
+			(status & TIOCM_CD)  ? "true" : "false",
+			(status & TIOCM_RTS) ? "true" : "false",
+			(status & TIOCM_CTS) ? "true" : "false",
+			(status & TIOCM_RI)  ? "true" : "false");
+
+	return p - dst;
+}
+
+
+size_t json_event(char *dst, const char *port, const char *event, const char *text)
+{
+	char *p = dst + header(dst, port);
+	int r;
+
+	p += sprintf(p, ",\"event\":\"%s\",\"text\":\"", event);
+	r = escape_text(p, (const uint8_t *)text, strlen(text));
+	if(r > 0) p += r;
+	memcpy(p, "\"}\n", 3);
+
+	return p + 3 - dst;
+}
+
+
+/*
+ * Socket sink: every connected client gets all records. Clients are never
+ * waited for; records that do not fit in a client's socket buffer are
+ * dropped for that client, a client that gets a partial record is
+ * disconnected.
+ */
+
+static void client_close(int i)
+{
+	close(clients[i]);
+	clients[i] = clients[--n_clients];
+}
+
+
+static int on_json_client(int fd, void *data)
+{
+	char buf[256];
+	int i;
+
+	if(read(fd, buf, sizeof buf) > 0) return 0;
+
+	mainloop_fd_del(fd, FD_READ, on_json_client, NULL);
+	for(i=0; i<n_clients; i++) {
+		if(clients[i] == fd) client_close(i);
+	}
+	return 0;
+}
+
+
+static int on_json_accept(int fd, void *data)
+{
+	int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(cfd < 0) return 0;
+
+	if(n_clients >= MAX_CLIENTS || mainloop_fd_add(cfd, FD_READ, on_json_client, NULL) != 0) {
+		close(cfd);
+		return 0;
+	}
+
+	clients[n_clients++] = cfd;
+	return 0;
+}
+
+
+int json_sock_listen(const char *addr)
+{
+	int fd = sock_listen(addr, MAX_CLIENTS, NULL);
+	if(fd < 0) return -1;
+
+	mainloop_fd_add(fd, FD_READ, on_json_accept, NULL);
+	mainloop_handler_name((void *)on_json_accept, "json_accept");
+	mainloop_handler_name((void *)on_json_client, "json_client");
+
+	return fd;
+}
+
+
+void json_sock_send(const char *buf, size_t len)
+{
+	int i;
+
+	for(i=0; i<n_clients; i++) {
+		ssize_t r = send(clients[i], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			stats.json_dropped ++;
+		} else if(r != (ssize_t)len) {
+			/* Error, or a partial record which can not be recovered from */
+			mainloop_fd_del(clients[i], FD_READ, on_json_client, NULL);
+			client_close(i--);
+		}
+	}
+}
+
+/*
+ * End
+ */
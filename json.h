@@ -0,0 +1,18 @@
+#ifndef json_h
+#define json_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Worst case size of a data record for a payload of len bytes */
+
+#define JSON_RECORD_MAX(len) ((len) * 2 + 256)
+
+size_t json_data(char *dst, const char *port, const char *dir, const uint8_t *buf, size_t len);
+size_t json_modem(char *dst, const char *port, int status);
+size_t json_event(char *dst, const char *port, const char *event, const char *text);
+
+int json_sock_listen(const char *addr);
+void json_sock_send(const char *buf, size_t len);
+
+#endif
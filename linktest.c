@@ -0,0 +1,236 @@
+/*
+ * Link qualification: transmit a PRBS at line rate and check what comes
+ * back over a loopback or an echoing device. Each rate is tested in two
+ * phases: a short settle time after the speed change during which the
+ * checker synchronises, and the measurement proper. Rates are tested in
+ * ascending order; the highest one without sync losses and with a bit
+ * error ratio below BER_MAX is reported as the stable rate.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include "clock.h"
+#include "mainloop.h"
+#include "serial.h"
+#include "stats.h"
+#include "prbs.h"
+#include "linktest.h"
+
+#define MAX_RATES    32
+#define TX_CHUNK     256
+#define SETTLE_MSEC  250
+#define BER_MAX      1E-6
+
+static int fd_port = -1;
+static int fd_flags;
+static int active = 0;
+static int measuring;
+static int order;
+static int secs;
+static int bits_per_char;
+static int rates[MAX_RATES];
+static int n_rates;
+static int cur;
+static int best_rate;
+static void (*report_handler)(const struct linktest_result *r);
+static void (*done_handler)(int best_rate);
+
+static struct prbs_gen gen;
+static struct prbs_check check;
+static uint8_t tx_buf[TX_CHUNK];
+static size_t tx_off = TX_CHUNK;
+static uint64_t tx_bytes;
+static uint64_t rx_bytes;
+static double t_start;
+static int elapsed;
+
+static int on_linktest_write(int fd, void *data);
+static int on_linktest_timer(void *data);
+
+
+static void fill_result(struct linktest_result *r, int final)
+{
+	memset(r, 0, sizeof *r);
+
+	r->order       = order;
+	r->rate        = rates[cur];
+	r->final       = final;
+	r->secs        = mono_sec() - t_start;
+	r->tx_bytes    = tx_bytes;
+	r->rx_bytes    = rx_bytes;
+	r->rx_rate     = r->secs > 0 ? rx_bytes / r->secs : 0;
+	r->line_rate   = (double)rates[cur] / bits_per_char;
+	r->synced      = check.synced;
+	r->bits        = check.bits;
+	r->errors      = (check.errors + PRBS_ERROR_MULT - 1) / PRBS_ERROR_MULT;
+	r->bursts      = check.bursts;
+	r->burst_max   = check.burst_max;
+	r->sync_losses = check.sync_losses;
+	r->ber         = check.bits ? (double)r->errors / check.bits : 1.0;
+	r->stable      = check.bits > 0 && check.synced && check.sync_losses == 0 && r->ber <= BER_MAX;
+}
+
+
+static void release(void)
+{
+	active = 0;
+	mainloop_timer_del(on_linktest_timer, NULL);
+	mainloop_fd_del(fd_port, FD_WRITE, on_linktest_write, NULL);
+	fcntl(fd_port, F_SETFL, fd_flags);
+}
+
+
+static void finish(void)
+{
+	release();
+	if(done_handler) done_handler(best_rate);
+}
+
+
+static void try_rate(void)
+{
+	measuring = 0;
+	elapsed = 0;
+
+	if(serial_set_speed(fd_port, rates[cur]) < 0) {
+		fprintf(stderr, "Can not set %d bps: %s\n", rates[cur], strerror(errno));
+	}
+	tcflush(fd_port, TCIOFLUSH);
+	mainloop_fd_flush(fd_port);
+
+	prbs_check_init(&check, order);
+	tx_off = TX_CHUNK;
+
+	mainloop_timer_add(0, SETTLE_MSEC, on_linktest_timer, NULL);
+}
+
+
+/*
+ * Keep the transmitter busy; a partially written chunk is finished
+ * first so the sequence stays continuous. The port is non blocking
+ * during the test: a writable port may have room for less than a chunk,
+ * and a blocking write would then wait for the echo that only the
+ * mainloop can read.
+ */
+
+static int on_linktest_write(int fd, void *data)
+{
+	ssize_t n;
+
+	if(tx_off == TX_CHUNK) {
+		prbs_gen_fill(&gen, tx_buf, TX_CHUNK);
+		tx_off = 0;
+	}
+
+	n = write(fd, tx_buf + tx_off, TX_CHUNK - tx_off);
+	if(n > 0) {
+		tx_off += n;
+		if(measuring) tx_bytes += n;
+		stats.tx_bytes += n;
+		stats.tx_writes ++;
+	}
+
+	return 0;
+}
+
+
+static int on_linktest_timer(void *data)
+{
+	struct linktest_result r;
+
+	if(!active) return 0;
+
+	if(!measuring) {
+		prbs_check_clear(&check);
+		tx_bytes = 0;
+		rx_bytes = 0;
+		t_start = mono_sec();
+		measuring = 1;
+		mainloop_timer_add(1, 0, on_linktest_timer, NULL);
+		return 0;
+	}
+
+	elapsed ++;
+	fill_result(&r, elapsed >= secs);
+	if(report_handler) report_handler(&r);
+
+	if(elapsed < secs) return 1;
+
+	if(r.stable) best_rate = rates[cur];
+
+	if(++cur == n_rates) {
+		finish();
+	} else {
+		try_rate();
+	}
+
+	return 0;
+}
+
+
+void linktest_feed(const uint8_t *buf, size_t len)
+{
+	if(!active) return;
+
+	prbs_check_feed(&check, buf, len);
+	if(measuring) rx_bytes += len;
+}
+
+
+int linktest_start(int fd, int o, int s, const int *r, int n, int bpc,
+		void (*report)(const struct linktest_result *r), void (*done)(int best_rate))
+{
+	int i, j;
+
+	if(!prbs_valid(o) || n < 1 || s < 1) return -1;
+	if(n > MAX_RATES) n = MAX_RATES;
+
+	for(i=0; i<n; i++) {
+		int v = r[i];
+		for(j=i; j>0 && rates[j-1] > v; j--) rates[j] = rates[j-1];
+		rates[j] = v;
+	}
+
+	fd_port = fd;
+	fd_flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+	order = o;
+	secs = s;
+	n_rates = n;
+	bits_per_char = bpc;
+	report_handler = report;
+	done_handler = done;
+	cur = 0;
+	best_rate = 0;
+	active = 1;
+
+	prbs_gen_init(&gen, order);
+
+	mainloop_handler_name((void *)on_linktest_write, "linktest_write");
+	mainloop_handler_name((void *)on_linktest_timer, "linktest_timer");
+	mainloop_fd_add(fd_port, FD_WRITE, on_linktest_write, NULL);
+	try_rate();
+
+	return 0;
+}
+
+
+int linktest_active(void)
+{
+	return active;
+}
+
+
+void linktest_stop(void)
+{
+	if(active) release();
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,32 @@
+#ifndef linktest_h
+#define linktest_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct linktest_result {
+	int order;
+	int rate;
+	int final;
+	int stable;
+	int synced;
+	double secs;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	double rx_rate;
+	double line_rate;
+	uint64_t bits;
+	uint64_t errors;        /* bit errors on the line */
+	uint64_t bursts;
+	uint64_t burst_max;
+	uint64_t sync_losses;
+	double ber;
+};
+
+int linktest_start(int fd, int order, int secs, const int *rates, int n, int bits_per_char,
+		void (*report)(const struct linktest_result *r), void (*done)(int best_rate));
+void linktest_feed(const uint8_t *buf, size_t len);
+int linktest_active(void);
+void linktest_stop(void);
+
+#endif
@@ -1,6 +1,9 @@
 
  
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <time.h>
 #include <sys/time.h>
@@ -9,9 +12,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
+#include "clock.h"
 #include "mainloop.h"
 #include "list.h"
+#include "hist.h"
+#include "pool.h"
+#include "uring.h"
 
 
 struct mainloop_fd_t {
@@ -20,6 +29,9 @@ struct mainloop_fd_t {
 	int (*handler)(int fd, void *user);
 	void *user;
 	int remove;
+	int ready;
+	int armed;
+	unsigned long id;
 	struct mainloop_fd_t *prev;
 	struct mainloop_fd_t *next;
 };
@@ -38,40 +50,1036 @@ struct mainloop_signal_t {
 	int signum;
 	int (*handler)(int signum, void *user);
 	void *user;
-	int signaled;
+	unsigned seen;          /* sig_count[signum] at the last dispatch */
 	int remove;
 	struct mainloop_signal_t *prev;
 	struct mainloop_signal_t *next;
 };
 
 
-struct mainloop_fd_t     *mainloop_fd_list     = NULL;
-struct mainloop_timer_t  *mainloop_timer_list  = NULL;
-struct mainloop_signal_t *mainloop_signal_list = NULL;
-int mainloop_running = 1;
+#define URING_ENTRIES 256
+#define RA_MAX        8
+#define RA_BUFS       16
+#define RA_BUF_SIZE   16384
+#define WB_MAX        8
+#define WB_SIZE       65536
 
+enum ud_type { UD_POLL = 1, UD_READ, UD_READPOLL, UD_WRITE, UD_IGNORE };
 
+#define UD(type, id)  (((uint64_t)(type) << 56) | (id))
+#define UD_TYPE(ud)   ((ud) >> 56)
+#define UD_ID(ud)     ((ud) & 0xffffffffffffffULL)
 
-int mainloop_fd_add(int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
+struct readahead {
+	int used;
+	int fd;
+	int armed;          /* read request owned by the kernel */
+	int stopping;       /* cancelled, waiting for the last completion */
+	int nobufs;         /* all buffers filled, armed again once one is consumed */
+	int err;            /* after the buffered data: errno, or -1 for end of file */
+	unsigned long gen;
+	struct io_uring_buf_ring *br;
+	uint8_t *mem;
+	uint16_t q_bid[RA_BUFS];
+	uint32_t q_len[RA_BUFS];
+	int q_head;
+	int q_count;
+	uint32_t q_off;
+	size_t pending;
+};
+
+struct wbuf {
+	int fd;
+	int cur;
+	int inflight;
+	size_t fill;        /* collected in buf[cur] */
+	size_t busy;        /* in buf[!cur], being written by the kernel */
+	size_t done;
+	uint8_t *buf[2];
+};
+
+struct mainloop_task {
+	void (*fn)(void *arg);
+	void *arg;
+	struct mainloop_task *next;
+};
+
+
+/*
+ * All state of one event loop. A loop is only used from the thread that
+ * runs it, except for mainloop_ctx_post(), mainloop_ctx_wakeup() and
+ * mainloop_ctx_stop() which can be called from any thread.
+ *
+ * Nodes come from slab pools: rescheduling a timer frees one node and
+ * takes another, which then never reaches malloc
+ */
+
+struct mainloop {
+	struct mainloop_fd_t     *fd_list;
+	struct mainloop_timer_t  *timer_list;
+	struct mainloop_signal_t *signal_list;
+	int running;
+	struct mainloop_stats *stats;
+	struct mainloop_stats own_stats;
+
+	struct pool fd_pool;
+	struct pool timer_pool;
+	struct pool signal_pool;
+	unsigned long fd_id;
+
+	/* wakeup and tasks from other threads */
+
+	int wake_fd;
+	pthread_mutex_t task_lock;
+	struct pool task_pool;
+	struct mainloop_task *task_head;
+	struct mainloop_task *task_tail;
+
+	/* io_uring backend */
+
+	struct uring ring;
+	int use_uring;
+	int multishot;
+	int in_loop;
+	struct readahead ra_list[RA_MAX];
+	struct wbuf wb_list[WB_MAX];
+};
+
+struct mainloop_stats mainloop_stats;
+
+static struct mainloop default_loop = {
+	.running     = 1,
+	.stats       = &mainloop_stats,
+	.fd_pool     = POOL_INIT("mainloop_fd", struct mainloop_fd_t),
+	.timer_pool  = POOL_INIT("mainloop_timer", struct mainloop_timer_t),
+	.signal_pool = POOL_INIT("mainloop_signal", struct mainloop_signal_t),
+	.wake_fd     = -1,
+	.task_lock   = PTHREAD_MUTEX_INITIALIZER,
+	.task_pool   = POOL_INIT(NULL, struct mainloop_task),
+};
+
+/*
+ * Signals. The handler only counts the signal and writes to the wake
+ * fds of all loops; each loop compares the counts with the ones its
+ * handlers saw last, and dispatches from its own iteration. Wake fds of
+ * destroyed loops are kept for reuse instead of closed, so a handler
+ * that read a slot just before it was cleared still writes to an
+ * eventfd. Loops beyond LOOPS_MAX are not woken up, they see the signal
+ * on their next iteration.
+ */
+
+#define LOOPS_MAX 64
+
+static unsigned sig_count[NSIG];
+static unsigned long long sig_time[NSIG];
+static int sig_users[NSIG];
+static int wake_fds[LOOPS_MAX] = { [0 ... LOOPS_MAX-1] = -1 };
+static int spare_fds[LOOPS_MAX];
+static int n_spare = 0;
+static pthread_mutex_t loops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The loop run by this thread */
+
+static __thread struct mainloop *current = NULL;
+
+
+/*
+ * The global functions work on the loop run by the calling thread, or
+ * on the default loop when the thread does not run one
+ */
+
+static struct mainloop *cur(void)
+{
+	return current ? current : &default_loop;
+}
+
+
+/*
+ * Optional per handler instrumentation: wait time between readiness of
+ * an event and dispatch of its handler, and run time of the handler
+ * itself. Handlers are identified by their function address, so
+ * rescheduled timers accumulate in the same slot. When the table is full
+ * the remaining handlers share the last slot, shown as "(other)". When
+ * instrumentation is disabled the only cost is a flag test per dispatch.
+ */
+
+#define PROF_MAX   64
+#define TRACE_SIZE 16384
+
+struct prof {
+	void *handler;
+	const char *name;
+	struct hist wait;
+	struct hist run;
+};
+
+struct trace_event {
+	unsigned long long t_start;
+	unsigned int wait;
+	unsigned int run;
+	int prof;
+};
+
+static int instrument = 0;
+static struct prof prof_list[PROF_MAX];
+static int prof_count = 0;
+static struct trace_event trace[TRACE_SIZE];
+static unsigned long trace_head = 0;
+static unsigned long long t_epoch;
+
+
+static struct prof *prof_find(void *handler)
+{
+	int i;
+
+	for(i=0; i<prof_count; i++) {
+		if(prof_list[i].handler == handler) return &prof_list[i];
+	}
+
+	if(prof_count == PROF_MAX - 1) {
+		prof_list[prof_count].name = "(other)";
+		prof_count ++;
+	}
+	if(prof_count == PROF_MAX) return &prof_list[PROF_MAX - 1];
+
+	prof_list[prof_count].handler = handler;
+	return &prof_list[prof_count++];
+}
+
+
+static void prof_record(void *handler, unsigned long long t_ready, unsigned long long t_start, unsigned long long t_end)
+{
+	struct prof *p = prof_find(handler);
+
+	unsigned long long wait = t_start > t_ready ? t_start - t_ready : 0;
+	unsigned long long run = t_end - t_start;
+
+	hist_add(&p->wait, wait);
+	hist_add(&p->run, run);
+
+	struct trace_event *ev = &trace[trace_head++ % TRACE_SIZE];
+	ev->t_start = t_start;
+	ev->wait = wait > 0xffffffff ? 0xffffffff : wait;
+	ev->run = run > 0xffffffff ? 0xffffffff : run;
+	ev->prof = p - prof_list;
+}
+
+
+/*
+ * Per handler profiles are kept for the default loop only
+ */
+
+static void account_handler(struct mainloop *ml, void *handler, unsigned long long t_ready, unsigned long long t_start)
+{
+	unsigned long long t_end = mono_nsec();
+	unsigned long long dt = t_end - t_start;
+
+	ml->stats->dispatches ++;
+	ml->stats->handler_nsec += dt;
+	if(dt > ml->stats->handler_max_nsec) ml->stats->handler_max_nsec = dt;
+
+	if(instrument && ml == &default_loop) prof_record(handler, t_ready, t_start, t_end);
+}
+
+
+void mainloop_instrument(int onoff)
+{
+	if(onoff && t_epoch == 0) t_epoch = mono_nsec();
+	instrument = onoff;
+}
+
+
+/*
+ * Give a handler a readable name for reports and traces
+ */
+
+void mainloop_handler_name(void *handler, const char *name)
+{
+	struct prof *p = prof_find(handler);
+	if(p->handler == handler) p->name = name;
+}
+
+
+static const char *prof_name(struct prof *p, char *buf, int len)
+{
+	if(p->name) return p->name;
+	snprintf(buf, len, "%p", p->handler);
+	return buf;
+}
+
+
+/*
+ * Print a latency summary of all handlers seen so far
+ */
+
+void mainloop_profile_dump(FILE *f)
+{
+	int i;
+
+	fprintf(f, "%-16s %9s   %-26s   %-26s\n", "handler", "calls",
+			"wait p50 / p99 / max", "run p50 / p99 / max");
+
+	for(i=0; i<prof_count; i++) {
+		struct prof *p = &prof_list[i];
+		char name[32], b[6][16];
+		if(p->run.count == 0) continue;
+		fprintf(f, "%-16s %9llu   %8s %8s %8s   %8s %8s %8s\n",
+				prof_name(p, name, sizeof name),
+				(unsigned long long)p->run.count,
+				hist_fmt_nsec(hist_percentile(&p->wait, 50), b[0], 16),
+				hist_fmt_nsec(hist_percentile(&p->wait, 99), b[1], 16),
+				hist_fmt_nsec(p->wait.max, b[2], 16),
+				hist_fmt_nsec(hist_percentile(&p->run, 50), b[3], 16),
+				hist_fmt_nsec(hist_percentile(&p->run, 99), b[4], 16),
+				hist_fmt_nsec(p->run.max, b[5], 16));
+	}
+}
+
+
+/*
+ * Write the most recent handler runs in Chrome trace event format, to
+ * be loaded in chrome://tracing or ui.perfetto.dev
+ */
+
+int mainloop_trace_dump(const char *fname)
+{
+	FILE *f;
+	unsigned long i, first;
+	int n = 0;
+
+	f = fopen(fname, "w");
+	if(f == NULL) return -1;
+
+	first = trace_head > TRACE_SIZE ? trace_head - TRACE_SIZE : 0;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for(i=first; i<trace_head; i++) {
+		struct trace_event *ev = &trace[i % TRACE_SIZE];
+		struct prof *p = &prof_list[ev->prof];
+		char name[32];
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"wait_us\":%.3f}}",
+				n++ ? ",\n" : "",
+				prof_name(p, name, sizeof name),
+				(ev->t_start - t_epoch) / 1E3, ev->run / 1E3, ev->wait / 1E3);
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	return n;
+}
+
+
+
+/*
+ * io_uring backend. Readiness handlers keep working unchanged: every
+ * watched fd gets a one shot poll request which is armed again after
+ * its handler ran, so the semantics stay level triggered as with
+ * select(). Requests are only queued in the submission ring and go to
+ * the kernel with the same io_uring_enter() that waits for completions
+ * and for the next timer, so arming them costs no system calls.
+ *
+ * Ports set to read ahead with mainloop_readahead() are read by the
+ * kernel into a ring of provided buffers, with a multishot read where the
+ * kernel has it and a poll linked to a read otherwise. Their handlers
+ * take the data with mainloop_read(), without a system call.
+ *
+ * Output passed to mainloop_write() is collected per fd and written
+ * with one request per fd and loop iteration, double buffered so the
+ * next iteration can collect while the kernel writes.
+ */
+
+static struct io_uring_sqe *get_sqe(struct mainloop *ml)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&ml->ring);
+
+	if(sqe == NULL) {
+		uring_enter(&ml->ring, 0, NULL);
+		sqe = uring_sqe(&ml->ring);
+	}
+	return sqe;
+}
+
+
+static void poll_arm(struct mainloop *ml, struct mainloop_fd_t *mf)
+{
+	struct io_uring_sqe *sqe = get_sqe(ml);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = mf->fd;
+	sqe->poll32_events = mf->type == FD_READ ? POLLIN : mf->type == FD_WRITE ? POLLOUT : POLLPRI;
+	sqe->user_data = UD(UD_POLL, mf->id);
+	mf->armed = 1;
+}
+
+
+static void poll_cancel(struct mainloop *ml, struct mainloop_fd_t *mf)
+{
+	struct io_uring_sqe *sqe = get_sqe(ml);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = UD(UD_POLL, mf->id);
+	sqe->user_data = UD(UD_IGNORE, 0);
+	mf->armed = 0;
+}
+
+
+static void poll_complete(struct mainloop *ml, unsigned long id, int res)
+{
+	struct mainloop_fd_t *mf, *mf_next;
+
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		if(mf->id == id) {
+			mf->armed = 0;
+			if(res != -ECANCELED) mf->ready = 1;
+		}
+	}
+}
+
+
+static struct readahead *ra_find(struct mainloop *ml, int fd)
+{
+	int i;
+
+	if(!ml->use_uring) return NULL;
+
+	for(i=0; i<RA_MAX; i++) {
+		if(ml->ra_list[i].used && !ml->ra_list[i].stopping && ml->ra_list[i].fd == fd) return &ml->ra_list[i];
+	}
+	return NULL;
+}
+
+
+static void ra_free(struct mainloop *ml, struct readahead *ra)
+{
+	uring_buf_ring_free(&ml->ring, ra->br, RA_BUFS, ra - ml->ra_list);
+	free(ra->mem);
+	ra->used = 0;
+}
+
+
+static void ra_arm(struct mainloop *ml, struct readahead *ra)
+{
+	unsigned long id = (ra->gen << 8) | (ra - ml->ra_list);
+	struct io_uring_sqe *sqe;
+
+	if(ra->armed || ra->stopping || ra->nobufs || ra->err) return;
+
+	if(!ml->multishot) {
+		sqe = get_sqe(ml);
+		if(sqe == NULL) return;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = ra->fd;
+		sqe->poll32_events = POLLIN;
+		sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe->user_data = UD(UD_READPOLL, id);
+	}
+
+	sqe = get_sqe(ml);
+	if(sqe == NULL) return;
+	sqe->opcode = ml->multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = ra->fd;
+	sqe->off = (uint64_t)-1;
+	sqe->len = ml->multishot ? 0 : RA_BUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ra - ml->ra_list;
+	sqe->user_data = UD(UD_READ, id);
+	ra->armed = 1;
+}
+
+
+static void ra_complete(struct mainloop *ml, unsigned long id, int res, unsigned flags)
+{
+	struct readahead *ra = &ml->ra_list[id & 0xff];
+
+	if(!ra->used || ra->gen != id >> 8) return;
+
+	if(res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+		int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if(ra->stopping) {
+			uring_buf_add(ra->br, RA_BUFS, ra->mem + bid * RA_BUF_SIZE, RA_BUF_SIZE, bid);
+		} else {
+			int tail = (ra->q_head + ra->q_count) % RA_BUFS;
+			ra->q_bid[tail] = bid;
+			ra->q_len[tail] = res;
+			ra->q_count ++;
+			ra->pending += res;
+		}
+		ml->stats->uring_reads ++;
+	} else if(res == 0) {
+		ra->err = -1;
+	} else if(res == -ENOBUFS) {
+		ra->nobufs = 1;
+	} else if(res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+		ra->err = -res;
+	}
+
+	if(!(flags & IORING_CQE_F_MORE)) {
+		ra->armed = 0;
+		if(ra->stopping) ra_free(ml, ra);
+	}
+}
+
+
+/*
+ * Let the kernel read ahead on the given fd. All handlers of the fd must
+ * then read with mainloop_read(). Stop before closing the fd.
+ */
+
+int mainloop_readahead(int fd, int onoff)
+{
+	struct mainloop *ml = cur();
+	struct readahead *ra = ra_find(ml, fd);
+	int i;
+
+	if(!onoff) {
+		if(ra == NULL) return -1;
+		if(ra->armed) {
+			struct io_uring_sqe *sqe;
+			unsigned long id = (ra->gen << 8) | (ra - ml->ra_list);
+			int type;
+			for(type=UD_READPOLL; type>=UD_READ; type--) {
+				sqe = get_sqe(ml);
+				if(sqe == NULL) break;
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = UD(type, id);
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+				sqe->user_data = UD(UD_IGNORE, 0);
+			}
+			ra->stopping = 1;
+			uring_enter(&ml->ring, 0, NULL);
+		} else {
+			ra_free(ml, ra);
+		}
+		return 0;
+	}
+
+	if(!ml->use_uring || ra) return -1;
+
+	for(i=0; i<RA_MAX && ml->ra_list[i].used; i++);
+	if(i == RA_MAX) return -1;
+	ra = &ml->ra_list[i];
+
+	unsigned long gen = ra->gen + 1;
+	memset(ra, 0, sizeof *ra);
+	ra->gen = gen & 0xffffffffffffULL;
+	ra->fd = fd;
+
+	ra->mem = malloc(RA_BUFS * RA_BUF_SIZE);
+	if(ra->mem == NULL) return -1;
+	ra->br = uring_buf_ring(&ml->ring, RA_BUFS, i);
+	if(ra->br == NULL) {
+		free(ra->mem);
+		return -1;
+	}
+	for(i=0; i<RA_BUFS; i++) {
+		uring_buf_add(ra->br, RA_BUFS, ra->mem + i * RA_BUF_SIZE, RA_BUF_SIZE, i);
+	}
+
+	ra->used = 1;
+	return 0;
+}
+
+
+/*
+ * read() for handlers, served from the read ahead buffers when enabled
+ */
+
+ssize_t mainloop_read(int fd, void *buf, size_t len)
+{
+	struct readahead *ra = ra_find(cur(), fd);
+	uint8_t *p = buf;
+	size_t n = 0;
+
+	if(ra == NULL) return read(fd, buf, len);
+
+	while(n < len && ra->q_count > 0) {
+		int bid = ra->q_bid[ra->q_head];
+		size_t l = ra->q_len[ra->q_head] - ra->q_off;
+		if(l > len - n) l = len - n;
+		memcpy(p + n, ra->mem + bid * RA_BUF_SIZE + ra->q_off, l);
+		n += l;
+		ra->q_off += l;
+		ra->pending -= l;
+		if(ra->q_off == ra->q_len[ra->q_head]) {
+			uring_buf_add(ra->br, RA_BUFS, ra->mem + bid * RA_BUF_SIZE, RA_BUF_SIZE, bid);
+			ra->q_head = (ra->q_head + 1) % RA_BUFS;
+			ra->q_count --;
+			ra->q_off = 0;
+			ra->nobufs = 0;
+		}
+	}
+
+	if(n > 0) return n;
+	if(ra->err > 0) {
+		errno = ra->err;
+		return -1;
+	}
+	if(ra->err < 0) return 0;
+
+	errno = EAGAIN;
+	return -1;
+}
+
+
+size_t mainloop_read_pending(int fd)
+{
+	struct readahead *ra = ra_find(cur(), fd);
+
+	return ra ? ra->pending : 0;
+}
+
+
+static void uring_reap(struct mainloop *ml);
+
+/*
+ * Drop the data read ahead on the given fd, e.g. after tcflush() or a
+ * speed change. Reads the kernel completed but the loop did not reap yet
+ * are collected first, so nothing read before the call survives it.
+ */
+
+void mainloop_fd_flush(int fd)
+{
+	struct mainloop *ml = cur();
+	struct readahead *ra = ra_find(ml, fd);
+
+	if(ra == NULL) return;
+
+	uring_enter(&ml->ring, 0, NULL);
+	uring_reap(ml);
+
+	while(ra->q_count > 0) {
+		int bid = ra->q_bid[ra->q_head];
+		uring_buf_add(ra->br, RA_BUFS, ra->mem + bid * RA_BUF_SIZE, RA_BUF_SIZE, bid);
+		ra->q_head = (ra->q_head + 1) % RA_BUFS;
+		ra->q_count --;
+	}
+	ra->q_off = 0;
+	ra->pending = 0;
+	ra->nobufs = 0;
+}
+
+
+static struct wbuf *wb_find(struct mainloop *ml, int fd, int create)
+{
+	int i;
+
+	for(i=0; i<WB_MAX; i++) {
+		if(ml->wb_list[i].buf[0] && ml->wb_list[i].fd == fd) return &ml->wb_list[i];
+	}
+	if(!create) return NULL;
+
+	for(i=0; i<WB_MAX; i++) {
+		struct wbuf *w = &ml->wb_list[i];
+		if(w->buf[0] == NULL) {
+			w->buf[0] = malloc(WB_SIZE * 2);
+			if(w->buf[0] == NULL) return NULL;
+			w->buf[1] = w->buf[0] + WB_SIZE;
+			w->fd = fd;
+			w->cur = 0;
+			w->fill = 0;
+			w->inflight = 0;
+			return w;
+		}
+	}
+	return NULL;
+}
+
+
+static void wb_queue(struct mainloop *ml, struct wbuf *w)
+{
+	struct io_uring_sqe *sqe = get_sqe(ml);
+
+	if(sqe == NULL) {
+		w->inflight = 0;
+		return;
+	}
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = w->fd;
+	sqe->addr = (uintptr_t)(w->buf[!w->cur] + w->done);
+	sqe->len = w->busy - w->done;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = UD(UD_WRITE, w - ml->wb_list);
+	w->inflight = 1;
+}
+
+
+static void wb_submit(struct mainloop *ml, struct wbuf *w)
+{
+	if(w->inflight || w->fill == 0) return;
+
+	w->busy = w->fill;
+	w->done = 0;
+	w->cur = !w->cur;
+	w->fill = 0;
+	wb_queue(ml, w);
+}
+
+
+static void wb_complete(struct mainloop *ml, unsigned long id, int res)
+{
+	struct wbuf *w;
+
+	if(id >= WB_MAX || !ml->wb_list[id].inflight) return;
+	w = &ml->wb_list[id];
+
+	ml->stats->uring_writes ++;
+
+	if(res == -EAGAIN || res == -EINTR) {
+		wb_queue(ml, w);
+	} else if(res < 0) {
+		ml->stats->write_errors ++;
+		w->inflight = 0;
+	} else if(w->done + res < w->busy) {
+		w->done += res;
+		wb_queue(ml, w);
+	} else {
+		w->inflight = 0;
+	}
+}
+
+
+static void uring_reap(struct mainloop *ml)
+{
+	struct io_uring_cqe *cqe;
+
+	while((cqe = uring_cqe(&ml->ring)) != NULL) {
+		uint64_t ud = cqe->user_data;
+		switch(UD_TYPE(ud)) {
+			case UD_POLL:
+				poll_complete(ml, UD_ID(ud), cqe->res);
+				break;
+			case UD_READ:
+				ra_complete(ml, UD_ID(ud), cqe->res, cqe->flags);
+				break;
+			case UD_WRITE:
+				wb_complete(ml, UD_ID(ud), cqe->res);
+				break;
+		}
+		uring_cqe_seen(&ml->ring);
+	}
+
+	ml->stats->uring_enters = ml->ring.enters;
+	ml->stats->uring_sqes = ml->ring.sqes_submitted;
+}
+
+
+static void wb_wait(struct mainloop *ml, struct wbuf *w)
+{
+	while(w->inflight) {
+		int r = uring_enter(&ml->ring, 1, NULL);
+		if(r < 0 && r != -EINTR) break;
+		uring_reap(ml);
+	}
+}
+
+
+static void loop_flush(struct mainloop *ml, int fd);
+
+
+static ssize_t write_all(int fd, const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t r = write(fd, buf + done, len - done);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		done += r;
+	}
+	return len;
+}
+
+
+static ssize_t loop_write(struct mainloop *ml, int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	struct wbuf *w;
+	size_t n = 0;
+
+	if(!ml->use_uring || !ml->in_loop || (w = wb_find(ml, fd, 1)) == NULL) {
+		loop_flush(ml, fd);
+		return write_all(fd, buf, len);
+	}
+
+	while(n < len) {
+		size_t l = len - n;
+		if(w->fill == WB_SIZE) {
+			wb_wait(ml, w);
+			wb_submit(ml, w);
+		}
+		if(l > WB_SIZE - w->fill) l = WB_SIZE - w->fill;
+		memcpy(w->buf[w->cur] + w->fill, p + n, l);
+		w->fill += l;
+		n += l;
+	}
+
+	return len;
+}
+
+
+static void loop_flush(struct mainloop *ml, int fd)
+{
+	int i;
+
+	if(!ml->use_uring) return;
+
+	for(i=0; i<WB_MAX; i++) {
+		struct wbuf *w = &ml->wb_list[i];
+		if(w->buf[0] && (fd == -1 || w->fd == fd)) {
+			wb_wait(ml, w);
+			wb_submit(ml, w);
+			wb_wait(ml, w);
+		}
+	}
+}
+
+
+/*
+ * Write all data to the given fd. With the io_uring backend this is
+ * collected and written when the loop next waits; outside of the loop
+ * it is written right away.
+ */
+
+ssize_t mainloop_write(int fd, const void *buf, size_t len)
+{
+	return loop_write(cur(), fd, buf, len);
+}
+
+
+/*
+ * Wait until all data given to mainloop_write() for the fd, or for all
+ * fds when fd is -1, is written
+ */
+
+void mainloop_flush(int fd)
+{
+	loop_flush(cur(), fd);
+}
+
+
+struct cookie {
+	struct mainloop *ml;
+	int fd;
+};
+
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t len)
+{
+	struct cookie *c = cookie;
+
+	return loop_write(c->ml, c->fd, buf, len);
+}
+
+
+static int cookie_close(void *cookie)
+{
+	struct cookie *c = cookie;
+	int fd = c->fd;
+	struct wbuf *w;
+
+	loop_flush(c->ml, fd);
+	w = wb_find(c->ml, fd, 0);
+	if(w) {
+		free(w->buf[0]);
+		w->buf[0] = w->buf[1] = NULL;
+	}
+	free(c);
+	return close(fd);
+}
+
+
+/*
+ * A stdio stream on the given fd which writes through mainloop_write()
+ * of the calling thread's loop
+ */
+
+FILE *mainloop_fdopen(int fd, const char *mode)
+{
+	cookie_io_functions_t io = {
+		.write = cookie_write,
+		.close = cookie_close,
+	};
+	struct cookie *c;
+	FILE *f;
+
+	c = malloc(sizeof *c);
+	if(c == NULL) return NULL;
+	c->ml = cur();
+	c->fd = fd;
+
+	f = fopencookie(c, mode, io);
+	if(f == NULL) free(c);
+	return f;
+}
+
+
+static void uring_atexit(void)
+{
+	default_loop.in_loop = 0;
+	loop_flush(&default_loop, -1);
+}
+
+
+/*
+ * Select the backend: "select" or "io_uring". Fails when the kernel has
+ * no (usable) io_uring, in which case select() stays in use.
+ */
+
+int mainloop_ctx_backend(struct mainloop *ml, const char *name)
+{
+	if(strcmp(name, "select") == 0) return ml->use_uring ? -1 : 0;
+
+	if(strcmp(name, "io_uring") != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(ml->use_uring) return 0;
+
+	if(uring_init(&ml->ring, URING_ENTRIES) != 0) return -1;
+
+	if(!(ml->ring.features & IORING_FEAT_EXT_ARG) || !(ml->ring.features & IORING_FEAT_NODROP)) {
+		uring_exit(&ml->ring);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ml->multishot = uring_op_supported(&ml->ring, URING_OP_READ_MULTISHOT);
+	ml->use_uring = 1;
+	if(ml == &default_loop) atexit(uring_atexit);
+
+	return 0;
+}
+
+
+int mainloop_backend(const char *name)
+{
+	return mainloop_ctx_backend(cur(), name);
+}
+
+
+const char *mainloop_backend_name(void)
+{
+	struct mainloop *ml = cur();
+
+	if(!ml->use_uring) return "select";
+	return ml->multishot ? "io_uring, multishot reads" : "io_uring";
+}
+
+
+static int wait_uring(struct mainloop *ml, struct timeval *tv)
+{
+	struct mainloop_fd_t *mf, *mf_next;
+	struct timespec ts;
+	int i, r;
+
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		struct readahead *ra;
+		if(mf->remove) continue;
+		if(mf->type == FD_READ && (ra = ra_find(ml, mf->fd)) != NULL) {
+			if(ra->q_count || ra->err) timerclear(tv);
+		} else if(mf->ready) {
+			timerclear(tv);
+		} else if(!mf->armed) {
+			poll_arm(ml, mf);
+		}
+	}
+
+	for(i=0; i<RA_MAX; i++) {
+		if(ml->ra_list[i].used) ra_arm(ml, &ml->ra_list[i]);
+	}
+
+	for(i=0; i<WB_MAX; i++) {
+		if(ml->wb_list[i].buf[0]) wb_submit(ml, &ml->wb_list[i]);
+	}
+
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+	r = uring_enter(&ml->ring, 1, &ts);
+	uring_reap(ml);
+
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		struct readahead *ra;
+		if(!mf->remove && mf->type == FD_READ && (ra = ra_find(ml, mf->fd)) != NULL) {
+			mf->ready = ra->q_count || ra->err;
+		}
+	}
+
+	if(r < 0) {
+		errno = -r;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int wait_select(struct mainloop *ml, struct timeval *tv)
+{
+	int r;
+	int maxfd;
+	fd_set fds_read;
+	fd_set fds_write;
+	fd_set fds_err;
+	struct mainloop_fd_t *mf, *mf_next;
+
+	/*
+	 * Add fd's to fd_set
+	 */
+
+	FD_ZERO(&fds_read);
+	FD_ZERO(&fds_write);
+	FD_ZERO(&fds_err);
+	maxfd = 0;	
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		if(!mf->remove) {
+			if(mf->type == FD_READ) FD_SET(mf->fd, &fds_read);
+			if(mf->type == FD_WRITE) FD_SET(mf->fd, &fds_write);
+			if(mf->type == FD_ERR) FD_SET(mf->fd, &fds_err);
+			if(mf->fd > maxfd) maxfd = mf->fd;
+		}
+	}
+
+	r = select(maxfd+1, &fds_read, &fds_write, &fds_err, tv);
+
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		mf->ready = r > 0 &&
+			(((mf->type == FD_READ) && FD_ISSET(mf->fd, &fds_read)) ||
+			 ((mf->type == FD_WRITE) && FD_ISSET(mf->fd, &fds_write)) ||
+			 ((mf->type == FD_ERR) && FD_ISSET(mf->fd, &fds_err)));
+	}
+
+	return r;
+}
+
+
+int mainloop_ctx_fd_add(struct mainloop *ml, int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
 {
 	struct mainloop_fd_t *mf, *mf_next;
 
 	/*
- 	 * Make sure the same fd is not twice in the list
+ 	 * Make sure the same fd is not twice in the list for the same type
 	 */
 	
-	LIST_FOREACH(mainloop_fd_list, mf, mf_next) {
-		if(mf->fd == fd && !mf->remove) return(-1);
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		if(mf->fd == fd && mf->type == type && !mf->remove) return(-1);
 	}
 
-	mf = calloc(sizeof *mf, 1);
+	mf = pool_alloc(&ml->fd_pool);
 	if(mf == NULL) return(-1);
 	mf->fd      = fd;
 	mf->type    = type;
 	mf->handler = handler;
 	mf->user    = user;
+	mf->id      = ++ml->fd_id;
 	
-	LIST_ADD_ITEM(mainloop_fd_list, mf);
+	LIST_ADD_ITEM(ml->fd_list, mf);
 	
 	return(0);	
 }
@@ -81,12 +1089,12 @@ int mainloop_fd_add(int fd, enum fd_type type, int (*handler)(int fd, void *user
  * Mark this fd for removeal
  */
  
-int mainloop_fd_del(int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
+int mainloop_ctx_fd_del(struct mainloop *ml, int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
 {
 	struct mainloop_fd_t *mf, *mf_next;
 	int found = 0;
 	
-	LIST_FOREACH(mainloop_fd_list, mf, mf_next) {
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
 		if( (mf->fd == fd) && (mf->type == type) && (mf->handler == handler) && (mf->user == user)) {
 			mf->remove = 1;
 			found = 1;
@@ -98,7 +1106,7 @@ int mainloop_fd_del(int fd, enum fd_type type, int (*handler)(int fd, void *user
 }
 
 
-int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user)
+int mainloop_ctx_timer_add(struct mainloop *ml, int sec, int msec, int (*handler)(void *user), void *user)
 {
 	struct timeval interval;
 	struct timeval when;
@@ -111,7 +1119,7 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
 	 * Remove this timer if already pending
 	 */
 
-	mainloop_timer_del(handler, user);
+	mainloop_ctx_timer_del(ml, handler, user);
 
 	/*
 	 * Calculate timestamp when this timer will expire
@@ -126,7 +1134,7 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
 	 * Create new instance
 	 */
 	 	
-	mt = calloc(sizeof *mt, 1);
+	mt = pool_alloc(&ml->timer_pool);
 	if(mt == NULL) return(-1);
 	mt->interval = interval;
 	mt->when     = when;
@@ -137,9 +1145,9 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
 	 * Add it to the list of timers, sorted
 	 */
 	 
-	if(mainloop_timer_list == NULL) {
+	if(ml->timer_list == NULL) {
 
-		mainloop_timer_list = mt;
+		ml->timer_list = mt;
 
 	} else {
 	
@@ -148,7 +1156,7 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
 		 */ 
 
 		sooner = NULL;
-		later  = mainloop_timer_list;
+		later  = ml->timer_list;
 
 		while(later && timercmp(&later->when, &when, < )) {
 			sooner = later;
@@ -163,7 +1171,7 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
 		mt->next = later;
 		if(sooner) sooner->next = mt;
 		if(later)  later->prev = mt;
-		if(sooner == NULL) mainloop_timer_list = mt;
+		if(sooner == NULL) ml->timer_list = mt;
 	}
 		
 	return(0);	
@@ -174,12 +1182,12 @@ int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user
  * Mark the given timer for removal
  */
  
-int mainloop_timer_del(int (*handler)(void *user), void *user)
+int mainloop_ctx_timer_del(struct mainloop *ml, int (*handler)(void *user), void *user)
 {
 	struct mainloop_timer_t *mt, *mt_next;
 	int found = 0;
 
-	LIST_FOREACH(mainloop_timer_list, mt, mt_next) {
+	LIST_FOREACH(ml->timer_list, mt, mt_next) {
 		if( (mt->handler == handler) && (mt->user == user) ) {
 			mt->remove = 1;
 			found = 1;
@@ -193,34 +1201,73 @@ int mainloop_timer_del(int (*handler)(void *user), void *user)
 
 
 
+static void wakeup(struct mainloop *ml)
+{
+	uint64_t one = 1;
+
+	if(ml->wake_fd >= 0 && write(ml->wake_fd, &one, sizeof one) < 0) {
+		/* counter is saturated, the loop wakes up anyway */
+	}
+}
+
+
 /*
- * Signal handler, called for all registered signals
+ * Signal handler, called for all registered signals. Loops run by other
+ * threads are not interrupted by the signal, so all of them are woken
+ * up. Only async-signal-safe work here: no lists are touched.
  */
 
 static void mainloop_signal_handler(int signum)
 {
-	struct mainloop_signal_t *ms, *ms_next;;
-	
-	LIST_FOREACH(mainloop_signal_list, ms, ms_next) {
-		if(ms->signum == signum) ms->signaled = 1;
+	uint64_t one = 1;
+	int saved_errno = errno;
+	int i, fd;
+
+	if(instrument) sig_time[signum] = mono_nsec();
+	__atomic_add_fetch(&sig_count[signum], 1, __ATOMIC_RELEASE);
+
+	for(i=0; i<LOOPS_MAX; i++) {
+		fd = __atomic_load_n(&wake_fds[i], __ATOMIC_ACQUIRE);
+		if(fd >= 0 && write(fd, &one, sizeof one) < 0) {
+			/* counter is saturated, the loop wakes up anyway */
+		}
 	}
+
+	errno = saved_errno;
 }
 
 
+/*
+ * Drop a user of the signal, and reset it to the default behaviour when
+ * no handlers are registered for it anymore
+ */
+
+static void signal_unref(int signum)
+{
+	pthread_mutex_lock(&loops_lock);
+	if(--sig_users[signum] == 0) signal(signum, SIG_DFL);
+	pthread_mutex_unlock(&loops_lock);
+}
 
-int mainloop_signal_add(int signum, int (*handler)(int signum, void *user), void *user)
+
+int mainloop_ctx_signal_add(struct mainloop *ml, int signum, int (*handler)(int signum, void *user), void *user)
 {
 	struct mainloop_signal_t *ms;
+
+	if(signum <= 0 || signum >= NSIG) return(-1);
 	
-	ms = calloc(sizeof *ms, 1);
+	ms = pool_alloc(&ml->signal_pool);
 	if(ms == NULL) return(-1);
 	ms->signum  = signum;
 	ms->handler = handler;
 	ms->user    = user;
+	ms->seen    = __atomic_load_n(&sig_count[signum], __ATOMIC_ACQUIRE);
 
-	LIST_ADD_ITEM(mainloop_signal_list, ms);
+	LIST_ADD_ITEM(ml->signal_list, ms);
 	
-	signal(signum, mainloop_signal_handler);
+	pthread_mutex_lock(&loops_lock);
+	if(sig_users[signum]++ == 0) signal(signum, mainloop_signal_handler);
+	pthread_mutex_unlock(&loops_lock);
 	
 	return(0);	
 }
@@ -230,55 +1277,44 @@ int mainloop_signal_add(int signum, int (*handler)(int signum, void *user), void
  * Mark the given signal for removal
  */
  
-int mainloop_signal_del(int signum, int (*handler)(int signum, void *user))
+int mainloop_ctx_signal_del(struct mainloop *ml, int signum, int (*handler)(int signum, void *user))
 {
 	struct mainloop_signal_t *ms, *ms_next;
-	int signum_refcount = 0;
 	int found = 0;
 
-	LIST_FOREACH(mainloop_signal_list, ms, ms_next) {
-		if( ms->signum == signum ) {
-			signum_refcount ++;
-			if(ms->handler == handler) {
-				found = 1;
-				ms->remove = 1;
-				signum_refcount --;
-			}
+	LIST_FOREACH(ml->signal_list, ms, ms_next) {
+		if( ms->signum == signum && ms->handler == handler && !ms->remove ) {
+			found = 1;
+			ms->remove = 1;
+			signal_unref(signum);
 		}
 	}
 	
 	if(found == 0) return(-1);
-	
-	/*
-	 * If no handlers are registerd for this signal anymore, reset
-	 * the signal to default behaviour 
-	 */
-	 
-	if(signum_refcount == 0) {
-		signal(signum, SIG_DFL);
-	}
-	
 	return(0);
 }
 
 
 /*
- * Start mainloop
+ * Let a stopped loop run again
  */
  
-void mainloop_start(void)
+void mainloop_ctx_start(struct mainloop *ml)
 {
-	mainloop_running = 1;
+	__atomic_store_n(&ml->running, 1, __ATOMIC_RELEASE);
 }
 
 
 /*
- * Request the mainloop to stop on the next iteration
+ * Request the mainloop to stop on the next iteration. Can be called from
+ * any thread, also before the loop runs; a stopped loop only runs again
+ * after mainloop_ctx_start().
  */
  
-void mainloop_stop(void)
+void mainloop_ctx_stop(struct mainloop *ml)
 {
-	mainloop_running = 0;
+	__atomic_store_n(&ml->running, 0, __ATOMIC_RELEASE);
+	if(ml != current) wakeup(ml);
 }
 
 					
@@ -286,48 +1322,28 @@ void mainloop_stop(void)
  * Run the mainloop. Stops when mainloop_stop() is called
  */
 
-int mainloop_poll(void)
+int mainloop_ctx_poll(struct mainloop *ml)
 {
 	int r;
-	int maxfd;
-	fd_set fds_read;
-	fd_set fds_write;
-	fd_set fds_err;
 	struct timeval tv;
 	struct timeval now;
+	unsigned long long t_ready = 0;
 	struct mainloop_fd_t     *mf, *mf_next;
 	struct mainloop_timer_t  *mt, *mt_next;
 	struct mainloop_signal_t *ms, *ms_next;
 
-	/*
-	 * Add fd's to fd_set
-	 */
-
-	FD_ZERO(&fds_read);
-	FD_ZERO(&fds_write);
-	FD_ZERO(&fds_err);
-	maxfd = 0;	
-	LIST_FOREACH(mainloop_fd_list, mf, mf_next) {
-		if(!mf->remove) {
-			if(mf->type == FD_READ) FD_SET(mf->fd, &fds_read);
-			if(mf->type == FD_WRITE) FD_SET(mf->fd, &fds_write);
-			if(mf->type == FD_ERR) FD_SET(mf->fd, &fds_err);
-			if(mf->fd > maxfd) maxfd = mf->fd;
-		}
-	}
-
 	/*
 	 * See if there are timers to expire, and set the select()'s
 	 * timeout value accordingly
 	 */
 	 
-	if(mainloop_timer_list) {
+	if(ml->timer_list) {
 		gettimeofday(&now, NULL);
-		if(timercmp(&now, &mainloop_timer_list->when, >)) {
+		if(timercmp(&now, &ml->timer_list->when, >)) {
 			tv.tv_sec = 0;
 			tv.tv_usec = 0;
 		} else {
-			timersub(&mainloop_timer_list->when, &now, &tv);
+			timersub(&ml->timer_list->when, &now, &tv);
 		}
 		
 	} else {
@@ -341,34 +1357,39 @@ int mainloop_poll(void)
 	 * actual work is done ...
 	 */
 
-	if(mainloop_running == 0) return(0);
-	r = select(maxfd+1, &fds_read, &fds_write, &fds_err, &tv);
+	if(__atomic_load_n(&ml->running, __ATOMIC_ACQUIRE) == 0) return(0);
+	r = ml->use_uring ? wait_uring(ml, &tv) : wait_select(ml, &tv);
 	if((r < 0) && (errno != EINTR)) return(-1);
 
+	ml->stats->iterations ++;
+	if(instrument) t_ready = mono_nsec();
+
 
 	/*
 	 * Call all registerd read fd's that have data
 	 */
 
-	if(r > 0) {		
-		LIST_FOREACH(mainloop_fd_list, mf, mf_next) {
-			if(!mf->remove && mf->handler) {
-				if((mf->type == FD_READ) && FD_ISSET(mf->fd, &fds_read)) mf->handler(mf->fd, mf->user);
-				if((mf->type == FD_WRITE) && FD_ISSET(mf->fd, &fds_write)) mf->handler(mf->fd, mf->user);
-				if((mf->type == FD_ERR) && FD_ISSET(mf->fd, &fds_err)) mf->handler(mf->fd, mf->user);
-			}
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
+		if(!mf->remove && mf->handler && mf->ready) {
+			unsigned long long t = mono_nsec();
+			mf->ready = 0;
+			mf->handler(mf->fd, mf->user);
+			account_handler(ml, (void *)mf->handler, t_ready, t);
 		}
 	}
 
 
 	/*
-	 * Call signal handlers, if signaled
+	 * Call signal handlers, if signaled since they last ran
 	 */
 	 
-	LIST_FOREACH(mainloop_signal_list, ms, ms_next) {
-		if(ms->signaled) {
-			ms->signaled = 0;
+	LIST_FOREACH(ml->signal_list, ms, ms_next) {
+		unsigned n = __atomic_load_n(&sig_count[ms->signum], __ATOMIC_ACQUIRE);
+		if(n != ms->seen && !ms->remove) {
+			unsigned long long t = mono_nsec();
+			ms->seen = n;
 			ms->handler(ms->signum, ms->user);
+			account_handler(ml, (void *)ms->handler, sig_time[ms->signum], t);
 		}
 	}	
 
@@ -379,11 +1400,18 @@ int mainloop_poll(void)
 
 	gettimeofday(&now, NULL);
 
-	while(mainloop_timer_list && timercmp(&mainloop_timer_list->when, &now, <)) {
+	while(ml->timer_list && timercmp(&ml->timer_list->when, &now, <)) {
 
 		r = 0;
-		if(!mainloop_timer_list->remove) {
-			r = mainloop_timer_list->handler(mainloop_timer_list->user);
+		if(!ml->timer_list->remove) {
+			unsigned long long t = mono_nsec();
+			if(instrument) {
+				struct timeval late;
+				timersub(&now, &ml->timer_list->when, &late);
+				t_ready = t - (late.tv_sec * 1000000000ULL + late.tv_usec * 1000ULL);
+			}
+			r = ml->timer_list->handler(ml->timer_list->user);
+			account_handler(ml, (void *)ml->timer_list->handler, t_ready, t);
 		}
 		
 		/*
@@ -392,21 +1420,22 @@ int mainloop_poll(void)
 		 */
 		 
 		if(r != 0) {
-			mainloop_timer_add(	
-					mainloop_timer_list->interval.tv_sec,
-					mainloop_timer_list->interval.tv_usec / 1000,
-					mainloop_timer_list->handler, 
-					mainloop_timer_list->user);
+			mainloop_ctx_timer_add(ml,
+
+					ml->timer_list->interval.tv_sec,
+					ml->timer_list->interval.tv_usec / 1000,
+					ml->timer_list->handler, 
+					ml->timer_list->user);
 		}
 		
 		/*
 		 * Remove and free the expired timer
 		 */
 		 
-		mt_next = mainloop_timer_list->next;
-		free(mainloop_timer_list);
-		mainloop_timer_list = mt_next;
-		if(mainloop_timer_list) mainloop_timer_list->prev = NULL;
+		mt_next = ml->timer_list->next;
+		pool_free(&ml->timer_pool, ml->timer_list);
+		ml->timer_list = mt_next;
+		if(ml->timer_list) ml->timer_list->prev = NULL;
 
 		gettimeofday(&now, NULL);
 	}
@@ -416,24 +1445,25 @@ int mainloop_poll(void)
 	 * Cleanup all fds, signals and timers that have their 'remove' flag set. 
 	 */
 
-	LIST_FOREACH(mainloop_fd_list, mf, mf_next) {
+	LIST_FOREACH(ml->fd_list, mf, mf_next) {
 		if(mf->remove) {
-			LIST_REMOVE_ITEM(mainloop_fd_list, mf);
-			free(mf);
+			if(mf->armed) poll_cancel(ml, mf);
+			LIST_REMOVE_ITEM(ml->fd_list, mf);
+			pool_free(&ml->fd_pool, mf);
 		}
 	}
 
-	LIST_FOREACH(mainloop_signal_list, ms, ms_next) {
+	LIST_FOREACH(ml->signal_list, ms, ms_next) {
 		if(ms->remove) {
-			LIST_REMOVE_ITEM(mainloop_signal_list, ms);
-			free(ms);
+			LIST_REMOVE_ITEM(ml->signal_list, ms);
+			pool_free(&ml->signal_pool, ms);
 		}
 	}
 
-	LIST_FOREACH(mainloop_timer_list, mt, mt_next) {	
+	LIST_FOREACH(ml->timer_list, mt, mt_next) {	
 		if(mt->remove) {
-			LIST_REMOVE_ITEM(mainloop_timer_list, mt);
-			free(mt);
+			LIST_REMOVE_ITEM(ml->timer_list, mt);
+			pool_free(&ml->timer_pool, mt);
 		}
 	}
 
@@ -448,44 +1478,349 @@ static int on_sigquit(int signo, void *data)
 
 
 /*
- * Run the mainloop. Stops when mainloop_stop() is called
+ * Run the tasks posted from other threads, in order
  */
 
-void mainloop_run(void)
+static int on_wake(int fd, void *user)
 {
-	mainloop_running  = 1;
+	struct mainloop *ml = user;
+	struct mainloop_task *t, *t_next, *list;
+	uint64_t n;
 
-	mainloop_signal_add(SIGQUIT, on_sigquit, NULL);
+	if(read(fd, &n, sizeof n) < 0 && errno != EAGAIN) return 0;
 
-	while(mainloop_running) {
-		mainloop_poll();
+	pthread_mutex_lock(&ml->task_lock);
+	list = ml->task_head;
+	ml->task_head = ml->task_tail = NULL;
+	pthread_mutex_unlock(&ml->task_lock);
+
+	for(t = list; t; t = t->next) {
+		t->fn(t->arg);
+	}
+
+	pthread_mutex_lock(&ml->task_lock);
+	for(t = list; t; t = t_next) {
+		t_next = t->next;
+		pool_free(&ml->task_pool, t);
 	}
+	pthread_mutex_unlock(&ml->task_lock);
 
+	return 0;
 }
 
 
-void mainloop_cleanup(void)
+/*
+ * Create the wake fd of a loop, and publish it for the signal handler
+ */
+
+static int wake_init(struct mainloop *ml)
+{
+	int i;
+
+	pthread_mutex_lock(&loops_lock);
+	if(ml->wake_fd < 0) {
+		ml->wake_fd = n_spare ? spare_fds[--n_spare] : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		for(i=0; i<LOOPS_MAX && ml->wake_fd >= 0; i++) {
+			if(wake_fds[i] < 0) {
+				__atomic_store_n(&wake_fds[i], ml->wake_fd, __ATOMIC_RELEASE);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&loops_lock);
+
+	return ml->wake_fd < 0 ? -1 : 0;
+}
+
+
+/*
+ * Withdraw the wake fd of a loop from the signal handler. One the handler
+ * may still see is kept open for the next loop.
+ */
+
+static void wake_release(struct mainloop *ml)
+{
+	int i, published = 0;
+
+	pthread_mutex_lock(&loops_lock);
+	for(i=0; i<LOOPS_MAX; i++) {
+		if(wake_fds[i] == ml->wake_fd) {
+			__atomic_store_n(&wake_fds[i], -1, __ATOMIC_RELEASE);
+			published = 1;
+		}
+	}
+	if(published) {
+		spare_fds[n_spare++] = ml->wake_fd;
+	} else if(ml->wake_fd >= 0) {
+		close(ml->wake_fd);
+	}
+	ml->wake_fd = -1;
+	pthread_mutex_unlock(&loops_lock);
+}
+
+
+/*
+ * Run the mainloop in the calling thread. Stops when mainloop_ctx_stop()
+ * is called
+ */
+
+void mainloop_ctx_run(struct mainloop *ml)
+{
+	struct mainloop *prev = current;
+
+	if(ml == &default_loop) mainloop_ctx_signal_add(ml, SIGQUIT, on_sigquit, NULL);
+	if(wake_init(ml) == 0) mainloop_ctx_fd_add(ml, ml->wake_fd, FD_READ, on_wake, ml);
+
+	current = ml;
+	ml->in_loop = 1;
+	while(__atomic_load_n(&ml->running, __ATOMIC_ACQUIRE)) {
+		mainloop_ctx_poll(ml);
+	}
+	ml->in_loop = 0;
+	current = prev;
+
+	if(ml->wake_fd >= 0) mainloop_ctx_fd_del(ml, ml->wake_fd, FD_READ, on_wake, ml);
+
+	loop_flush(ml, -1);
+}
+
+
+static void loop_cleanup(struct mainloop *ml)
 {
 	struct mainloop_fd_t     *mf, *mf_next;
 	struct mainloop_timer_t  *mt, *mt_next;
 	struct mainloop_signal_t *ms, *ms_next;
 
-	if(mainloop_running) return;
+	if(ml->running) return;
 
 	/*
 	 * Free all used stuff
 	 */
 
-	LIST_FOREACH(mainloop_fd_list,     mf, mf_next) free(mf);
-	LIST_FOREACH(mainloop_timer_list,  mt, mt_next) free(mt);
-	LIST_FOREACH(mainloop_signal_list, ms, ms_next) free(ms);
+	LIST_FOREACH(ml->fd_list,     mf, mf_next) pool_free(&ml->fd_pool, mf);
+	LIST_FOREACH(ml->timer_list,  mt, mt_next) pool_free(&ml->timer_pool, mt);
+	LIST_FOREACH(ml->signal_list, ms, ms_next) {
+		if(!ms->remove) signal_unref(ms->signum);
+		pool_free(&ml->signal_pool, ms);
+	}
 	
-	mainloop_fd_list     = NULL;
-	mainloop_timer_list  = NULL;
-	mainloop_signal_list = NULL;
+	ml->fd_list     = NULL;
+	ml->timer_list  = NULL;
+	ml->signal_list = NULL;
+
+	pool_release(&ml->fd_pool);
+	pool_release(&ml->timer_pool);
+	pool_release(&ml->signal_pool);
+
+	if(ml->use_uring) {
+		int i;
+		loop_flush(ml, -1);
+		for(i=0; i<RA_MAX; i++) {
+			if(ml->ra_list[i].used) ra_free(ml, &ml->ra_list[i]);
+		}
+		for(i=0; i<WB_MAX; i++) {
+			free(ml->wb_list[i].buf[0]);
+			ml->wb_list[i].buf[0] = ml->wb_list[i].buf[1] = NULL;
+		}
+		uring_exit(&ml->ring);
+		ml->use_uring = 0;
+	}
+}
+
+
+/*
+ * Create a new loop, to be run by mainloop_ctx_run(), typically in its
+ * own thread
+ */
 
+struct mainloop *mainloop_ctx_create(void)
+{
+	struct mainloop *ml;
+
+	ml = calloc(1, sizeof *ml);
+	if(ml == NULL) return NULL;
+
+	ml->running = 1;
+	ml->stats = &ml->own_stats;
+	ml->fd_pool.size = sizeof(struct mainloop_fd_t);
+	ml->timer_pool.size = sizeof(struct mainloop_timer_t);
+	ml->signal_pool.size = sizeof(struct mainloop_signal_t);
+	ml->task_pool.size = sizeof(struct mainloop_task);
+	ml->wake_fd = -1;
+	pthread_mutex_init(&ml->task_lock, NULL);
+
+	if(wake_init(ml) != 0) {
+		pthread_mutex_destroy(&ml->task_lock);
+		free(ml);
+		return NULL;
+	}
+
+	return ml;
 }
 
 
-/* end */
+/*
+ * Free a loop which is not running. Tasks still posted to it are
+ * dropped.
+ */
+
+void mainloop_ctx_destroy(struct mainloop *ml)
+{
+	struct mainloop_task *t, *t_next;
+
+	if(ml == &default_loop) {
+		mainloop_cleanup();
+		return;
+	}
+
+	ml->running = 0;
+	loop_cleanup(ml);
+	wake_release(ml);
+
+	for(t = ml->task_head; t; t = t_next) {
+		t_next = t->next;
+		pool_free(&ml->task_pool, t);
+	}
+	pool_release(&ml->task_pool);
+
+	pthread_mutex_destroy(&ml->task_lock);
+	free(ml);
+}
+
+
+/*
+ * Run fn(arg) from the given loop, in the order posted. Can be called
+ * from any thread.
+ */
+
+int mainloop_ctx_post(struct mainloop *ml, void (*fn)(void *arg), void *arg)
+{
+	struct mainloop_task *t;
+
+	if(wake_init(ml) != 0) return -1;
+
+	pthread_mutex_lock(&ml->task_lock);
+	t = pool_alloc(&ml->task_pool);
+	if(t) {
+		t->fn = fn;
+		t->arg = arg;
+		if(ml->task_tail) {
+			ml->task_tail->next = t;
+		} else {
+			ml->task_head = t;
+		}
+		ml->task_tail = t;
+	}
+	pthread_mutex_unlock(&ml->task_lock);
+
+	if(t == NULL) return -1;
+
+	wakeup(ml);
+	return 0;
+}
+
+
+/*
+ * Make the loop run an iteration, e.g. after changing state it checks
+ * from a timer. Can be called from any thread.
+ */
+
+void mainloop_ctx_wakeup(struct mainloop *ml)
+{
+	if(wake_init(ml) == 0) wakeup(ml);
+}
+
+
+struct mainloop *mainloop_ctx_default(void)
+{
+	return &default_loop;
+}
+
+
+/*
+ * The loop run by the calling thread, NULL when it runs none
+ */
+
+struct mainloop *mainloop_ctx_current(void)
+{
+	return current;
+}
 
+
+const struct mainloop_stats *mainloop_ctx_stats(struct mainloop *ml)
+{
+	return ml->stats;
+}
+
+
+/*
+ * The global API, on the calling thread's loop or the default loop
+ */
+
+int mainloop_fd_add(int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
+{
+	return mainloop_ctx_fd_add(cur(), fd, type, handler, user);
+}
+
+
+int mainloop_fd_del(int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user)
+{
+	return mainloop_ctx_fd_del(cur(), fd, type, handler, user);
+}
+
+
+int mainloop_timer_add(int sec, int msec, int (*handler)(void *user), void *user)
+{
+	return mainloop_ctx_timer_add(cur(), sec, msec, handler, user);
+}
+
+
+int mainloop_timer_del(int (*handler)(void *user), void *user)
+{
+	return mainloop_ctx_timer_del(cur(), handler, user);
+}
+
+
+int mainloop_signal_add(int signum, int (*handler)(int signum, void *user), void *user)
+{
+	return mainloop_ctx_signal_add(cur(), signum, handler, user);
+}
+
+
+int mainloop_signal_del(int signum, int (*handler)(int signum, void *user))
+{
+	return mainloop_ctx_signal_del(cur(), signum, handler);
+}
+
+
+void mainloop_start(void)
+{
+	mainloop_ctx_start(&default_loop);
+}
+
+
+void mainloop_stop(void)
+{
+	mainloop_ctx_stop(cur());
+}
+
+
+int mainloop_poll(void)
+{
+	return mainloop_ctx_poll(cur());
+}
+
+
+void mainloop_run(void)
+{
+	mainloop_ctx_run(&default_loop);
+}
+
+
+void mainloop_cleanup(void)
+{
+	loop_cleanup(&default_loop);
+}
+
+
+/* end */
@@ -1,6 +1,23 @@
 #ifndef mainloop_h
 #define mainloop_h
 
+#include <stdio.h>
+#include <sys/types.h>
+
+struct mainloop_stats {
+	unsigned long long iterations;
+	unsigned long long dispatches;
+	unsigned long long handler_nsec;
+	unsigned long long handler_max_nsec;
+	unsigned long long uring_enters;
+	unsigned long long uring_sqes;
+	unsigned long long uring_reads;
+	unsigned long long uring_writes;
+	unsigned long long write_errors;
+};
+
+extern struct mainloop_stats mainloop_stats;
+
 enum fd_type {
 	FD_READ,
 	FD_WRITE,
@@ -22,4 +39,51 @@ int  mainloop_poll(void);
 void mainloop_run(void);
 void mainloop_cleanup(void);
 
+int mainloop_backend(const char *name);
+const char *mainloop_backend_name(void);
+int mainloop_readahead(int fd, int onoff);
+ssize_t mainloop_read(int fd, void *buf, size_t len);
+size_t mainloop_read_pending(int fd);
+void mainloop_fd_flush(int fd);
+ssize_t mainloop_write(int fd, const void *buf, size_t len);
+void mainloop_flush(int fd);
+FILE *mainloop_fdopen(int fd, const char *mode);
+
+void mainloop_instrument(int onoff);
+void mainloop_handler_name(void *handler, const char *name);
+void mainloop_profile_dump(FILE *f);
+int  mainloop_trace_dump(const char *fname);
+
+/*
+ * Independent loop contexts, e.g. one per thread. A context is run by
+ * one thread; registering fds, timers and signals is done from that
+ * thread or before it runs. Posting, waking up and stopping work from
+ * any thread; a loop stopped before it runs returns at once, until
+ * mainloop_ctx_start() allows it to run again. The functions above act
+ * on the loop run by the calling thread, or on the default loop.
+ */
+
+struct mainloop;
+
+struct mainloop *mainloop_ctx_create(void);
+void mainloop_ctx_destroy(struct mainloop *ml);
+struct mainloop *mainloop_ctx_default(void);
+struct mainloop *mainloop_ctx_current(void);
+const struct mainloop_stats *mainloop_ctx_stats(struct mainloop *ml);
+
+int mainloop_ctx_fd_add(struct mainloop *ml, int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user);
+int mainloop_ctx_fd_del(struct mainloop *ml, int fd, enum fd_type type, int (*handler)(int fd, void *user), void *user);
+int mainloop_ctx_timer_add(struct mainloop *ml, int sec, int msec, int (*handler)(void *user), void *user);
+int mainloop_ctx_timer_del(struct mainloop *ml, int (*handler)(void *user), void *user);
+int mainloop_ctx_signal_add(struct mainloop *ml, int signum, int (*handler)(int signum, void *user), void *user);
+int mainloop_ctx_signal_del(struct mainloop *ml, int signum, int (*handler)(int signum, void *user));
+int mainloop_ctx_backend(struct mainloop *ml, const char *name);
+
+void mainloop_ctx_run(struct mainloop *ml);
+void mainloop_ctx_start(struct mainloop *ml);
+int  mainloop_ctx_poll(struct mainloop *ml);
+void mainloop_ctx_stop(struct mainloop *ml);
+void mainloop_ctx_wakeup(struct mainloop *ml);
+int  mainloop_ctx_post(struct mainloop *ml, void (*fn)(void *arg), void *arg);
+
 #endif
@@ -0,0 +1,318 @@
+
+/*
+ * Prometheus text format metrics endpoint, on a unix or TCP socket (see
+ * sock_listen()). TCP clients are served as HTTP, so a Prometheus server
+ * can scrape directly; unix socket clients get the plain metrics text as
+ * soon as they connect.
+ *
+ * All sockets are non blocking and handled from the mainloop. The metrics
+ * text is only rendered when a client asks for it, so there is no cost
+ * on the data path besides the counters that are kept anyway.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "mainloop.h"
+#include "stats.h"
+#include "metrics.h"
+#include "sock.h"
+#include "pool.h"
+#include "rt.h"
+#include "pipeline.h"
+
+#define MAX_CLIENTS 8
+#define CLIENT_TIMEOUT 10      /* seconds */
+
+static const char *port_name = "";
+static int is_unix;
+
+struct client {
+	int fd;
+	char *buf;              /* reply, written from 'off' on */
+	size_t len;
+	size_t off;
+	int writing;            /* waiting for the socket to take more */
+};
+
+static struct client clients[MAX_CLIENTS] = { [0 ... MAX_CLIENTS-1] = { .fd = -1 } };
+
+static int on_metrics_accept(int fd, void *data);
+static int on_metrics_request(int fd, void *data);
+static int on_metrics_write(int fd, void *data);
+static int on_metrics_timeout(void *data);
+
+
+static int metrics_render(char *buf, size_t size)
+{
+	struct serial_icount ic;
+	char *p = buf;
+	char *end = buf + size;
+	const char *n = port_name;
+
+	stats_get_errors(&ic);
+
+#define METRIC(type, name, help, fmt, val) \
+	p += snprintf(p, end - p, "# HELP iterm_" name " " help "\n# TYPE iterm_" name " " type "\n" \
+			"iterm_" name "{port=\"%s\"} " fmt "\n", n, val); \
+	if(p >= end) return -1;
+
+#define COUNTER(name, help, val) METRIC("counter", name, help, "%llu", (unsigned long long)(val))
+#define GAUGE(name, help, fmt, val) METRIC("gauge", name, help, fmt, val)
+
+	COUNTER("rx_bytes_total", "Bytes received from the serial port", stats.rx_bytes);
+	COUNTER("tx_bytes_total", "Bytes written to the serial port", stats.tx_bytes);
+	COUNTER("rx_reads_total", "Read calls on the serial port", stats.rx_reads);
+	COUNTER("tx_writes_total", "Write calls on the serial port", stats.tx_writes);
+	COUNTER("rx_coalesced_reads_total", "Reads done after a coalescing window in the bulk profile", stats.rx_coalesced);
+	COUNTER("io_profile_switches_total", "Switches of the adaptive read profile", stats.io_switches);
+	GAUGE("rx_rate_bytes", "Receive rate in bytes/sec", "%.0f", stats.rx_rate);
+	GAUGE("tx_rate_bytes", "Transmit rate in bytes/sec", "%.0f", stats.tx_rate);
+	GAUGE("rx_queue_bytes", "Bytes waiting in the kernel input queue", "%d", stats.inq);
+	GAUGE("tx_queue_bytes", "Bytes waiting in the kernel output queue", "%d", stats.outq);
+	COUNTER("log_bytes_total", "Bytes written to the log", stats.log_bytes);
+	GAUGE("log_pending_bytes", "Log bytes not yet flushed", "%llu", (unsigned long long)stats.log_pending);
+	COUNTER("modem_transitions_total", "Modem control line transitions", stats.modem_transitions);
+	COUNTER("reconnects_total", "Serial port reconnects", stats.reconnects);
+	COUNTER("splice_bytes_total", "Bytes moved with splice()", stats.splice_bytes);
+	COUNTER("copy_bytes_total", "Bytes copied through user space in splice mode", stats.copy_bytes);
+	COUNTER("json_dropped_records_total", "JSON records dropped for slow socket clients", stats.json_dropped);
+	GAUGE("tx_pace_queue_bytes", "Bytes waiting in the transmit pacing queue", "%llu", (unsigned long long)stats.tx_queued);
+	COUNTER("tx_pace_holds_total", "Pacing stalls because the kernel output queue was too full", stats.tx_pace_holds);
+	COUNTER("render_skipped_bytes_total", "Bytes not rendered to the terminal due to decimation", stats.render_skipped);
+	COUNTER("uart_frame_errors_total", "UART framing errors", ic.frame);
+	COUNTER("uart_parity_errors_total", "UART parity errors", ic.parity);
+	COUNTER("uart_overruns_total", "UART hardware overruns", ic.overrun);
+	COUNTER("uart_buf_overruns_total", "tty buffer overruns", ic.buf_overrun);
+	COUNTER("uart_breaks_total", "Break conditions received", ic.brk);
+	COUNTER("mainloop_iterations_total", "Mainloop iterations", mainloop_stats.iterations);
+	COUNTER("mainloop_dispatches_total", "Mainloop handler calls", mainloop_stats.dispatches);
+	METRIC("counter", "mainloop_handler_seconds_total", "Total time spent in mainloop handlers", "%.9f",
+			mainloop_stats.handler_nsec * 1E-9);
+	COUNTER("mainloop_uring_enters_total", "io_uring_enter() calls of the io_uring event loop", mainloop_stats.uring_enters);
+	COUNTER("mainloop_uring_submissions_total", "Requests submitted by the io_uring event loop", mainloop_stats.uring_sqes);
+	COUNTER("mainloop_uring_reads_total", "Read completions of the io_uring event loop", mainloop_stats.uring_reads);
+	COUNTER("mainloop_uring_writes_total", "Write completions of the io_uring event loop", mainloop_stats.uring_writes);
+	GAUGE("mainloop_handler_max_seconds", "Longest mainloop handler run", "%.9f",
+			mainloop_stats.handler_max_nsec * 1E-9);
+	GAUGE("wakeup_latency_p50_seconds", "Median mainloop wakeup latency", "%.9f",
+			hist_percentile(rt_wakeup(), 50) * 1E-9);
+	GAUGE("wakeup_latency_p99_seconds", "99th percentile mainloop wakeup latency", "%.9f",
+			hist_percentile(rt_wakeup(), 99) * 1E-9);
+	GAUGE("wakeup_latency_max_seconds", "Highest mainloop wakeup latency", "%.9f",
+			rt_wakeup()->max * 1E-9);
+
+	/* Allocator pools, one sample per pool */
+
+#define POOL_METRIC(type, metric, help, field) \
+	p += snprintf(p, end - p, "# HELP iterm_" metric " " help "\n# TYPE iterm_" metric " " type "\n"); \
+	for(pl = pool_list(); pl && p < end; pl = pl->next) { \
+		p += snprintf(p, end - p, "iterm_" metric "{port=\"%s\",pool=\"%s\"} %llu\n", \
+				n, pl->name, (unsigned long long)pl->field); \
+	} \
+	if(p >= end) return -1;
+
+	struct pool *pl;
+	POOL_METRIC("counter", "pool_allocs_total", "Objects allocated from the pool", allocs);
+	POOL_METRIC("counter", "pool_mallocs_total", "Slabs allocated with malloc for the pool", mallocs);
+	POOL_METRIC("gauge", "pool_in_use_objects", "Objects currently allocated from the pool", in_use);
+	POOL_METRIC("gauge", "pool_capacity_objects", "Objects available in the pool slabs", capacity);
+
+#undef POOL_METRIC
+
+	/* Processing stages, one sample per stage */
+
+#define STAGE_METRIC(type, metric, help, fmt, val) \
+	p += snprintf(p, end - p, "# HELP iterm_" metric " " help "\n# TYPE iterm_" metric " " type "\n"); \
+	for(pp = pipeline_list(); pp && p < end; pp = pp->next) { \
+		for(st = pp->first; st && p < end; st = st->next) { \
+			p += snprintf(p, end - p, "iterm_" metric "{port=\"%s\",chain=\"%s\",stage=\"%s\"} " fmt "\n", \
+					n, pp->name, st->name, val); \
+		} \
+	} \
+	if(p >= end) return -1;
+
+	struct pipeline *pp;
+	struct stage *st;
+	STAGE_METRIC("counter", "stage_chunks_total", "Chunks processed by the stage", "%llu", (unsigned long long)st->chunks);
+	STAGE_METRIC("counter", "stage_in_bytes_total", "Bytes into the stage", "%llu", (unsigned long long)st->bytes_in);
+	STAGE_METRIC("counter", "stage_out_bytes_total", "Bytes passed on by the stage", "%llu", (unsigned long long)st->bytes_out);
+	STAGE_METRIC("counter", "stage_seconds_total", "Time spent in the stage itself, when profiling", "%.9f", st->nsec * 1E-9);
+
+#undef STAGE_METRIC
+#undef METRIC
+#undef COUNTER
+#undef GAUGE
+
+	return p - buf;
+}
+
+
+static void client_close(struct client *c)
+{
+	mainloop_fd_del(c->fd, FD_READ, on_metrics_request, c);
+	mainloop_fd_del(c->fd, FD_WRITE, on_metrics_write, c);
+	mainloop_timer_del(on_metrics_timeout, c);
+	close(c->fd);
+	free(c->buf);
+	c->buf = NULL;
+	c->fd = -1;
+}
+
+
+/*
+ * Write as much of the reply as the socket takes, the rest goes out from
+ * on_metrics_write(). The client is closed when all is sent or on error.
+ */
+
+static void client_flush(struct client *c)
+{
+	while(c->off < c->len) {
+		ssize_t r = send(c->fd, c->buf + c->off, c->len - c->off, MSG_NOSIGNAL);
+		if(r < 0 && errno == EINTR) continue;
+		if(r < 0 && errno == EAGAIN) {
+			if(!c->writing) {
+				mainloop_fd_add(c->fd, FD_WRITE, on_metrics_write, c);
+				c->writing = 1;
+			}
+			return;
+		}
+		if(r <= 0) break;
+		c->off += r;
+	}
+
+	client_close(c);
+}
+
+
+static void metrics_send(struct client *c, int http)
+{
+	char buf[32768];
+	char hdr[128];
+	int len = metrics_render(buf, sizeof buf);
+	int hlen = 0;
+
+	if(len < 0) {
+		len = 0;
+		if(http) hlen = snprintf(hdr, sizeof hdr, "HTTP/1.0 500 Internal Server Error\r\n\r\n");
+	} else if(http) {
+		hlen = snprintf(hdr, sizeof hdr,
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %d\r\n\r\n", len);
+	}
+
+	c->buf = malloc(hlen + len + 1);
+	if(c->buf == NULL) {
+		client_close(c);
+		return;
+	}
+	memcpy(c->buf, hdr, hlen);
+	memcpy(c->buf + hlen, buf, len);
+	c->len = hlen + len;
+	c->off = 0;
+
+	client_flush(c);
+}
+
+
+static int on_metrics_write(int fd, void *data)
+{
+	client_flush(data);
+	return 0;
+}
+
+
+static int on_metrics_timeout(void *data)
+{
+	client_close(data);
+	return 0;
+}
+
+
+static int on_metrics_request(int fd, void *data)
+{
+	struct client *c = data;
+	char buf[1024];
+	int r;
+
+	/*
+	 * We do not care about the request itself, answer to anything
+	 */
+
+	r = read(fd, buf, sizeof buf);
+	if(r > 0) {
+		mainloop_fd_del(fd, FD_READ, on_metrics_request, c);
+		metrics_send(c, 1);
+	} else if(r == 0 || errno != EAGAIN) {
+		client_close(c);
+	}
+	return 0;
+}
+
+
+static int on_metrics_accept(int fd, void *data)
+{
+	struct client *c = NULL;
+	int cfd = accept(fd, NULL, NULL);
+	int i;
+
+	if(cfd < 0) return 0;
+
+	for(i=0; i<MAX_CLIENTS; i++) {
+		if(clients[i].fd < 0) {
+			c = &clients[i];
+			break;
+		}
+	}
+
+	if(c == NULL) {
+		close(cfd);
+		return 0;
+	}
+
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+	c->fd = cfd;
+	c->writing = 0;
+
+	/* Clients which never send a request or never read the reply are dropped */
+
+	mainloop_timer_add(CLIENT_TIMEOUT, 0, on_metrics_timeout, c);
+
+	if(is_unix) {
+		metrics_send(c, 0);
+	} else if(mainloop_fd_add(cfd, FD_READ, on_metrics_request, c) != 0) {
+		client_close(c);
+	}
+
+	return 0;
+}
+
+
+int metrics_listen(const char *addr, const char *port)
+{
+	int fd;
+
+	port_name = port;
+
+	fd = sock_listen(addr, MAX_CLIENTS, &is_unix);
+	if(fd < 0) return -1;
+
+	mainloop_fd_add(fd, FD_READ, on_metrics_accept, NULL);
+	mainloop_handler_name((void *)on_metrics_accept, "metrics_accept");
+	mainloop_handler_name((void *)on_metrics_request, "metrics_request");
+	mainloop_handler_name((void *)on_metrics_write, "metrics_write");
+	mainloop_handler_name((void *)on_metrics_timeout, "metrics_timeout");
+
+	return fd;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,6 @@
+#ifndef metrics_h
+#define metrics_h
+
+int metrics_listen(const char *addr, const char *port);
+
+#endif
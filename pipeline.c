@@ -0,0 +1,154 @@
+/*
+ * Processing chains. A pipeline is an ordered list of stages; a chunk
+ * fed to the pipeline goes to the first enabled stage, and every stage
+ * passes its output on to the next enabled one with stage_emit(). The
+ * last stage is the sink and emits nothing.
+ *
+ * Disabled stages are unlinked from the chain when they are switched,
+ * so they cost nothing on the data path. Every stage counts chunks and
+ * bytes; with instrumentation enabled its own run time is measured as
+ * well, excluding the time spent in the stages after it.
+ */
+
+
+#include "clock.h"
+#include "pipeline.h"
+
+static struct pipeline *pipelines = NULL;
+static int instrument = 0;
+static uint64_t t_child;
+
+
+void pipeline_init(struct pipeline *pl, const char *name)
+{
+	pl->name = name;
+	pl->first = NULL;
+	pl->first_on = NULL;
+	pl->next = pipelines;
+	pipelines = pl;
+}
+
+
+/*
+ * Find the next enabled stage for every stage, disabled ones included:
+ * those can still emit, e.g. when flushing state while being switched off
+ */
+
+static void relink(struct pipeline *pl)
+{
+	struct stage *s, *p;
+	struct stage *from = pl->first;
+
+	pl->first_on = NULL;
+
+	/* Every stage from 'from' up to the next enabled one links to that one */
+
+	for(s = pl->first; s; s = s->next) {
+		if(!s->enabled) continue;
+		if(pl->first_on == NULL) pl->first_on = s;
+		for(p = from; p != s; p = p->next) p->next_on = s;
+		from = s;
+	}
+
+	for(p = from; p; p = p->next) p->next_on = NULL;
+}
+
+
+/*
+ * Append a stage to the end of the chain, disabled
+ */
+
+void pipeline_add(struct pipeline *pl, struct stage *s)
+{
+	struct stage **p = &pl->first;
+
+	while(*p) p = &(*p)->next;
+	*p = s;
+
+	s->pl = pl;
+	s->next = NULL;
+	s->enabled = 0;
+	relink(pl);
+}
+
+
+void pipeline_enable(struct stage *s, int onoff)
+{
+	if(s->enabled == !!onoff) return;
+
+	s->enabled = !!onoff;
+	relink(s->pl);
+}
+
+
+static void dispatch(struct stage *s, const struct chunk *c)
+{
+	uint64_t t, saved;
+
+	s->chunks ++;
+	s->bytes_in += c->len;
+
+	if(!instrument) {
+		s->process(s, c);
+		return;
+	}
+
+	saved = t_child;
+	t_child = 0;
+	t = mono_nsec();
+	s->process(s, c);
+	t = mono_nsec() - t;
+	s->nsec += t - t_child;
+	t_child = saved + t;
+}
+
+
+void pipeline_feed(struct pipeline *pl, const struct chunk *c)
+{
+	if(pl->first_on) dispatch(pl->first_on, c);
+}
+
+
+/*
+ * Flush the output of all enabled stages, in chain order
+ */
+
+void pipeline_flush(struct pipeline *pl)
+{
+	struct stage *s;
+
+	for(s = pl->first_on; s; s = s->next_on) {
+		if(s->flush) s->flush(s);
+	}
+}
+
+
+void pipeline_instrument(int onoff)
+{
+	instrument = onoff;
+}
+
+
+struct pipeline *pipeline_list(void)
+{
+	return pipelines;
+}
+
+
+void stage_emit(struct stage *s, const struct chunk *c)
+{
+	s->bytes_out += c->len;
+	if(s->next_on) dispatch(s->next_on, c);
+}
+
+
+void stage_emit_buf(struct stage *s, const void *buf, size_t len, int flags)
+{
+	struct chunk c = { buf, len, flags };
+
+	stage_emit(s, &c);
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,67 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Chunk flags. Stages that transform device data pass chunks with any
+ * of these flags on unchanged, unless stated otherwise.
+ */
+
+#define CHUNK_TX      1   /* data sent to the port, e.g. local echo */
+#define CHUNK_MARKER  2   /* line added by iterm itself, timestamped but not filtered */
+#define CHUNK_TEXT    4   /* formatted output, passed on to the sink as is */
+
+/*
+ * A chunk references a buffer owned by whoever emits it, and is only
+ * valid during the call. Stages that do not change the data pass on the
+ * same chunk, so one read buffer feeds all chains without copying.
+ */
+
+struct chunk {
+	const uint8_t *buf;
+	size_t len;
+	int flags;
+};
+
+struct pipeline;
+
+struct stage {
+	const char *name;
+	void (*process)(struct stage *s, const struct chunk *c);
+	void (*flush)(struct stage *s);
+	void *user;
+
+	int enabled;
+	struct pipeline *pl;
+	struct stage *next;
+	struct stage *next_on;  /* next enabled stage */
+
+	uint64_t chunks;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t nsec;          /* own run time, without the stages it emits to */
+};
+
+struct pipeline {
+	const char *name;
+	struct stage *first;
+	struct stage *first_on;
+	struct pipeline *next;
+};
+
+#define STAGE_INIT(name, process, flush, user) { name, process, flush, user }
+
+void pipeline_init(struct pipeline *pl, const char *name);
+void pipeline_add(struct pipeline *pl, struct stage *s);
+void pipeline_enable(struct stage *s, int onoff);
+void pipeline_feed(struct pipeline *pl, const struct chunk *c);
+void pipeline_flush(struct pipeline *pl);
+void pipeline_instrument(int onoff);
+struct pipeline *pipeline_list(void);
+
+void stage_emit(struct stage *s, const struct chunk *c);
+void stage_emit_buf(struct stage *s, const void *buf, size_t len, int flags);
+
+#endif
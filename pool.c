@@ -0,0 +1,138 @@
+/*
+ * Slab pool allocator. Each pool hands out objects of one size. Slabs
+ * are cache line aligned and grow geometrically, from SLAB_MIN up to
+ * SLAB_MAX objects, so small pools stay small and large ones need few
+ * mallocs. Free objects hold the free list link in their first word.
+ *
+ * Pools register themselves on first use so their counters can be
+ * listed with pool_list(). Slabs are only returned to the system by
+ * pool_release(), which requires all objects to be freed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define SLAB_MIN   16
+#define SLAB_MAX   1024
+#define ALIGN      16
+#define CACHE_LINE 64
+
+struct pool_slab {
+	struct pool_slab *next;
+	unsigned objs;
+};
+
+static struct pool *pools = NULL;
+
+
+static size_t obj_size(struct pool *p)
+{
+	size_t size = p->size < sizeof(void *) ? sizeof(void *) : p->size;
+	return (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+
+static int grow(struct pool *p)
+{
+	struct pool_slab *slab;
+	size_t size = obj_size(p);
+	size_t hdr = (sizeof *slab + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	unsigned n = p->slab_objs ? p->slab_objs * 2 : SLAB_MIN;
+	uint8_t *obj;
+	unsigned i;
+
+	if(n > SLAB_MAX) n = SLAB_MAX;
+
+	if(posix_memalign((void **)&slab, CACHE_LINE, hdr + n * size) != 0) return -1;
+	p->mallocs ++;
+
+	/* Unnamed pools may be freed with their owner, keep them unlisted */
+
+	if(p->mallocs == 1 && p->name) {
+		p->next = pools;
+		pools = p;
+	}
+
+	slab->objs = n;
+	slab->next = p->slabs;
+	p->slabs = slab;
+	p->slab_objs = n;
+	p->capacity += n;
+
+	/* Chain the objects so they are handed out in address order */
+
+	obj = (uint8_t *)slab + hdr;
+	for(i=n; i>0; i--) {
+		void **o = (void **)(obj + (i - 1) * size);
+		*o = p->free_list;
+		p->free_list = o;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns a zeroed object, or NULL when out of memory
+ */
+
+void *pool_alloc(struct pool *p)
+{
+	void **o;
+
+	if(p->free_list == NULL && grow(p) != 0) return NULL;
+
+	o = p->free_list;
+	p->free_list = *o;
+
+	p->allocs ++;
+	p->in_use ++;
+	if(p->in_use > p->peak) p->peak = p->in_use;
+
+	memset(o, 0, p->size);
+	return o;
+}
+
+
+void pool_free(struct pool *p, void *obj)
+{
+	void **o = obj;
+
+	if(obj == NULL) return;
+
+	*o = p->free_list;
+	p->free_list = o;
+
+	p->frees ++;
+	p->in_use --;
+}
+
+
+void pool_release(struct pool *p)
+{
+	struct pool_slab *slab, *next;
+
+	if(p->in_use) return;
+
+	for(slab = p->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	p->slabs = NULL;
+	p->free_list = NULL;
+	p->slab_objs = 0;
+	p->capacity = 0;
+}
+
+
+struct pool *pool_list(void)
+{
+	return pools;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,40 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed size object pool. Objects are carved from contiguous slabs and
+ * recycled through an intrusive LIFO free list, so a steady state of
+ * allocations and frees does not touch malloc at all. Named pools are
+ * listed by pool_list() once used.
+ */
+
+struct pool_slab;
+
+struct pool {
+	const char *name;
+	size_t size;
+
+	void *free_list;
+	struct pool_slab *slabs;
+	unsigned slab_objs;
+	struct pool *next;
+
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t mallocs;
+	unsigned in_use;
+	unsigned peak;
+	unsigned capacity;
+};
+
+#define POOL_INIT(name, type) { name, sizeof(type) }
+
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+void pool_release(struct pool *p);
+struct pool *pool_list(void);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * PRBS generator and self-synchronising checker.
+ *
+ * The checker does not need to know the phase of the transmitted
+ * sequence: it predicts every bit from the previously received ones,
+ * using the same feedback taps as the generator. After 'order' clean
+ * bits the register holds a valid state and the prediction locks. A
+ * single bit error on the line shows up three times (once when
+ * received, and once for each tap it passes), a dropped or inserted
+ * byte gives a short burst after which the checker resynchronises by
+ * itself.
+ */
+
+#include <string.h>
+
+#include "prbs.h"
+
+#define SYNC_BITS   64     /* clean bits needed to declare sync */
+#define SYNC_LOSS   16     /* errors within the last 64 bits to lose sync */
+#define BURST_GAP   64     /* clean bits separating two bursts */
+
+static const struct {
+	int order;
+	int tap;
+} poly[] = {
+	{  7,  6 },      /* x^7 + x^6 + 1 */
+	{ 15, 14 },      /* x^15 + x^14 + 1 */
+	{ 23, 18 },      /* x^23 + x^18 + 1 */
+};
+
+
+static int find_tap(int order)
+{
+	int i;
+
+	for(i=0; i<sizeof(poly)/sizeof(poly[0]); i++) {
+		if(poly[i].order == order) return poly[i].tap;
+	}
+
+	return 0;
+}
+
+
+int prbs_valid(int order)
+{
+	return find_tap(order) > 0;
+}
+
+
+void prbs_gen_init(struct prbs_gen *g, int order)
+{
+	g->order = order;
+	g->tap = find_tap(order);
+	g->mask = (1u << order) - 1;
+	g->state = g->mask;
+}
+
+
+void prbs_gen_fill(struct prbs_gen *g, uint8_t *buf, size_t len)
+{
+	uint32_t s = g->state;
+	int o = g->order - 1;
+	int t = g->tap - 1;
+	size_t i;
+	int j;
+
+	for(i=0; i<len; i++) {
+		uint8_t c = 0;
+		for(j=0; j<8; j++) {
+			uint32_t b = ((s >> o) ^ (s >> t)) & 1;
+			s = ((s << 1) | b) & g->mask;
+			c |= b << j;
+		}
+		buf[i] = c;
+	}
+
+	g->state = s;
+}
+
+
+void prbs_check_init(struct prbs_check *c, int order)
+{
+	memset(c, 0, sizeof *c);
+	c->order = order;
+	c->tap = find_tap(order);
+	c->mask = (1u << order) - 1;
+}
+
+
+/*
+ * Reset the counters, keeping the checker in sync
+ */
+
+void prbs_check_clear(struct prbs_check *c)
+{
+	c->bits = 0;
+	c->errors = 0;
+	c->bursts = 0;
+	c->burst_len = 0;
+	c->burst_max = 0;
+	c->gap = BURST_GAP;
+	c->sync_losses = 0;
+}
+
+
+/*
+ * Errors are only counted once the checker has been in sync. Bursts are
+ * runs of errors separated by less than BURST_GAP clean bits; their
+ * length is measured from the first to the last errored bit.
+ */
+
+void prbs_check_feed(struct prbs_check *c, const uint8_t *buf, size_t len)
+{
+	uint32_t r = c->state;
+	int o = c->order - 1;
+	int t = c->tap - 1;
+	size_t i;
+	int j;
+
+	for(i=0; i<len; i++) {
+		for(j=0; j<8; j++) {
+			uint32_t b = (buf[i] >> j) & 1;
+			uint32_t err = (((r >> o) ^ (r >> t)) & 1) ^ b;
+			r = ((r << 1) | b) & c->mask;
+
+			if(!c->synced) {
+				if(err || r == 0) {
+					c->run = 0;
+				} else if(++c->run >= SYNC_BITS) {
+					c->synced = 1;
+					c->window = 0;
+					c->gap = BURST_GAP;
+				}
+				continue;
+			}
+
+			c->bits ++;
+			c->window = (c->window << 1) | err;
+
+			if(!err) {
+				c->gap ++;
+				continue;
+			}
+
+			c->errors ++;
+			if(c->gap >= BURST_GAP) {
+				c->bursts ++;
+				c->burst_len = 1;
+			} else {
+				c->burst_len += c->gap + 1;
+			}
+			if(c->burst_len > c->burst_max) c->burst_max = c->burst_len;
+			c->gap = 0;
+
+			if(__builtin_popcountll(c->window) >= SYNC_LOSS) {
+				c->synced = 0;
+				c->run = 0;
+				c->sync_losses ++;
+			}
+		}
+	}
+
+	c->state = r;
+}
+
+/*
+ * End
+ */
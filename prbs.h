@@ -0,0 +1,54 @@
+#ifndef prbs_h
+#define prbs_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ITU-T O.150 style pseudo random bit sequences. Bits are packed LSB
+ * first, matching the order in which a UART shifts them out.
+ */
+
+/*
+ * The checker counts every bit error on the line once per feedback tap
+ * it passes through, including the received bit itself
+ */
+
+#define PRBS_ERROR_MULT  3
+
+struct prbs_gen {
+	uint32_t state;
+	uint32_t mask;
+	int order;
+	int tap;
+};
+
+struct prbs_check {
+	uint32_t state;
+	uint32_t mask;
+	int order;
+	int tap;
+
+	int synced;
+	int run;
+	uint64_t window;
+
+	uint64_t bits;
+	uint64_t errors;
+	uint64_t bursts;
+	uint64_t burst_len;
+	uint64_t burst_max;
+	uint64_t gap;
+	uint64_t sync_losses;
+};
+
+int prbs_valid(int order);
+
+void prbs_gen_init(struct prbs_gen *g, int order);
+void prbs_gen_fill(struct prbs_gen *g, uint8_t *buf, size_t len);
+
+void prbs_check_init(struct prbs_check *c, int order);
+void prbs_check_feed(struct prbs_check *c, const uint8_t *buf, size_t len);
+void prbs_check_clear(struct prbs_check *c);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Export the contents of an iterm flight recorder file in chronological
+ * order. The ring is scanned for valid records, which are sorted by
+ * sequence number; the file header is only used for the summary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flightrec.h"
+
+struct entry {
+	uint64_t seq;
+	uint64_t off;
+};
+
+static struct entry *entries = NULL;
+static size_t n_entries = 0;
+static size_t n_alloc = 0;
+
+
+static void add_entry(const struct flightrec_rec *r, uint64_t off, void *user)
+{
+	if(n_entries == n_alloc) {
+		n_alloc = n_alloc ? n_alloc * 2 : 1024;
+		entries = realloc(entries, n_alloc * sizeof *entries);
+		if(entries == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	entries[n_entries].seq = r->seq;
+	entries[n_entries].off = off;
+	n_entries ++;
+}
+
+
+static int cmp_seq(const void *a, const void *b)
+{
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+
+static char *fmt_time(uint64_t ns, char *buf, size_t len)
+{
+	time_t t = ns / 1000000000ULL;
+	char tmp[32];
+
+	strftime(tmp, sizeof tmp, "%Y-%m-%d %H:%M:%S", localtime(&t));
+	snprintf(buf, len, "%s.%03d", tmp, (int)(ns / 1000000 % 1000));
+	return buf;
+}
+
+
+static void summary(const struct flightrec_hdr *h, const uint8_t *data)
+{
+	const struct flightrec_rec *first, *last;
+	uint64_t bytes = 0, lost = 0;
+	char t1[48], t2[48];
+	size_t i;
+
+	fprintf(stderr, "Ring size %llu bytes, last sync %s at record %llu\n",
+			(unsigned long long)h->data_size,
+			fmt_time(h->t_sync, t1, sizeof t1),
+			(unsigned long long)h->seq);
+
+	if(n_entries == 0) {
+		fprintf(stderr, "No records\n");
+		return;
+	}
+
+	for(i=0; i<n_entries; i++) {
+		const struct flightrec_rec *r = (const void *)(data + entries[i].off);
+		bytes += r->len;
+		if(i > 0) lost += entries[i].seq - entries[i-1].seq - 1;
+	}
+
+	first = (const void *)(data + entries[0].off);
+	last = (const void *)(data + entries[n_entries-1].off);
+
+	fprintf(stderr, "%zu records, %llu bytes, sequence %llu..%llu, %llu missing\n",
+			n_entries, (unsigned long long)bytes,
+			(unsigned long long)first->seq, (unsigned long long)last->seq,
+			(unsigned long long)lost);
+	fprintf(stderr, "From %s to %s\n", fmt_time(first->t, t1, sizeof t1), fmt_time(last->t, t2, sizeof t2));
+	if(last->seq >= h->seq) {
+		fprintf(stderr, "%llu records written after the last sync\n",
+				(unsigned long long)(last->seq - h->seq + 1));
+	}
+}
+
+
+static void usage(const char *fname)
+{
+	printf("usage: %s [-i] FILE\n", fname);
+	printf("\n");
+	printf("Write the contents of an iterm flight recorder file to stdout\n");
+	printf("\n");
+	printf("  -i        Show a summary of the file instead\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	const struct flightrec_hdr *h;
+	const uint8_t *map;
+	const uint8_t *data;
+	struct stat st;
+	int info = 0;
+	size_t i;
+	int fd;
+	int o;
+
+	while( (o = getopt(argc, argv, "hi")) != EOF) {
+		switch(o) {
+			case 'i':
+				info = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(0);
+		}
+	}
+
+	if(optind != argc - 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	if(st.st_size < FLIGHTREC_HDR_SIZE) {
+		fprintf(stderr, "%s: not a flight recorder file\n", argv[optind]);
+		exit(1);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	h = (const void *)map;
+	if(!flightrec_hdr_ok(h) || h->data_size != st.st_size - FLIGHTREC_HDR_SIZE) {
+		fprintf(stderr, "%s: not a flight recorder file\n", argv[optind]);
+		exit(1);
+	}
+
+	data = map + FLIGHTREC_HDR_SIZE;
+	flightrec_scan(data, h->data_size, add_entry, NULL);
+	qsort(entries, n_entries, sizeof *entries, cmp_seq);
+
+	if(info) {
+		summary(h, data);
+		return 0;
+	}
+
+	for(i=0; i<n_entries; i++) {
+		const struct flightrec_rec *r = (const void *)(data + entries[i].off);
+		fwrite(r + 1, 1, r->len, stdout);
+	}
+
+	return 0;
+}
+
+/*
+ * End
+ */
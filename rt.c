@@ -0,0 +1,142 @@
+/*
+ * Real-time mode. iterm is single threaded, so the serial read path is
+ * the whole process: it is moved to SCHED_FIFO, optionally pinned to one
+ * CPU, and its memory is locked. The stack and a heap reserve are faulted
+ * in before locking, and malloc is told to never give memory back or use
+ * separate mappings, so the data path does not take page faults later on.
+ *
+ * Every step is attempted on its own; a step that fails for lack of
+ * privileges is reported but the others still apply.
+ *
+ * The wakeup probe is a periodic mainloop timer that records how late it
+ * runs. This is the time between the kernel timer expiring and the
+ * mainloop getting the CPU, which is the same delay a serial read sees
+ * when data arrives.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+#include "clock.h"
+#include "mainloop.h"
+#include "rt.h"
+
+#define PREFAULT_STACK  (256 * 1024)
+#define PREFAULT_HEAP   (4 * 1024 * 1024)
+#define PROBE_MSEC      10
+
+static struct hist wakeup;
+static double t_probe;
+
+
+static void prefault_stack(void)
+{
+	volatile uint8_t buf[PREFAULT_STACK];
+	size_t i;
+
+	for(i=0; i<sizeof buf; i+=4096) buf[i] = 0;
+}
+
+
+static void prefault_heap(void)
+{
+	uint8_t *p;
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	p = malloc(PREFAULT_HEAP);
+	if(p) {
+		memset(p, 0, PREFAULT_HEAP);
+		free(p);
+	}
+}
+
+
+/*
+ * Locking future mappings makes later allocations fail once the memlock
+ * limit is reached, so that is only done without a limit
+ */
+
+static int lock_memory(void)
+{
+	struct rlimit rl;
+	int flags = MCL_CURRENT;
+
+	if(geteuid() == 0 || (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur == RLIM_INFINITY)) {
+		flags |= MCL_FUTURE;
+	}
+
+	return mlockall(flags) == 0 ? 0 : errno;
+}
+
+
+int rt_pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof set, &set) != 0) return errno;
+	return 0;
+}
+
+
+int rt_enable(int prio, int cpu, struct rt_result *r)
+{
+	struct sched_param sp;
+
+	memset(r, 0, sizeof *r);
+
+	prctl(PR_SET_TIMERSLACK, 1UL);
+
+	memset(&sp, 0, sizeof sp);
+	sp.sched_priority = prio;
+	if(sched_setscheduler(0, SCHED_FIFO, &sp) != 0) r->sched = errno;
+
+	if(cpu >= 0) r->affinity = rt_pin(cpu);
+
+	prefault_stack();
+	prefault_heap();
+	r->mlock = lock_memory();
+
+	return (r->sched || r->affinity || r->mlock) ? -1 : 0;
+}
+
+
+static int on_rt_probe(void *data)
+{
+	double t = mono_sec();
+	double late = t - t_probe - PROBE_MSEC * 1E-3;
+
+	hist_add(&wakeup, late > 0 ? late * 1E9 : 0);
+	t_probe = t;
+	return 1;
+}
+
+
+void rt_probe_start(void)
+{
+	hist_reset(&wakeup);
+	t_probe = mono_sec();
+	mainloop_timer_add(0, PROBE_MSEC, on_rt_probe, NULL);
+	mainloop_handler_name((void *)on_rt_probe, "rt_probe");
+}
+
+
+const struct hist *rt_wakeup(void)
+{
+	return &wakeup;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,21 @@
+#ifndef rt_h
+#define rt_h
+
+#include "hist.h"
+
+/*
+ * Outcome of rt_enable(), an errno value per step, 0 on success
+ */
+
+struct rt_result {
+	int sched;
+	int affinity;
+	int mlock;
+};
+
+int rt_pin(int cpu);
+int rt_enable(int prio, int cpu, struct rt_result *r);
+void rt_probe_start(void);
+const struct hist *rt_wakeup(void);
+
+#endif
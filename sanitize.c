@@ -0,0 +1,357 @@
+/*
+ * Streaming filter for device output, with one instance per sink so the
+ * screen and the log can be treated differently:
+ *
+ *  - escape sequences (CSI, OSC and two byte ESC sequences) and control
+ *    characters are passed, stripped, or shown in caret notation. The
+ *    'safe' mode only keeps SGR colour sequences. Sequences split over
+ *    chunks are handled by keeping the parser state in the instance.
+ *
+ *  - lines containing a log level keyword are coloured. A keyword can
+ *    only be seen once part of the line may have been printed already;
+ *    short lines are then redrawn from the start of the line with '\r',
+ *    longer ones are coloured from the current chunk on.
+ *
+ * Plain printable text is the common case. Runs of it are found with a
+ * SIMD scan for the next control character and copied as a whole.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sanitize.h"
+
+#define REDRAW_MAX 80
+
+enum {
+	ST_GROUND,
+	ST_ESC,
+	ST_CSI,
+	ST_OSC,
+	ST_OSC_ESC,
+};
+
+enum {
+	LEVEL_NONE,
+	LEVEL_WARN,
+	LEVEL_ERR,
+	LEVEL_PANIC,
+};
+
+static const struct {
+	const char *word;
+	size_t len;
+	int level;
+} keywords[] = {
+	{ "panic",   5, LEVEL_PANIC },
+	{ "PANIC",   5, LEVEL_PANIC },
+	{ "Oops",    4, LEVEL_PANIC },
+	{ "ERR",     3, LEVEL_ERR },
+	{ "error",   5, LEVEL_ERR },
+	{ "Error",   5, LEVEL_ERR },
+	{ "FATAL",   5, LEVEL_ERR },
+	{ "fatal",   5, LEVEL_ERR },
+	{ "WARN",    4, LEVEL_WARN },
+	{ "warning", 7, LEVEL_WARN },
+	{ "Warning", 7, LEVEL_WARN },
+};
+
+static const char *level_colour[] = { "", "\e[33m", "\e[31m", "\e[1;31m" };
+static const char *mode_name[] = { "raw", "safe", "strip", "escape" };
+
+
+int sanitize_parse_mode(const char *s)
+{
+	int i;
+
+	for(i=0; i<sizeof(mode_name)/sizeof(mode_name[0]); i++) {
+		if(strcasecmp(s, mode_name[i]) == 0) return i;
+	}
+
+	return -1;
+}
+
+
+const char *sanitize_mode_name(enum sanitize_mode mode)
+{
+	return mode_name[mode];
+}
+
+
+void sanitize_init(struct sanitize *s, enum sanitize_mode mode, int colour)
+{
+	memset(s, 0, sizeof *s);
+	s->mode = mode;
+	s->colour = colour;
+	s->redraw = 1;
+}
+
+
+/*
+ * Length of the run of bytes without control characters
+ */
+
+static size_t plain_run(const uint8_t *p, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i c1f = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, c1f), v), _mm_cmpeq_epi8(v, del));
+		int bits = _mm_movemask_epi8(m);
+		if(bits) return i + __builtin_ctz(bits);
+	}
+#endif
+
+	for(; i < n; i++) {
+		if(p[i] < 0x20 || p[i] == 0x7f) break;
+	}
+
+	return i;
+}
+
+
+static int scan_level(const void *p, size_t n, int level)
+{
+	int i;
+
+	for(i=0; i<sizeof(keywords)/sizeof(keywords[0]); i++) {
+		if(keywords[i].level > level && memmem(p, n, keywords[i].word, keywords[i].len)) {
+			level = keywords[i].level;
+		}
+	}
+
+	return level;
+}
+
+
+/*
+ * Check the part of the current line that was written to the output since
+ * 'seg' for keywords, and insert colour (and a redraw) in front of it if
+ * the level went up. Returns the new end of the output.
+ */
+
+static uint8_t *check_line(struct sanitize *s, uint8_t *seg, uint8_t *o)
+{
+	size_t n = o - seg;
+	size_t i;
+
+	if(n == 0) return o;
+
+	if(s->colour) {
+		char tmp[16];
+		size_t m = n < 7 ? n : 7;
+		int level;
+
+		memcpy(tmp, s->tail, s->tail_len);
+		memcpy(tmp + s->tail_len, seg, m);
+		level = scan_level(tmp, s->tail_len + m, s->level);
+		level = scan_level(seg, n, level);
+
+		if(level > s->level) {
+			const char *col = level_colour[level];
+			size_t cl = strlen(col);
+			int redraw = s->redraw && s->line_len > 0 && s->line_len + n <= REDRAW_MAX;
+			size_t pre = cl + (redraw ? 1 + s->line_len : 0);
+			uint8_t *p = seg;
+
+			memmove(seg + pre, seg, n);
+			if(redraw) *p++ = '\r';
+			memcpy(p, col, cl);
+			p += cl;
+			if(redraw) memcpy(p, s->line, s->line_len);
+
+			seg += pre;
+			o += pre;
+			s->level = level;
+		}
+	}
+
+	/* Remember the line so far for redraws and keywords split over chunks */
+
+	for(i=0; i<n && s->line_len < SANITIZE_LINE_MAX; i++) {
+		s->line[s->line_len++] = seg[i];
+	}
+	if(i < n) s->line_len = SANITIZE_LINE_MAX;
+
+	if(n >= 7) {
+		memcpy(s->tail, seg + n - 7, 7);
+		s->tail_len = 7;
+	} else {
+		size_t keep = s->tail_len + n > 7 ? 7 - n : s->tail_len;
+		memmove(s->tail, s->tail + s->tail_len - keep, keep);
+		memcpy(s->tail + keep, seg, n);
+		s->tail_len = keep + n;
+	}
+
+	return o;
+}
+
+
+static uint8_t *put_str(uint8_t *o, const char *str)
+{
+	size_t l = strlen(str);
+	memcpy(o, str, l);
+	return o + l;
+}
+
+
+static uint8_t *put_caret(uint8_t *o, uint8_t c)
+{
+	*o++ = '^';
+	*o++ = c ^ 0x40;
+	return o;
+}
+
+
+/*
+ * Output a byte that is part of an escape sequence
+ */
+
+static uint8_t *put_seq(struct sanitize *s, uint8_t *o, uint8_t c)
+{
+	switch(s->mode) {
+		case SANITIZE_RAW:
+			*o++ = c;
+			break;
+		case SANITIZE_ESCAPE:
+			if(c < 0x20 || c == 0x7f) {
+				o = put_caret(o, c);
+			} else {
+				*o++ = c;
+			}
+			break;
+		case SANITIZE_SAFE:
+			if(s->seq_len < SANITIZE_SEQ_MAX) s->seq[s->seq_len] = c;
+			s->seq_len ++;
+			break;
+		case SANITIZE_STRIP:
+			break;
+	}
+
+	return o;
+}
+
+
+static void end_seq(struct sanitize *s, uint8_t **o, int keep)
+{
+	if(s->mode == SANITIZE_SAFE && keep && s->seq_len <= SANITIZE_SEQ_MAX) {
+		memcpy(*o, s->seq, s->seq_len);
+		*o += s->seq_len;
+	}
+	s->seq_len = 0;
+	s->state = ST_GROUND;
+}
+
+
+size_t sanitize(struct sanitize *s, const uint8_t *src, size_t len, uint8_t *dst)
+{
+	uint8_t *o = dst;
+	uint8_t *seg;
+	size_t i = 0;
+
+	if(s->mode == SANITIZE_RAW && !s->colour) {
+		memcpy(dst, src, len);
+		return len;
+	}
+
+	if(s->level) o = put_str(o, level_colour[s->level]);
+	seg = o;
+
+	while(i < len) {
+
+		uint8_t c;
+
+		if(s->state == ST_GROUND) {
+			size_t n = plain_run(src + i, len - i);
+			memcpy(o, src + i, n);
+			o += n;
+			i += n;
+			if(i == len) break;
+		}
+
+		c = src[i++];
+
+		switch(s->state) {
+
+			case ST_GROUND:
+				if(c == 0x1b) {
+					s->state = ST_ESC;
+					o = put_seq(s, o, c);
+				} else if(c == '\n') {
+					o = check_line(s, seg, o);
+					if(s->level) o = put_str(o, "\e[0m");
+					*o++ = '\n';
+					s->level = LEVEL_NONE;
+					s->line_len = 0;
+					s->tail_len = 0;
+					seg = o;
+				} else if(c == '\r') {
+					o = check_line(s, seg, o);
+					*o++ = '\r';
+					s->line_len = 0;
+					seg = o;
+				} else if(c == '\t' || c == '\b' || s->mode == SANITIZE_RAW) {
+					*o++ = c;
+				} else if(s->mode == SANITIZE_ESCAPE) {
+					o = put_caret(o, c);
+				}
+				break;
+
+			case ST_ESC:
+				o = put_seq(s, o, c);
+				if(c == '[') {
+					s->state = ST_CSI;
+				} else if(c == ']') {
+					s->state = ST_OSC;
+				} else if(c != 0x1b) {
+					end_seq(s, &o, 0);
+				}
+				break;
+
+			case ST_CSI:
+				if(c == 0x1b) {
+					end_seq(s, &o, 0);
+					s->state = ST_ESC;
+					o = put_seq(s, o, c);
+					break;
+				}
+				o = put_seq(s, o, c);
+				if(c >= 0x40 && c <= 0x7e) end_seq(s, &o, c == 'm');
+				break;
+
+			case ST_OSC:
+				o = put_seq(s, o, c);
+				if(c == 0x07) end_seq(s, &o, 0);
+				if(c == 0x1b) s->state = ST_OSC_ESC;
+				break;
+
+			case ST_OSC_ESC:
+				o = put_seq(s, o, c);
+				if(c == '\\') {
+					end_seq(s, &o, 0);
+				} else if(c != 0x1b) {
+					s->state = ST_OSC;
+				}
+				break;
+		}
+	}
+
+	o = check_line(s, seg, o);
+	if(s->level) o = put_str(o, "\e[0m");
+
+	return o - dst;
+}
+
+/*
+ * End
+ */
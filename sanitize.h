@@ -0,0 +1,46 @@
+#ifndef sanitize_h
+#define sanitize_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum sanitize_mode {
+	SANITIZE_RAW,       /* pass everything */
+	SANITIZE_SAFE,      /* keep SGR colour sequences, strip the rest */
+	SANITIZE_STRIP,     /* strip all escape sequences and controls */
+	SANITIZE_ESCAPE,    /* show escape sequences and controls as ^X */
+};
+
+#define SANITIZE_LINE_MAX 256
+#define SANITIZE_SEQ_MAX  32
+
+/* Worst case output size for 'len' bytes of input */
+
+#define SANITIZE_MAX(len) ((len) * 8 + SANITIZE_LINE_MAX + 64)
+
+struct sanitize {
+	enum sanitize_mode mode;
+	int colour;
+	int redraw;
+
+	/* escape sequence parser */
+
+	int state;
+	uint8_t seq[SANITIZE_SEQ_MAX];
+	size_t seq_len;
+
+	/* current line, for keyword colouring */
+
+	int level;
+	char line[SANITIZE_LINE_MAX];
+	size_t line_len;
+	char tail[8];
+	size_t tail_len;
+};
+
+int sanitize_parse_mode(const char *s);
+const char *sanitize_mode_name(enum sanitize_mode mode);
+void sanitize_init(struct sanitize *s, enum sanitize_mode mode, int colour);
+size_t sanitize(struct sanitize *s, const uint8_t *src, size_t len, uint8_t *dst);
+
+#endif
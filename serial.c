@@ -12,6 +12,7 @@
 #include <linux/serial.h>
 
 #include "serial.h"
+#include "speed.h"
 
 
 struct speed {
@@ -68,12 +69,8 @@ int serial_open(char *dev, int baudrate, int rtscts, int xonxoff, int stopbits,
 
 	if(br == 0) br = B9600;
 
-	fd = open (dev, O_RDWR | O_NOCTTY);
-	
-	if (fd < 0) {
-		perror (dev);
-		exit (1);
-	}
+	fd = open (dev, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) return -1;
 
 	tios.c_cflag = br | CS8 | CLOCAL | CREAD;  
 	if(stopbits == 2) tios.c_cflag |= CSTOPB;
@@ -91,6 +88,46 @@ int serial_open(char *dev, int baudrate, int rtscts, int xonxoff, int stopbits,
 }
 
 
+/*
+ * Change the speed of an open port. Rates that are not in the speed list
+ * are set as custom rate; returns the actual rate or -1
+ */
+
+int serial_set_speed(int fd, int baudrate)
+{
+	struct termios tios;
+	int i;
+
+	for(i=0; i<sizeof(speed_list)/sizeof(speed_list[0]); i++) {
+		if(speed_list[i].speed == baudrate) {
+			if(tcgetattr(fd, &tios) != 0) return -1;
+			cfsetispeed(&tios, speed_list[i].bit);
+			cfsetospeed(&tios, speed_list[i].bit);
+			if(tcsetattr(fd, TCSANOW, &tios) != 0) return -1;
+			return baudrate;
+		}
+	}
+
+	return set_speed(fd, baudrate);
+}
+
+
+/*
+ * Copy the standard speeds, from low to high
+ */
+
+int serial_get_speed_list(int *rates, int max)
+{
+	int i;
+
+	for(i=0; i<max && i<sizeof(speed_list)/sizeof(speed_list[0]); i++) {
+		rates[i] = speed_list[i].speed;
+	}
+
+	return i;
+}
+
+
 int serial_get_speed(int fd)
 {
 	struct termios tios;
@@ -159,10 +196,53 @@ int serial_set_dtr(int fd, int state)
 
 int serial_get_mctrl(int fd)
 {
-	int status;
+	int status = 0;
 	ioctl(fd, TIOCMGET, &status);
 	return status;
 }
 
 
+/*
+ * Read the UART interrupt counters. Not all drivers implement this
+ * (pty's and most USB adapters don't), in which case -1 is returned
+ */
+
+int serial_get_icount(int fd, struct serial_icount *ic)
+{
+	struct serial_icounter_struct icount;
+
+	if(ioctl(fd, TIOCGICOUNT, &icount) != 0) return(-1);
+
+	ic->rx          = icount.rx;
+	ic->tx          = icount.tx;
+	ic->frame       = icount.frame;
+	ic->parity      = icount.parity;
+	ic->overrun     = icount.overrun;
+	ic->buf_overrun = icount.buf_overrun;
+	ic->brk         = icount.brk;
+
+	return(0);
+}
+
+
+/*
+ * Number of bytes waiting in the kernel input and output queues
+ */
+
+int serial_get_inq(int fd)
+{
+	int n;
+	if(ioctl(fd, TIOCINQ, &n) != 0) return(-1);
+	return n;
+}
+
+
+int serial_get_outq(int fd)
+{
+	int n;
+	if(ioctl(fd, TIOCOUTQ, &n) != 0) return(-1);
+	return n;
+}
+
+
 // end
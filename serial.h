@@ -1,7 +1,31 @@
+#ifndef serial_h
+#define serial_h
+
+#include <termios.h>
+
+/* Line error and transfer counters as kept by the tty driver */
+
+struct serial_icount {
+	int rx;
+	int tx;
+	int frame;
+	int parity;
+	int overrun;
+	int buf_overrun;
+	int brk;
+};
+
 /* serial.c */
 int serial_open(char *dev, int baudrate, int rtscts, int xonxoff, int stopbits, int parity);
 int serial_get_speed(int fd);
+int serial_set_speed(int fd, int baudrate);
+int serial_get_speed_list(int *rates, int max);
 int set_noncanonical(int fd, struct termios *save);
 int serial_set_dtr(int fd, int state);
 int serial_set_rts(int fd, int state);
 int serial_get_mctrl(int fd);
+int serial_get_icount(int fd, struct serial_icount *ic);
+int serial_get_inq(int fd);
+int serial_get_outq(int fd);
+
+#endif
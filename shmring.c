@@ -0,0 +1,474 @@
+/*
+ * Shared memory ring: RX and TX data published in a POSIX shared memory
+ * object, so any number of local tools can follow the port without a
+ * copy through a socket or pipe.
+ *
+ * There is one writer. It moves 'reserve' ahead before it overwrites
+ * part of the ring, writes the record in place and then publishes the
+ * new 'head' with a release store. Readers never block the writer: they
+ * read records where they are, and afterwards check 'reserve' to see if
+ * the writer came around in the meantime. A reader that was overrun
+ * skips ahead to 'head' and counts the bytes it lost.
+ *
+ * Readers that want to sleep register in 'waiters' and wait on the
+ * 'wake' futex; the writer only does the wake up syscall when someone is
+ * waiting, so publishing costs two atomic operations on an idle ring.
+ *
+ * Every reader takes a consumer slot in the header, where it publishes
+ * its read position and loss count for iterm to show. Slots of readers
+ * that died are reused; when all slots are taken a reader still works,
+ * it is just not listed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "clock.h"
+#include "shmring.h"
+
+static int fd = -1;
+static char shm_name[256];
+static struct shmring_hdr *hdr = NULL;
+static uint8_t *data;
+static uint64_t data_size;
+static uint64_t head;
+static uint64_t seq;
+
+
+static int futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+
+/*
+ * Shared memory names are '/name'; accept them without the slash too
+ */
+
+static void make_name(char *buf, size_t len, const char *name)
+{
+	snprintf(buf, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+
+int shmring_open(const char *name, uint64_t size)
+{
+	uint64_t total;
+	int r;
+
+	if(size < SHMRING_SIZE_MIN) size = SHMRING_SIZE_MIN;
+	data_size = SHMRING_SIZE_MIN;
+	while(data_size < size) data_size <<= 1;
+	total = SHMRING_HDR_SIZE + data_size;
+
+	make_name(shm_name, sizeof shm_name, name);
+
+	/*
+	 * Always start from a fresh object. Readers of an old one see it
+	 * closed, by the flag or because its writer is gone.
+	 */
+
+	shm_unlink(shm_name);
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if(fd < 0) return -1;
+
+	if(ftruncate(fd, total) != 0) goto err;
+
+	hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if(hdr == MAP_FAILED) {
+		hdr = NULL;
+		goto err;
+	}
+
+	data = (uint8_t *)hdr + SHMRING_HDR_SIZE;
+	head = 0;
+	seq = 0;
+
+	hdr->hdr_size = SHMRING_HDR_SIZE;
+	hdr->writer_pid = getpid();
+	hdr->data_size = data_size;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, SHMRING_MAGIC, sizeof hdr->magic);
+
+	return 0;
+
+err:
+	r = errno;
+	shm_unlink(shm_name);
+	close(fd);
+	fd = -1;
+	errno = r;
+	return -1;
+}
+
+
+/*
+ * Record the calling process as the writer, after a fork
+ */
+
+void shmring_owner(void)
+{
+	if(hdr) hdr->writer_pid = getpid();
+}
+
+
+static void write_rec(int dir, const uint8_t *buf, size_t len)
+{
+	struct shmring_rec *r;
+	size_t size = SHMRING_REC_SIZE(len);
+	uint64_t off = head & (data_size - 1);
+	uint64_t remain = data_size - off;
+
+	/* Records do not wrap; the rest of the ring is skipped */
+
+	if(remain < size) {
+		__atomic_store_n(&hdr->reserve, head + remain + size, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		if(remain >= sizeof *r) {
+			r = (struct shmring_rec *)(data + off);
+			r->len = remain - sizeof *r;
+			r->dir = SHMRING_PAD;
+		}
+		head += remain;
+		off = 0;
+	} else {
+		__atomic_store_n(&hdr->reserve, head + size, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	r = (struct shmring_rec *)(data + off);
+	r->len = len;
+	r->dir = dir;
+	r->pad = 0;
+	r->seq = seq;
+	r->t = real_nsec();
+	memcpy(r + 1, buf, len);
+
+	head += size;
+	seq ++;
+}
+
+
+void shmring_write(int dir, const uint8_t *buf, size_t len)
+{
+	if(hdr == NULL || len == 0) return;
+
+	while(len > 0) {
+		size_t n = len < SHMRING_REC_MAX ? len : SHMRING_REC_MAX;
+		write_rec(dir, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	hdr->seq = seq;
+	__atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST)) {
+		futex(&hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
+
+
+void shmring_close(void)
+{
+	if(hdr == NULL) return;
+
+	__atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+	futex(&hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+
+	shm_unlink(shm_name);
+	munmap(hdr, SHMRING_HDR_SIZE + data_size);
+	close(fd);
+	hdr = NULL;
+	fd = -1;
+}
+
+
+static int pid_alive(uint32_t pid)
+{
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * Number of live readers that took a slot, the largest distance any of
+ * them is behind the writer, and their losses added up
+ */
+
+int shmring_consumers(uint64_t *max_lag, uint64_t *lost)
+{
+	int i, n = 0;
+
+	*max_lag = 0;
+	*lost = 0;
+	if(hdr == NULL) return 0;
+
+	for(i=0; i<SHMRING_CONSUMERS; i++) {
+		struct shmring_consumer *c = &hdr->consumers[i];
+		uint32_t pid = __atomic_load_n(&c->pid, __ATOMIC_ACQUIRE);
+		uint64_t tail;
+
+		if(pid == 0 || !pid_alive(pid)) continue;
+
+		tail = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+		if(head - tail > *max_lag) *max_lag = head - tail;
+		*lost += __atomic_load_n(&c->lost, __ATOMIC_RELAXED);
+		n ++;
+	}
+
+	return n;
+}
+
+
+/*
+ * Client side
+ */
+
+static void claim_slot(struct shmring_client *c)
+{
+	uint32_t pid = getpid();
+	int i, pass;
+
+	/* Free slots first, then the ones of readers that are gone */
+
+	for(pass=0; pass<2; pass++) {
+		for(i=0; i<SHMRING_CONSUMERS; i++) {
+			struct shmring_consumer *s = &c->hdr->consumers[i];
+			uint32_t old = __atomic_load_n(&s->pid, __ATOMIC_RELAXED);
+
+			if(pass == 0 ? old != 0 : (old == 0 || pid_alive(old))) continue;
+
+			s->tail = c->tail;
+			s->lost = 0;
+			s->records = 0;
+			if(__atomic_compare_exchange_n(&s->pid, &old, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				c->slot = i;
+				return;
+			}
+		}
+	}
+}
+
+
+int shmring_attach(struct shmring_client *c, const char *name)
+{
+	char path[256];
+	struct stat st;
+	void *map;
+	uint64_t size;
+	int r;
+
+	memset(c, 0, sizeof *c);
+	c->fd = -1;
+	c->slot = -1;
+
+	make_name(path, sizeof path, name);
+	c->fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+	if(c->fd < 0) return -1;
+
+	if(fstat(c->fd, &st) != 0) goto err;
+	if(st.st_size < SHMRING_HDR_SIZE + SHMRING_SIZE_MIN) {
+		errno = EPROTO;
+		goto err;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if(map == MAP_FAILED) goto err;
+
+	c->hdr = map;
+	size = c->hdr->data_size;
+	if(memcmp(c->hdr->magic, SHMRING_MAGIC, sizeof c->hdr->magic) != 0 ||
+	   c->hdr->hdr_size != SHMRING_HDR_SIZE ||
+	   (size & (size - 1)) != 0 || SHMRING_HDR_SIZE + size != (uint64_t)st.st_size) {
+		munmap(map, st.st_size);
+		c->hdr = NULL;
+		errno = EPROTO;
+		goto err;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* Follow from the newest data on */
+
+	c->data = (uint8_t *)map + SHMRING_HDR_SIZE;
+	c->size = size;
+	c->tail = __atomic_load_n(&c->hdr->head, __ATOMIC_ACQUIRE);
+	claim_slot(c);
+
+	return 0;
+
+err:
+	r = errno;
+	close(c->fd);
+	c->fd = -1;
+	errno = r;
+	return -1;
+}
+
+
+void shmring_detach(struct shmring_client *c)
+{
+	if(c->hdr == NULL) return;
+
+	if(c->slot >= 0) {
+		__atomic_store_n(&c->hdr->consumers[c->slot].pid, 0, __ATOMIC_RELEASE);
+	}
+	munmap(c->hdr, SHMRING_HDR_SIZE + c->size);
+	close(c->fd);
+	c->hdr = NULL;
+	c->fd = -1;
+}
+
+
+static void publish(struct shmring_client *c)
+{
+	struct shmring_consumer *s;
+
+	if(c->slot < 0) return;
+
+	s = &c->hdr->consumers[c->slot];
+	__atomic_store_n(&s->tail, c->tail, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->lost, c->lost, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->records, c->records, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * True when nothing from 'pos' on was overwritten yet. The fence orders
+ * the reads of the record before the read of 'reserve': if any of them
+ * saw new data, 'reserve' is seen moved past it as well.
+ */
+
+static int intact(struct shmring_client *c, uint64_t pos)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&c->hdr->reserve, __ATOMIC_RELAXED) - pos <= c->size;
+}
+
+
+static void resync(struct shmring_client *c)
+{
+	uint64_t end = __atomic_load_n(&c->hdr->head, __ATOMIC_ACQUIRE);
+
+	c->lost += end - c->tail;
+	c->tail = end;
+	publish(c);
+}
+
+
+/*
+ * Next record, read in place, or NULL when the reader is up to date.
+ * The record stays valid until the writer comes around; call
+ * shmring_consume() after using it to find out if it did.
+ */
+
+const struct shmring_rec *shmring_peek(struct shmring_client *c)
+{
+	const struct shmring_rec *r;
+	uint64_t end, off, remain;
+	uint32_t len;
+	uint16_t dir;
+
+	for(;;) {
+		end = __atomic_load_n(&c->hdr->head, __ATOMIC_ACQUIRE);
+		if(c->tail == end) return NULL;
+
+		if(end - c->tail > c->size) {
+			resync(c);
+			continue;
+		}
+
+		off = c->tail & (c->size - 1);
+		remain = c->size - off;
+		if(remain < sizeof *r) {
+			c->tail += remain;
+			continue;
+		}
+
+		r = (const struct shmring_rec *)(c->data + off);
+		len = __atomic_load_n(&r->len, __ATOMIC_RELAXED);
+		dir = __atomic_load_n(&r->dir, __ATOMIC_RELAXED);
+		if(!intact(c, c->tail)) {
+			resync(c);
+			continue;
+		}
+
+		if(dir == SHMRING_PAD) {
+			c->tail += remain;
+			continue;
+		}
+
+		c->rec_size = SHMRING_REC_SIZE(len);
+		return r;
+	}
+}
+
+
+/*
+ * Done with the record from shmring_peek(). Returns 0 when it was intact
+ * all along, -1 when the writer overwrote it while it was being used;
+ * the reader then continues with the newest data.
+ */
+
+int shmring_consume(struct shmring_client *c)
+{
+	if(!intact(c, c->tail)) {
+		resync(c);
+		return -1;
+	}
+
+	c->tail += c->rec_size;
+	c->records ++;
+	publish(c);
+	return 0;
+}
+
+
+/*
+ * Wait for new data for at most 'timeout_ms', or forever when negative.
+ * Returns 1 when there is data, 0 otherwise.
+ */
+
+int shmring_wait(struct shmring_client *c, int timeout_ms)
+{
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	struct shmring_hdr *h = c->hdr;
+	uint32_t w;
+
+	__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+	w = __atomic_load_n(&h->wake, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) == c->tail && !shmring_closed(c)) {
+		futex(&h->wake, FUTEX_WAIT, w, timeout_ms < 0 ? NULL : &ts);
+	}
+	__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) != c->tail;
+}
+
+
+/*
+ * True when the writer closed the ring, or died without doing so
+ */
+
+int shmring_closed(struct shmring_client *c)
+{
+	if(__atomic_load_n(&c->hdr->closed, __ATOMIC_ACQUIRE)) return 1;
+	return !pid_alive(__atomic_load_n(&c->hdr->writer_pid, __ATOMIC_RELAXED));
+}
+
+/*
+ * End
+ */
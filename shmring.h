@@ -0,0 +1,99 @@
+#ifndef shmring_h
+#define shmring_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Layout of the shared memory ring: a header page followed by the data
+ * ring. Positions are byte counts since the start and never wrap; the
+ * offset in the ring is the position modulo the ring size.
+ *
+ * 'head' is the end of the last complete record. 'reserve' is moved
+ * ahead before a record is written, so everything before reserve minus
+ * the ring size may be overwritten at any time.
+ */
+
+#define SHMRING_MAGIC      "ITRMSHM1"
+#define SHMRING_HDR_SIZE   4096
+#define SHMRING_CONSUMERS  62
+#define SHMRING_SIZE_MIN   (1024 * 1024)
+#define SHMRING_REC_MAX    65536
+
+#define SHMRING_RX         0
+#define SHMRING_TX         1
+#define SHMRING_PAD        0xffff    /* rest of the ring is unused */
+
+struct shmring_consumer {
+	uint32_t pid;           /* 0 when the slot is free */
+	uint32_t pad;
+	uint64_t tail;          /* read position */
+	uint64_t lost;          /* bytes overwritten before they were read */
+	uint64_t records;
+	uint8_t pad2[32];
+} __attribute__((aligned(64)));
+
+struct shmring_hdr {
+	char magic[8];
+	uint32_t hdr_size;
+	uint32_t writer_pid;
+	uint64_t data_size;     /* a power of two */
+	uint64_t seq;           /* records written */
+	uint32_t closed;        /* set when the writer is gone */
+	uint8_t pad[28];
+
+	uint64_t head;
+	uint64_t reserve;
+	uint32_t wake;          /* futex, bumped on every publish */
+	uint32_t waiters;
+	uint8_t pad2[40];
+
+	struct shmring_consumer consumers[SHMRING_CONSUMERS];
+};
+
+struct shmring_rec {
+	uint32_t len;
+	uint16_t dir;           /* SHMRING_RX, SHMRING_TX or SHMRING_PAD */
+	uint16_t pad;
+	uint64_t seq;
+	uint64_t t;             /* ns since the epoch */
+};
+
+#define SHMRING_REC_SIZE(len) ((sizeof(struct shmring_rec) + (len) + 7) & ~(size_t)7)
+
+/* Writer, in iterm */
+
+int shmring_open(const char *name, uint64_t size);
+void shmring_owner(void);
+void shmring_write(int dir, const uint8_t *buf, size_t len);
+void shmring_close(void);
+int shmring_consumers(uint64_t *max_lag, uint64_t *lost);
+
+/*
+ * Client. Records are read in place: shmring_peek() returns the next one
+ * without copying, and shmring_consume() tells whether it was still
+ * intact after use. A client that falls behind by more than the ring
+ * size skips ahead to the newest data and counts the bytes it lost; the
+ * writer never waits for clients.
+ */
+
+struct shmring_client {
+	int fd;
+	struct shmring_hdr *hdr;
+	uint8_t *data;
+	uint64_t size;
+	uint64_t tail;
+	uint64_t rec_size;
+	uint64_t lost;
+	uint64_t records;
+	int slot;
+};
+
+int shmring_attach(struct shmring_client *c, const char *name);
+void shmring_detach(struct shmring_client *c);
+const struct shmring_rec *shmring_peek(struct shmring_client *c);
+int shmring_consume(struct shmring_client *c);
+int shmring_wait(struct shmring_client *c, int timeout_ms);
+int shmring_closed(struct shmring_client *c);
+
+#endif
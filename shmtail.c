@@ -0,0 +1,119 @@
+/*
+ * Follow the shared memory ring of a running iterm and write the data to
+ * stdout as it arrives. Records are written straight from the ring; the
+ * number of bytes lost because this reader fell behind is reported on
+ * stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+static volatile sig_atomic_t stop = 0;
+
+
+static void on_signal(int signo)
+{
+	stop = 1;
+}
+
+
+static void print_rec(const struct shmring_rec *r)
+{
+	time_t t = r->t / 1000000000ULL;
+	char tmp[32];
+
+	strftime(tmp, sizeof tmp, "%H:%M:%S", localtime(&t));
+	printf("%s.%06d %s %5u ", tmp, (int)(r->t / 1000 % 1000000),
+			r->dir == SHMRING_TX ? "tx" : "rx", r->len);
+	fwrite(r + 1, 1, r->len, stdout);
+	if(r->len == 0 || ((const uint8_t *)(r + 1))[r->len - 1] != '\n') putchar('\n');
+}
+
+
+static void usage(const char *fname)
+{
+	printf("usage: %s [-a] [-t] NAME\n", fname);
+	printf("\n");
+	printf("Follow the shared memory ring of iterm -m NAME and write the data to stdout\n");
+	printf("\n");
+	printf("  -a        Include data sent to the port\n");
+	printf("  -t        One line per record with time, direction and length\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	struct shmring_client c;
+	const struct shmring_rec *r;
+	uint64_t lost = 0;
+	int all = 0;
+	int lines = 0;
+	int o;
+
+	while( (o = getopt(argc, argv, "aht")) != EOF) {
+		switch(o) {
+			case 'a':
+				all = 1;
+				break;
+			case 't':
+				lines = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(0);
+		}
+	}
+
+	if(optind != argc - 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if(shmring_attach(&c, argv[optind]) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], errno == EPROTO ? "not an iterm ring" : strerror(errno));
+		exit(1);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while(!stop) {
+
+		while( (r = shmring_peek(&c)) != NULL) {
+			if(lines) {
+				if(all || r->dir == SHMRING_RX) print_rec(r);
+			} else {
+				if(all || r->dir == SHMRING_RX) fwrite(r + 1, 1, r->len, stdout);
+			}
+			if(shmring_consume(&c) != 0 && lines) printf("-- overrun\n");
+		}
+
+		if(c.lost != lost) {
+			fprintf(stderr, "%llu bytes lost\n", (unsigned long long)(c.lost - lost));
+			lost = c.lost;
+		}
+
+		if(shmring_closed(&c) && shmring_peek(&c) == NULL) break;
+
+		fflush(stdout);
+		shmring_wait(&c, 1000);
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%llu records, %llu bytes lost\n",
+			(unsigned long long)c.records, (unsigned long long)c.lost);
+	shmring_detach(&c);
+
+	return 0;
+}
+
+/*
+ * End
+ */
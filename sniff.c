@@ -0,0 +1,174 @@
+/*
+ * Two port line tap. Chunks read from either port are timestamped on the
+ * shared monotonic clock and queued per direction. The timestamp is an
+ * estimate of when the first byte of the chunk was on the wire: the read
+ * time minus the character time of the chunk.
+ *
+ * Chunks are released in timestamp order. The head of one queue can only
+ * be released when the other queue holds a later chunk, or when it is
+ * older than the reorder window: data from the other port that arrived
+ * earlier on the wire may still be on its way through the driver.
+ *
+ * A chunk starts a new frame when the direction changes, or when the line
+ * was idle for longer than the gap time since the previous chunk in the
+ * same direction.
+ */
+
+#include <string.h>
+
+#include "clock.h"
+#include "mainloop.h"
+#include "sniff.h"
+
+#define CHUNKS       1024
+#define DATA_SIZE    (256 * 1024)
+#define WINDOW       0.010
+#define FLUSH_MSEC   5
+
+struct chunk {
+	double t;
+	size_t off;
+	size_t len;
+};
+
+static struct queue {
+	struct chunk chunk[CHUNKS];
+	unsigned head;
+	unsigned tail;
+	uint8_t data[DATA_SIZE];
+	size_t d_head;
+	size_t d_tail;
+	double t_end;
+	double t_end_out;
+} q[2];
+
+static double char_time;
+static double gap;
+static int last_dir = -1;
+static int timer_running = 0;
+static void (*emit_fn)(int dir, double t, int newframe, const uint8_t *buf, size_t len);
+
+static int on_sniff_timer(void *data);
+
+
+void sniff_init(double ct, double g,
+		void (*emit)(int dir, double t, int newframe, const uint8_t *buf, size_t len))
+{
+	char_time = ct;
+	gap = g;
+	emit_fn = emit;
+	mainloop_handler_name((void *)on_sniff_timer, "sniff_timer");
+}
+
+
+static void release(int dir)
+{
+	struct queue *qu = &q[dir];
+	struct chunk *c = &qu->chunk[qu->tail % CHUNKS];
+	size_t off = c->off % DATA_SIZE;
+	size_t n1 = c->len;
+	int newframe;
+
+	newframe = dir != last_dir || c->t - qu->t_end_out > gap;
+
+	if(off + n1 > DATA_SIZE) n1 = DATA_SIZE - off;
+	emit_fn(dir, c->t, newframe, qu->data + off, n1);
+	if(n1 < c->len) emit_fn(dir, c->t + n1 * char_time, 0, qu->data, c->len - n1);
+
+	qu->t_end_out = c->t + c->len * char_time;
+	qu->d_tail += c->len;
+	qu->tail ++;
+	last_dir = dir;
+}
+
+
+/*
+ * Release all chunks that can be put in order; with 'all' set the window
+ * is ignored
+ */
+
+static void flush(int all)
+{
+	double t_limit = mono_sec() - WINDOW;
+
+	for(;;) {
+		int have0 = q[0].head != q[0].tail;
+		int have1 = q[1].head != q[1].tail;
+		int dir;
+
+		if(have0 && have1) {
+			dir = q[1].chunk[q[1].tail % CHUNKS].t < q[0].chunk[q[0].tail % CHUNKS].t;
+			release(dir);
+			continue;
+		}
+
+		if(have0 || have1) {
+			dir = have1;
+			if(!all && q[dir].chunk[q[dir].tail % CHUNKS].t > t_limit) break;
+		} else {
+			break;
+		}
+
+		release(dir);
+	}
+}
+
+
+static int on_sniff_timer(void *data)
+{
+	flush(0);
+	timer_running = q[0].head != q[0].tail || q[1].head != q[1].tail;
+	return timer_running;
+}
+
+
+void sniff_feed(int dir, const uint8_t *buf, size_t len)
+{
+	struct queue *qu = &q[dir & 1];
+	double t = mono_sec() - len * char_time;
+	struct chunk *c;
+	size_t i, off;
+
+	if(len == 0) return;
+	if(len > DATA_SIZE) len = DATA_SIZE;
+
+	/* Make room by releasing old data out of order if needed */
+
+	while(qu->head - qu->tail == CHUNKS || DATA_SIZE - (qu->d_head - qu->d_tail) < len) {
+		release(dir & 1);
+	}
+
+	if(t < qu->t_end) t = qu->t_end;
+	qu->t_end = t + len * char_time;
+
+	c = &qu->chunk[qu->head % CHUNKS];
+	c->t = t;
+	c->off = qu->d_head;
+	c->len = len;
+
+	off = qu->d_head % DATA_SIZE;
+	i = len;
+	if(off + i > DATA_SIZE) i = DATA_SIZE - off;
+	memcpy(qu->data + off, buf, i);
+	memcpy(qu->data, buf + i, len - i);
+
+	qu->d_head += len;
+	qu->head ++;
+
+	flush(0);
+
+	if(!timer_running) {
+		timer_running = 1;
+		mainloop_timer_add(0, FLUSH_MSEC, on_sniff_timer, NULL);
+	}
+}
+
+
+void sniff_flush(void)
+{
+	flush(1);
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,12 @@
+#ifndef sniff_h
+#define sniff_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+void sniff_init(double char_time, double gap,
+		void (*emit)(int dir, double t, int newframe, const uint8_t *buf, size_t len));
+void sniff_feed(int dir, const uint8_t *buf, size_t len);
+void sniff_flush(void);
+
+#endif
@@ -0,0 +1,83 @@
+
+/*
+ * Listening socket helper. The address is either a path to a unix
+ * socket, or [host]:port for a TCP socket (host defaults to 127.0.0.1)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sock.h"
+
+
+/*
+ * Create a non blocking listening socket, returns the fd or -1
+ */
+
+int sock_listen(const char *addr, int backlog, int *is_unix)
+{
+	int fd;
+	int r;
+	char *colon = strrchr(addr, ':');
+
+	if(colon == NULL) {
+
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof sun.sun_path, "%s", addr);
+		unlink(sun.sun_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0) return -1;
+		r = bind(fd, (struct sockaddr *)&sun, sizeof sun);
+		if(is_unix) *is_unix = 1;
+
+	} else {
+
+		struct sockaddr_in sin;
+		char host[64];
+		int one = 1;
+
+		snprintf(host, sizeof host, "%.*s", (int)(colon - addr), addr);
+
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(colon + 1));
+		if(inet_pton(AF_INET, host[0] ? host : "127.0.0.1", &sin.sin_addr) != 1) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0) return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		r = bind(fd, (struct sockaddr *)&sin, sizeof sin);
+		if(is_unix) *is_unix = 0;
+	}
+
+	if(r == 0) r = listen(fd, backlog);
+	if(r != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,6 @@
+#ifndef sock_h
+#define sock_h
+
+int sock_listen(const char *addr, int backlog, int *is_unix);
+
+#endif
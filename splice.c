@@ -0,0 +1,212 @@
+
+/*
+ * Zero copy transfer from the serial port to stdout and/or the log file.
+ *
+ * Data is spliced from the serial fd into an intermediate pipe. With two
+ * destinations it is duplicated into a second pipe with tee(), and each
+ * pipe is spliced into its destination. Whenever the kernel refuses a
+ * splice (tty drivers without splice support, files opened with
+ * O_APPEND), that leg falls back to plain read() and write().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "stats.h"
+#include "splice.h"
+
+#define CHUNK 65536
+
+static int fd_src = -1;
+static int fd_dst[2] = { -1, -1 };
+static int pipe_fd[2][2] = { { -1, -1 }, { -1, -1 } };
+static int can_splice_in = 1;
+static int can_splice_out[2] = { 1, 1 };
+static int n_dst = 0;
+static int log_dst = -1;
+
+#define SINK_ERR(i) ((i) == log_dst ? SPLICE_ELOG : SPLICE_EOUT)
+
+
+/*
+ * Move exactly len bytes from pipe p to its destination
+ */
+
+static int drain(int i, size_t len)
+{
+	uint8_t buf[CHUNK];
+	ssize_t r;
+
+	while(len > 0) {
+
+		if(can_splice_out[i]) {
+			r = splice(pipe_fd[i][0], NULL, fd_dst[i], NULL, len, SPLICE_F_MOVE);
+			if(r < 0 && errno == EINVAL) {
+				can_splice_out[i] = 0;
+				continue;
+			}
+			if(r > 0) stats.splice_bytes += r;
+		} else {
+			r = read(pipe_fd[i][0], buf, len < sizeof buf ? len : sizeof buf);
+			if(r > 0) {
+				ssize_t done = 0;
+				while(done < r) {
+					ssize_t w = write(fd_dst[i], buf + done, r - done);
+					if(w < 0 && errno == EINTR) continue;
+					if(w < 0) return -1;
+					done += w;
+				}
+				stats.copy_bytes += 2 * r;
+			}
+		}
+
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return -1;
+		len -= r;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Fallback when the source can not be spliced: read into user space and
+ * write to the destinations directly
+ */
+
+static int transfer_copy(void)
+{
+	static uint8_t buf[CHUNK];
+	ssize_t len;
+	int i;
+
+	len = read(fd_src, buf, sizeof buf);
+	if(len <= 0) return len;
+
+	stats.copy_bytes += len;
+
+	for(i=0; i<n_dst; i++) {
+		ssize_t done = 0;
+		while(done < len) {
+			ssize_t w = write(fd_dst[i], buf + done, len - done);
+			if(w < 0 && errno == EINTR) continue;
+			if(w < 0) return SINK_ERR(i);
+			done += w;
+		}
+		stats.copy_bytes += len;
+	}
+
+	return len;
+}
+
+
+/*
+ * Move one chunk of available data. Returns the number of bytes, 0 on
+ * end of file, -1 on an error reading the source, or SPLICE_EOUT or
+ * SPLICE_ELOG when writing that destination failed; errno tells why
+ */
+
+int splice_transfer(void)
+{
+	ssize_t len;
+
+	if(!can_splice_in) return transfer_copy();
+
+	len = splice(fd_src, NULL, pipe_fd[0][1], NULL, CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if(len < 0 && errno == EINVAL) {
+		can_splice_in = 0;
+		return transfer_copy();
+	}
+	if(len <= 0) return len;
+
+	stats.splice_bytes += len;
+
+	if(n_dst == 2) {
+		ssize_t done = 0;
+		while(done < len) {
+			ssize_t r = tee(pipe_fd[0][0], pipe_fd[1][1], len - done, 0);
+			if(r < 0 && errno == EINTR) continue;
+			if(r <= 0) return SINK_ERR(1);
+			done += r;
+		}
+		if(drain(1, len) != 0) return SINK_ERR(1);
+	}
+
+	if(drain(0, len) != 0) return SINK_ERR(0);
+
+	return len;
+}
+
+
+/*
+ * Set up splicing from fd_src to fd_out and fd_log, either of which may
+ * be -1
+ */
+
+int splice_open(int src, int fd_out, int fd_log)
+{
+	int i;
+
+	fd_src = src;
+	n_dst = 0;
+	log_dst = -1;
+	if(fd_out >= 0) fd_dst[n_dst++] = fd_out;
+	if(fd_log >= 0) {
+		log_dst = n_dst;
+		fd_dst[n_dst++] = fd_log;
+	}
+
+	for(i=0; i<n_dst; i++) {
+		if(pipe2(pipe_fd[i], O_CLOEXEC) != 0) return -1;
+		fcntl(pipe_fd[i][1], F_SETPIPE_SZ, CHUNK);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Continue with a new source, e.g. after the port was reopened
+ */
+
+void splice_set_source(int src)
+{
+	fd_src = src;
+	can_splice_in = 1;
+}
+
+
+/*
+ * Continue with a new log file, e.g. after log rotation. The caller
+ * closes the old one.
+ */
+
+int splice_set_log(int fd)
+{
+	if(log_dst < 0) return -1;
+
+	fd_dst[log_dst] = fd;
+	can_splice_out[log_dst] = 1;
+	return 0;
+}
+
+
+void splice_close(void)
+{
+	int i;
+
+	for(i=0; i<2; i++) {
+		if(pipe_fd[i][0] >= 0) close(pipe_fd[i][0]);
+		if(pipe_fd[i][1] >= 0) close(pipe_fd[i][1]);
+		pipe_fd[i][0] = pipe_fd[i][1] = -1;
+	}
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,15 @@
+#ifndef splice_h
+#define splice_h
+
+/* splice_transfer() results when writing a destination failed */
+
+#define SPLICE_EOUT  -2
+#define SPLICE_ELOG  -3
+
+int splice_open(int fd_src, int fd_out, int fd_log);
+int splice_transfer(void);
+void splice_set_source(int src);
+int splice_set_log(int fd);
+void splice_close(void);
+
+#endif
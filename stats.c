@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "clock.h"
+#include "serial.h"
+#include "stats.h"
+
+struct stats stats;
+
+
+/*
+ * Sample queue depths and error counters of the given serial port, and
+ * update the transfer rates. Returns the number of overruns (hardware
+ * and tty buffer) that occured since the previous sample.
+ */
+
+int stats_sample(int fd)
+{
+	struct serial_icount ic;
+	int overruns = 0;
+	double t = mono_sec();
+
+	stats.inq  = serial_get_inq(fd);
+	stats.outq = serial_get_outq(fd);
+	if(stats.inq  > stats.inq_peak)  stats.inq_peak  = stats.inq;
+	if(stats.outq > stats.outq_peak) stats.outq_peak = stats.outq;
+
+	if(serial_get_icount(fd, &ic) == 0) {
+		if(!stats.have_icount) {
+			stats.icount_base = ic;
+			stats.icount = ic;
+			stats.have_icount = 1;
+		}
+		overruns = (ic.overrun - stats.icount.overrun) +
+		           (ic.buf_overrun - stats.icount.buf_overrun);
+		stats.icount = ic;
+	}
+
+	if(stats.t_rate == 0) {
+		stats.t_rate = t;
+		stats.rx_bytes_prev = stats.rx_bytes;
+		stats.tx_bytes_prev = stats.tx_bytes;
+	}
+
+	double dt = t - stats.t_rate;
+
+	if(dt >= 1.0) {
+		stats.rx_rate = (stats.rx_bytes - stats.rx_bytes_prev) / dt;
+		stats.tx_rate = (stats.tx_bytes - stats.tx_bytes_prev) / dt;
+		if(stats.rx_rate > stats.rx_peak) stats.rx_peak = stats.rx_rate;
+		if(stats.tx_rate > stats.tx_peak) stats.tx_peak = stats.tx_rate;
+		stats.rx_bytes_prev = stats.rx_bytes;
+		stats.tx_bytes_prev = stats.tx_bytes;
+		stats.t_rate = t;
+	}
+
+	return overruns;
+}
+
+
+/*
+ * Get the error counters accumulated over the session
+ */
+
+void stats_get_errors(struct serial_icount *ic)
+{
+	*ic = stats.icount_acc;
+
+	if(stats.have_icount) {
+		ic->rx          += stats.icount.rx          - stats.icount_base.rx;
+		ic->tx          += stats.icount.tx          - stats.icount_base.tx;
+		ic->frame       += stats.icount.frame       - stats.icount_base.frame;
+		ic->parity      += stats.icount.parity      - stats.icount_base.parity;
+		ic->overrun     += stats.icount.overrun     - stats.icount_base.overrun;
+		ic->buf_overrun += stats.icount.buf_overrun - stats.icount_base.buf_overrun;
+		ic->brk         += stats.icount.brk         - stats.icount_base.brk;
+	}
+}
+
+
+/*
+ * The port was closed; keep the error counts so far, the counters of a
+ * reopened device start from scratch
+ */
+
+void stats_port_reset(void)
+{
+	stats_get_errors(&stats.icount_acc);
+	stats.have_icount = 0;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,64 @@
+#ifndef stats_h
+#define stats_h
+
+#include <stdint.h>
+
+#include "serial.h"
+
+struct stats {
+
+	/* Transfer counters, updated from the data path */
+
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_reads;
+	uint64_t tx_writes;
+	uint64_t log_bytes;
+	uint64_t log_pending;
+	uint64_t modem_transitions;
+	uint64_t reconnects;
+	uint64_t render_skipped;
+	uint64_t render_backlog;
+	uint64_t splice_bytes;
+	uint64_t copy_bytes;
+	uint64_t json_dropped;
+	uint64_t tx_pace_holds;
+	uint64_t tx_queued;
+	uint64_t rx_coalesced;
+	uint64_t io_switches;
+
+	/* Rates in bytes/sec, recalculated once per second */
+
+	double rx_rate;
+	double tx_rate;
+	double rx_peak;
+	double tx_peak;
+
+	/* Kernel queue depths at the last sample */
+
+	int inq;
+	int outq;
+	int inq_peak;
+	int outq_peak;
+
+	/* UART error counters, if supported by the driver */
+
+	int have_icount;
+	struct serial_icount icount;
+	struct serial_icount icount_base;
+	struct serial_icount icount_acc;
+
+	/* private */
+
+	double t_rate;
+	uint64_t rx_bytes_prev;
+	uint64_t tx_bytes_prev;
+};
+
+extern struct stats stats;
+
+int stats_sample(int fd);
+void stats_get_errors(struct serial_icount *ic);
+void stats_port_reset(void);
+
+#endif
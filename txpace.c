@@ -0,0 +1,245 @@
+/*
+ * Transmit pacing. Outgoing data is queued and released from a mainloop
+ * timer, every byte at its own due time:
+ *
+ *   interval = max(character time + char delay, 1 / rate)
+ *
+ * with the line delay added after each newline. The kernel output queue
+ * is kept just deep enough to cover the timer granularity: when TIOCOUTQ
+ * reports more than that, the link is slower than planned (flow control,
+ * a busy target) and the schedule is shifted instead of piling up data
+ * in the driver, where the delays would be lost.
+ *
+ * When the queue drains, the achieved duration is compared to the
+ * planned one (including shifts caused by holds), and the lateness of
+ * the individual bytes is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "mainloop.h"
+#include "hist.h"
+#include "stats.h"
+#include "txpace.h"
+
+#define QUEUE_SIZE  65536
+#define BATCH_MAX   1024
+#define TICK        0.001
+
+static double char_delay;
+static double line_delay;
+static double rate;
+static double char_time = 10.0 / 115200;
+
+static void (*send_fn)(const uint8_t *buf, size_t len);
+static int (*outq_fn)(void);
+static void (*done_fn)(const struct txpace_report *r);
+
+static uint8_t queue[QUEUE_SIZE];
+static size_t q_head;
+static size_t q_tail;
+
+static int running = 0;
+static double t_next;
+static double t_first;
+static double t_last;
+static double due_first;
+static double due_last;
+static uint64_t bytes;
+static uint64_t holds;
+static struct hist late;
+
+static int on_txpace_timer(void *data);
+
+
+/*
+ * Parse a pacing spec: comma separated char=MS, line=MS and rate=BYTES/S,
+ * or 'off'
+ */
+
+int txpace_set(const char *spec)
+{
+	double c = 0, l = 0, r = 0;
+	const char *p = spec;
+
+	if(strcmp(spec, "off") != 0) {
+		while(*p) {
+			char *end;
+			if(strncmp(p, "char=", 5) == 0) {
+				c = strtod(p + 5, &end) * 1E-3;
+			} else if(strncmp(p, "line=", 5) == 0) {
+				l = strtod(p + 5, &end) * 1E-3;
+			} else if(strncmp(p, "rate=", 5) == 0) {
+				r = strtod(p + 5, &end);
+				if(*end == 'k') { r *= 1E3; end ++; }
+			} else {
+				return -1;
+			}
+			if(*end != ',' && *end != '\0') return -1;
+			p = *end ? end + 1 : end;
+		}
+		if(c < 0 || l < 0 || r < 0) return -1;
+	}
+
+	char_delay = c;
+	line_delay = l;
+	rate = r;
+
+	return 0;
+}
+
+
+int txpace_enabled(void)
+{
+	return char_delay > 0 || line_delay > 0 || rate > 0;
+}
+
+
+void txpace_describe(char *buf, size_t len)
+{
+	snprintf(buf, len, "char %.3g ms, line %.3g ms, rate %.0f B/s",
+			char_delay * 1E3, line_delay * 1E3, rate);
+}
+
+
+void txpace_set_line(int baudrate, int bits_per_char)
+{
+	if(baudrate > 0) char_time = (double)bits_per_char / baudrate;
+}
+
+
+void txpace_start(void (*send)(const uint8_t *buf, size_t len), int (*outq)(void),
+		void (*done)(const struct txpace_report *r))
+{
+	send_fn = send;
+	outq_fn = outq;
+	done_fn = done;
+	mainloop_handler_name((void *)on_txpace_timer, "txpace_timer");
+}
+
+
+size_t txpace_queued(void)
+{
+	return q_head - q_tail;
+}
+
+
+static void schedule(double t)
+{
+	double dt = t_next - t;
+	int ms = dt > TICK ? (int)(dt * 1E3 + 0.999) : 1;
+
+	mainloop_timer_add(ms / 1000, ms % 1000, on_txpace_timer, NULL);
+}
+
+
+static void finish(void)
+{
+	struct txpace_report r;
+
+	running = 0;
+
+	r.bytes    = bytes;
+	r.holds    = holds;
+	r.elapsed  = t_last - t_first;
+	r.target   = due_last - due_first;
+	r.late_p50 = hist_percentile(&late, 50);
+	r.late_p99 = hist_percentile(&late, 99);
+	r.late_max = late.max;
+
+	if(done_fn) done_fn(&r);
+}
+
+
+static int on_txpace_timer(void *data)
+{
+	uint8_t buf[BATCH_MAX];
+	size_t n = 0;
+	double t = mono_sec();
+	double interval = char_time + char_delay;
+	int limit = TICK * 2 / char_time + 2;
+	int outq = outq_fn ? outq_fn() : 0;
+
+	if(rate > 0 && 1.0 / rate > interval) interval = 1.0 / rate;
+	if(limit > BATCH_MAX) limit = BATCH_MAX;
+
+	if(outq < 0) {
+		t_next = t + 0.1;
+		schedule(t);
+		return 0;
+	}
+
+	if(outq > limit) {
+		double t_drain = t + (outq - limit) * char_time;
+		if(t_drain > t_next) t_next = t_drain;
+		holds ++;
+		stats.tx_pace_holds ++;
+		schedule(t);
+		return 0;
+	}
+
+	while(q_tail != q_head && t_next <= t && n < limit - outq) {
+		uint8_t c = queue[q_tail++ % QUEUE_SIZE];
+		double dt = interval + (c == '\n' ? line_delay : 0);
+		buf[n++] = c;
+		hist_add(&late, (t - t_next) * 1E9);
+		if(bytes + n == 1) {
+			t_first = t;
+			due_first = t_next;
+		}
+		due_last = t_next;
+		t_next += dt;
+	}
+
+	if(n > 0) {
+		bytes += n;
+		t_last = t;
+		send_fn(buf, n);
+	}
+
+	stats.tx_queued = q_head - q_tail;
+
+	if(q_tail == q_head) {
+		finish();
+	} else {
+		schedule(t);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Queue data for transmission, returns the number of bytes accepted
+ */
+
+size_t txpace_write(const uint8_t *buf, size_t len)
+{
+	size_t i;
+	size_t room = QUEUE_SIZE - (q_head - q_tail);
+
+	if(len > room) len = room;
+
+	for(i=0; i<len; i++) {
+		queue[q_head++ % QUEUE_SIZE] = buf[i];
+	}
+	stats.tx_queued = q_head - q_tail;
+
+	if(!running && len > 0) {
+		running = 1;
+		t_next = mono_sec();
+		bytes = 0;
+		holds = 0;
+		hist_reset(&late);
+		on_txpace_timer(NULL);
+	}
+
+	return len;
+}
+
+/*
+ * End
+ */
@@ -0,0 +1,26 @@
+#ifndef txpace_h
+#define txpace_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct txpace_report {
+	uint64_t bytes;
+	uint64_t holds;
+	double elapsed;
+	double target;
+	uint64_t late_p50;
+	uint64_t late_p99;
+	uint64_t late_max;
+};
+
+int txpace_set(const char *spec);
+int txpace_enabled(void);
+void txpace_describe(char *buf, size_t len);
+void txpace_set_line(int baudrate, int bits_per_char);
+void txpace_start(void (*send)(const uint8_t *buf, size_t len), int (*outq)(void),
+		void (*done)(const struct txpace_report *r));
+size_t txpace_write(const uint8_t *buf, size_t len);
+size_t txpace_queued(void);
+
+#endif
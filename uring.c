@@ -0,0 +1,261 @@
+/*
+ * Minimal io_uring access through the raw system calls: ring setup,
+ * submission and completion queue handling, the opcode probe and
+ * provided buffer rings. Only what the mainloop backend needs.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(int fd, unsigned submit, unsigned wait_nr, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait_nr, flags, arg, argsz);
+}
+
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+static void probe(struct uring *u)
+{
+	struct {
+		struct io_uring_probe p;
+		struct io_uring_probe_op ops[64];
+	} pr;
+	int i;
+
+	memset(&pr, 0, sizeof pr);
+	if(sys_register(u->fd, IORING_REGISTER_PROBE, &pr, 64) != 0) return;
+
+	for(i=0; i<pr.p.ops_len && i<64; i++) {
+		if(pr.ops[i].flags & IO_URING_OP_SUPPORTED) u->ops[pr.ops[i].op] = 1;
+	}
+}
+
+
+int uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(u, 0, sizeof *u);
+	memset(&p, 0, sizeof p);
+
+	u->fd = sys_setup(entries, &p);
+	if(u->fd < 0) return -1;
+
+	u->features = p.features;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if(u->features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ring == MAP_FAILED) goto err;
+
+	if(u->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if(u->cq_ring == MAP_FAILED) goto err_sq;
+	}
+
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) goto err_cq;
+
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+
+	u->sq_head  = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_local = *u->sq_tail;
+
+	u->cq_head  = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	probe(u);
+	return 0;
+
+err_cq:
+	if(u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+err_sq:
+	munmap(u->sq_ring, u->sq_ring_size);
+err:
+	close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+
+void uring_exit(struct uring *u)
+{
+	if(u->fd < 0) return;
+
+	munmap(u->sqes, u->sqes_size);
+	if(u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+
+/*
+ * Get a zeroed submission entry, or NULL when the queue is full and
+ * needs to be submitted first
+ */
+
+struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if(u->sq_local - head > u->sq_mask) return NULL;
+
+	sqe = &u->sqes[u->sq_local & u->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[u->sq_local & u->sq_mask] = u->sq_local & u->sq_mask;
+	u->sq_local ++;
+	return sqe;
+}
+
+
+/*
+ * Submit all queued entries and wait for at least wait_nr completions,
+ * at most until the timeout. Returns 0 or -errno; a timeout is not an
+ * error.
+ */
+
+int uring_enter(struct uring *u, unsigned wait_nr, const struct timespec *ts)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec kts;
+	unsigned flags = 0;
+	unsigned submit;
+	int r;
+
+	submit = u->sq_local - *u->sq_tail;
+	__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+	if(wait_nr) flags |= IORING_ENTER_GETEVENTS;
+
+	memset(&arg, 0, sizeof arg);
+	if(ts) {
+		kts.tv_sec = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+		arg.ts = (uintptr_t)&kts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	if(submit == 0 && wait_nr == 0) return 0;
+
+	u->enters ++;
+	r = sys_enter(u->fd, submit, wait_nr, flags, ts ? &arg : NULL, ts ? sizeof arg : 0);
+	if(r < 0) return errno == ETIME ? 0 : -errno;
+
+	u->sqes_submitted += r;
+	return 0;
+}
+
+
+struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+
+void uring_cqe_seen(struct uring *u)
+{
+	u->cqes_seen ++;
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+int uring_op_supported(struct uring *u, int op)
+{
+	return op >= 0 && op < 64 && u->ops[op];
+}
+
+
+/*
+ * Provided buffer rings: the kernel picks a buffer from the ring for
+ * every read completion, the application hands it back when done
+ */
+
+struct io_uring_buf_ring *uring_buf_ring(struct uring *u, unsigned entries, int bgid)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_buf_ring *br;
+	size_t size = entries * sizeof(struct io_uring_buf);
+
+	br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(br == MAP_FAILED) return NULL;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+
+	if(sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		munmap(br, size);
+		return NULL;
+	}
+
+	return br;
+}
+
+
+void uring_buf_ring_free(struct uring *u, struct io_uring_buf_ring *br, unsigned entries, int bgid)
+{
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof reg);
+	reg.bgid = bgid;
+	sys_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(br, entries * sizeof(struct io_uring_buf));
+}
+
+
+void uring_buf_add(struct io_uring_buf_ring *br, unsigned entries, void *addr, unsigned len, int bid)
+{
+	uint16_t tail = br->tail;
+	struct io_uring_buf *b = &br->bufs[tail & (entries - 1)];
+
+	b->addr = (uintptr_t)addr;
+	b->len = len;
+	b->bid = bid;
+	__atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * End
+ */
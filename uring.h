@@ -0,0 +1,55 @@
+#ifndef uring_h
+#define uring_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/io_uring.h>
+
+/* Not in older kernel headers, probed at run time */
+
+#define URING_OP_READ_MULTISHOT 49
+
+struct uring {
+	int fd;
+	unsigned features;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	uint8_t ops[64];
+
+	unsigned long long enters;
+	unsigned long long sqes_submitted;
+	unsigned long long cqes_seen;
+};
+
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+
+struct io_uring_sqe *uring_sqe(struct uring *u);
+int uring_enter(struct uring *u, unsigned wait_nr, const struct timespec *ts);
+struct io_uring_cqe *uring_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+int uring_op_supported(struct uring *u, int op);
+
+struct io_uring_buf_ring *uring_buf_ring(struct uring *u, unsigned entries, int bgid);
+void uring_buf_ring_free(struct uring *u, struct io_uring_buf_ring *br, unsigned entries, int bgid);
+void uring_buf_add(struct io_uring_buf_ring *br, unsigned entries, void *addr, unsigned len, int bid);
+
+#endif